@@ -66,6 +66,24 @@ enum mqtt5_error_reason_code {
  */
 typedef struct mqtt5_user_property_list_t *mqtt5_user_property_handle_t;
 
+/**
+ *  MQTT5 user properties of a received packet, read in place from the packet by esp_mqtt5_user_property_view_next()
+ */
+typedef struct {
+    const uint8_t *properties;          /*!< Property block of the packet, NULL if the packet has no properties */
+    size_t properties_len;              /*!< Property block length */
+} esp_mqtt5_user_property_view_t;
+
+/**
+ *  MQTT5 user property of a received packet, the key and value point into the packet and are not null-terminated
+ */
+typedef struct {
+    const char *key;                    /*!< Item key name */
+    uint16_t key_len;                   /*!< Item key name length */
+    const char *value;                  /*!< Item value string */
+    uint16_t value_len;                 /*!< Item value string length */
+} esp_mqtt5_user_property_ref_t;
+
 /**
  *  MQTT5 protocol connect properties and will properties configuration, more details refer to MQTT5 protocol document section 3.1.2.11 and 3.3.2.3
  */
@@ -85,6 +103,13 @@ typedef struct {
     const char *correlation_data;                /*!< Binary data for receiver to match the response message */
     uint16_t correlation_data_len;               /*!< The length of correlation data */
     mqtt5_user_property_handle_t will_user_property;  /*!< The handle for will message user property, call function esp_mqtt5_client_set_user_property to set it */
+    bool auto_topic_alias;                       /*!< Assign topic aliases to the published topics automatically, up to the topic alias maximum
+                                                      of the server (see CONFIG_MQTT5_OUTBOUND_TOPIC_ALIAS_MAX). The topic is sent with its alias
+                                                      on first use after each connection, then only the alias. Applies to messages sent by
+                                                      esp_mqtt_client_publish() and QoS 0 messages of esp_mqtt_client_publish_async(), which
+                                                      don't set their own topic alias */
+    bool user_property_view_only;                /*!< Don't copy the user properties of received packets into the `user_property` list of events,
+                                                      event handlers read them from `user_property_view` instead */
 } esp_mqtt5_connection_property_config_t;
 
 /**
@@ -145,6 +170,7 @@ typedef struct {
     int content_type_len;               /*!< Content type length of the message */
     uint16_t subscribe_id;              /*!< Subscription identifier of the message */
     mqtt5_user_property_handle_t user_property;  /*!< The handle for user property, call function esp_mqtt5_client_delete_user_property to free the memory */
+    esp_mqtt5_user_property_view_t user_property_view; /*!< User properties of the received packet, valid only within the event handler */
 } esp_mqtt5_event_property_t;
 
 /**
@@ -279,6 +305,35 @@ uint8_t esp_mqtt5_client_get_user_property_count(mqtt5_user_property_handle_t us
  * This API will free the memory in user property list and free user_property itself
  */
 void esp_mqtt5_client_delete_user_property(mqtt5_user_property_handle_t user_property);
+
+/**
+ * @brief Get the next user property of a received packet
+ *
+ * The user properties are read in place, without any allocation, e.g.:
+ * `size_t offset = 0; while (esp_mqtt5_user_property_view_next(&event->property->user_property_view, &offset, &item)) { ... }`
+ *
+ * @param view                     user properties of the received packet
+ * @param offset                   iteration position, zero for the first user property
+ * @param item                     the user property, pointing into the packet
+ *
+ * @return true if a user property was found, false at the end of the properties
+ */
+bool esp_mqtt5_user_property_view_next(const esp_mqtt5_user_property_view_t *view, size_t *offset, esp_mqtt5_user_property_ref_t *item);
+
+/**
+ * @brief Copy the user properties of a received packet into a user property list
+ *
+ * This API will allocate memory for user_property, please DO NOT forget `call esp_mqtt5_client_delete_user_property`
+ * after you use it.
+ *
+ * @param view                     user properties of the received packet
+ * @param user_property            user_property handle, NULL if the packet has no user properties
+ *
+ * @return ESP_ERR_NO_MEM if failed to allocate
+ *         ESP_ERR_INVALID_ARG on wrong initialization
+ *         ESP_OK on success
+ */
+esp_err_t esp_mqtt5_user_property_view_copy(const esp_mqtt5_user_property_view_t *view, mqtt5_user_property_handle_t *user_property);
 #ifdef __cplusplus
 }
 #endif //__cplusplus
@@ -143,6 +143,104 @@ typedef enum esp_mqtt_protocol_ver_t {
     MQTT_PROTOCOL_V_5,
 } esp_mqtt_protocol_ver_t;
 
+/**
+ *  Policy applied when a new message would exceed the outbox size limit.
+ *  Only publish messages are dropped to make room for the new one.
+ */
+typedef enum esp_mqtt_outbox_overflow_policy_t {
+    MQTT_OUTBOX_OVERFLOW_REJECT_NEW = 0,          /*!< The new message is rejected, publish/enqueue returns -2 */
+    MQTT_OUTBOX_OVERFLOW_DROP_OLDEST,             /*!< The oldest message is dropped */
+    MQTT_OUTBOX_OVERFLOW_DROP_LOWEST_QOS,         /*!< The oldest message of the lowest QoS is dropped */
+    MQTT_OUTBOX_OVERFLOW_DROP_EXPIRING_SOONEST,   /*!< The message closest to its expiry is dropped, considering
+                                                       both the outbox expiry and its own expiry
+                                                       (see esp_mqtt_publish_options_t) */
+} esp_mqtt_outbox_overflow_policy_t;
+
+/**
+ *  Priority class of an outbound message. Queued messages of higher classes are sent first,
+ *  lower classes gain priority while waiting (see CONFIG_MQTT_OUTBOX_PRIORITY_AGING_MS).
+ */
+typedef enum esp_mqtt_priority_t {
+    MQTT_PRIORITY_DEFAULT = 0,  /*!< Selects MQTT_PRIORITY_NORMAL, so that zeroed publish options keep the default class */
+    MQTT_PRIORITY_CONTROL,      /*!< Protocol messages (subscribe, unsubscribe, ...), could be used for command responses */
+    MQTT_PRIORITY_HIGH,         /*!< Urgent messages, e.g. alarms */
+    MQTT_PRIORITY_NORMAL,       /*!< Default class of published messages */
+    MQTT_PRIORITY_BULK,         /*!< Messages which could wait, e.g. telemetry backlog */
+    MQTT_PRIORITY_MAX,
+} esp_mqtt_priority_t;
+
+/**
+ *  Outcome of an asynchronous publish, see esp_mqtt_client_publish_async()
+ */
+typedef enum esp_mqtt_publish_status_t {
+    MQTT_PUBLISH_STATUS_SENT = 0,       /*!< QoS 0 message was written to the transport */
+    MQTT_PUBLISH_STATUS_ACKNOWLEDGED,   /*!< QoS 1 message was acknowledged by PUBACK, QoS 2 message by PUBCOMP */
+    MQTT_PUBLISH_STATUS_EXPIRED,        /*!< Message expired in the outbox before being acknowledged */
+    MQTT_PUBLISH_STATUS_DROPPED,        /*!< Message was dropped, i.e. it couldn't be created or stored, it was evicted
+                                             by the outbox overflow policy, replaced by a coalesced message, it was
+                                             a QoS 0 message while disconnected or the client was stopped */
+} esp_mqtt_publish_status_t;
+
+/**
+ * Options of a single publish, see esp_mqtt_client_publish_with_options()
+ * and esp_mqtt_client_enqueue_with_options()
+ *
+ * Initialize it with ESP_MQTT_PUBLISH_OPTIONS_DEFAULT(), a zeroed structure selects the same defaults.
+ */
+typedef struct esp_mqtt_publish_options_t {
+    uint32_t expiry_ms; /*!< Outbox expiry in milliseconds from enqueueing the message, 0 to use the default.
+                         The message is deleted from the outbox once the expiry elapses, even before the global
+                         outbox expiry timeout. It overrides the message expiry interval of the MQTT5 publish
+                         property, which is otherwise used as the expiry. If the message carries the MQTT5
+                         message expiry interval, it's rewritten to the remaining time whenever it's resent. */
+    bool coalesce;  /*!< Last-value-wins: while the message waits in the outbox to be transmitted, a newer message
+                         on the same topic, also published with this option, replaces it instead of being queued
+                         behind it. Messages published using an MQTT5 topic alias without the topic are never
+                         coalesced. If MQTT_REPORT_DELETED_MESSAGES is enabled, the replaced message is reported
+                         by MQTT_EVENT_DELETED. */
+    esp_mqtt_priority_t priority; /*!< Priority class of the message, MQTT_PRIORITY_NORMAL by default. Messages waiting
+                         in the outbox, e.g. after a reconnection, are sent in the order of their class, so that
+                         urgent messages are not delayed by a backlog of bulk data. */
+} esp_mqtt_publish_options_t;
+
+/** Default options of a publish, as used by esp_mqtt_client_publish() and esp_mqtt_client_enqueue() */
+#define ESP_MQTT_PUBLISH_OPTIONS_DEFAULT() { \
+    .expiry_ms = 0,                         \
+    .coalesce = false,                      \
+    .priority = MQTT_PRIORITY_NORMAL,       \
+}
+
+typedef struct esp_mqtt_async_publish *esp_mqtt_async_publish_handle_t;
+
+typedef struct esp_mqtt_reactor *esp_mqtt_reactor_handle_t;
+
+typedef struct esp_mqtt_topic *esp_mqtt_topic_handle_t;
+
+/**
+ * *MQTT* reactor configuration, see esp_mqtt_reactor_create()
+ */
+typedef struct esp_mqtt_reactor_config_t {
+    int priority;   /*!< Reactor task priority, defaults to the *MQTT* task priority */
+    int stack_size; /*!< Reactor task stack size, defaults to the *MQTT* task stack size */
+} esp_mqtt_reactor_config_t;
+
+/**
+ * @brief Completion callback of an asynchronous publish, see esp_mqtt_client_publish_async()
+ *
+ * It's called from the MQTT task, or from the task calling the client API which drops
+ * the message (e.g. replacing it by a coalesced message), so it must not block. Messages
+ * evicted by the outbox overflow policy are reported from the MQTT task. It might be
+ * called before esp_mqtt_client_publish_async() returns.
+ *
+ * @param client    *MQTT* client handle
+ * @param handle    handle of the publish, valid only until the callback returns
+ * @param msg_id    message id of the publish message, zero for QoS 0 messages and messages dropped before being created
+ * @param status    outcome of the publish
+ * @param user_ctx  user context passed to esp_mqtt_client_publish_async()
+ */
+typedef void (*esp_mqtt_publish_cb_t)(esp_mqtt_client_handle_t client, esp_mqtt_async_publish_handle_t handle, int msg_id,
+                                      esp_mqtt_publish_status_t status, void *user_ctx);
+
 /**
  * @brief *MQTT* error code structure to be passed as a contextual information
  * into ERROR event
@@ -205,6 +303,8 @@ typedef struct esp_mqtt_event_t {
     bool retain; /*!< Retained flag of the message associated with this event */
     int qos;     /*!< QoS of the messages associated with this event */
     bool dup;    /*!< dup flag of the message associated with this event */
+    int reconnect_delay_ms; /*!< Delay before the next reconnection attempt in milliseconds for the disconnected
+                                 event, -1 if auto reconnect is disabled */
     esp_mqtt_protocol_ver_t protocol_ver;   /*!< MQTT protocol version used for connection, defaults to value from menuconfig*/
 #ifdef CONFIG_MQTT_PROTOCOL_5
     esp_mqtt5_event_property_t *property; /*!< MQTT 5 property associated with this event */
@@ -214,6 +314,16 @@ typedef struct esp_mqtt_event_t {
 
 typedef esp_mqtt_event_t *esp_mqtt_event_handle_t;
 
+/**
+ * @brief Direct event handler, see esp_mqtt_client_register_direct_handler()
+ *
+ * It's called from the MQTT task, with the event of the client itself, which is valid only until the handler returns.
+ *
+ * @param event         the event
+ * @param handler_args  context passed to esp_mqtt_client_register_direct_handler()
+ */
+typedef void (*esp_mqtt_direct_handler_t)(const esp_mqtt_event_t *event, void *handler_args);
+
 
 /**
  * *MQTT* client configuration structure
@@ -331,6 +441,14 @@ typedef struct esp_mqtt_client_config_t {
     struct network_t {
         int reconnect_timeout_ms; /*!< Reconnect to the broker after this value in miliseconds if auto reconnect is not
                           disabled (defaults to 10s) */
+        int reconnect_max_timeout_ms; /*!< Upper bound of the reconnect delay in milliseconds. If greater than
+                          `reconnect_timeout_ms`, the delay backs off exponentially with decorrelated jitter,
+                          i.e. it's picked randomly between `reconnect_timeout_ms` and three times the previous
+                          delay, up to this value, until the broker accepts the connection. Defaults to 0,
+                          i.e. a fixed delay of `reconnect_timeout_ms` */
+        bool reconnect_first_immediately; /*!< Retry the first reconnection after losing the connection to the
+                          broker unexpectedly right away, the reconnect delay applies from the second attempt.
+                          Doesn't apply after esp_mqtt_client_disconnect() */
         int timeout_ms; /*!< Abort network operation if it is not completed after this value, in milliseconds
                 (defaults to 10s). */
         int refresh_connection_after_ms; /*!< Refresh connection after this value (in milliseconds) */
@@ -345,6 +463,9 @@ typedef struct esp_mqtt_client_config_t {
     struct task_t {
         int priority;   /*!< *MQTT* task priority*/
         int stack_size; /*!< *MQTT* task stack size*/
+        esp_mqtt_reactor_handle_t reactor; /*!< Run the client on this shared reactor instead of its own task,
+                                                the priority and stack size above are not used then,
+                                                see esp_mqtt_reactor_create() */
     } task; /*!< FreeRTOS task configuration.*/
     /**
      * Client buffer size configuration
@@ -362,9 +483,44 @@ typedef struct esp_mqtt_client_config_t {
      */
     struct outbox_config_t {
         uint64_t limit; /*!< Size limit for the outbox in bytes.*/
+        esp_mqtt_outbox_overflow_policy_t overflow_policy; /*!< What to do with a new message if it would exceed
+                                                                ``limit``, rejects it by default */
     } outbox; /*!< Outbox configuration. */
 } esp_mqtt_client_config_t;
 
+/**
+ * Outbox memory pool statistics, used to size the pool (CONFIG_MQTT_OUTBOX_POOL) in the field
+ */
+typedef struct esp_mqtt_outbox_pool_stats {
+    size_t arena_size;       /*!< Size of the preallocated data arena in bytes */
+    size_t arena_used;       /*!< Bytes of the arena held by queued messages, including size class rounding */
+    size_t arena_high_water; /*!< Maximum of ``arena_used`` since the client was created */
+    size_t arena_unused;     /*!< Bytes of the arena which haven't been carved into blocks yet */
+    size_t data_requested;   /*!< Bytes actually requested by messages stored in the arena,
+                                  ``arena_used - data_requested`` is the internal fragmentation */
+    size_t free_block_bytes; /*!< Bytes of released blocks, reusable by messages of the same or a smaller
+                                  size class */
+    size_t heap_fallbacks;   /*!< Number of message allocations served from the heap, as the arena was exhausted
+                                  or the message too big */
+    size_t items_in_use;     /*!< Number of outbox items currently allocated */
+    size_t items_high_water; /*!< Maximum of ``items_in_use`` since the client was created */
+    size_t item_slabs;       /*!< Number of allocated item slabs */
+} esp_mqtt_outbox_pool_stats_t;
+
+#define MQTT_OUTBOX_WAIT_HISTOGRAM_SIZE 8
+
+/**
+ * Outbox statistics per priority class
+ */
+typedef struct esp_mqtt_outbox_priority_stats {
+    size_t queued[MQTT_PRIORITY_MAX];   /*!< Number of messages of each class waiting to be transmitted,
+                                            indexed by esp_mqtt_priority_t, MQTT_PRIORITY_DEFAULT is always 0 */
+    uint32_t wait_histogram[MQTT_PRIORITY_MAX][MQTT_OUTBOX_WAIT_HISTOGRAM_SIZE]; /*!< Number of queued messages
+                                            of each class sent by the client task, by the time they waited
+                                            in the outbox: bucket ``i`` counts waits shorter than ``10 << 2*i`` ms
+                                            (10ms, 40ms, 160ms, ...), the last bucket all longer waits */
+} esp_mqtt_outbox_priority_stats_t;
+
 /**
  * Topic definition struct
  */
@@ -441,6 +597,40 @@ esp_err_t esp_mqtt_client_disconnect(esp_mqtt_client_handle_t client);
  */
 esp_err_t esp_mqtt_client_stop(esp_mqtt_client_handle_t client);
 
+/**
+ * @brief Creates a reactor, i.e. a single task running many *MQTT* clients
+ *
+ * Clients configured with `task.reactor` are run by the reactor task once started, instead of
+ * creating a task per client. The reactor waits for incoming data of all the clients at once
+ * and runs each client only when it has data to read, new work or a timer to serve, so an idle
+ * client costs only its buffers and state.
+ *
+ *  * Notes:
+ *  - Connecting to the broker blocks the reactor up to the network timeout of the client
+ *  - Event handlers of the clients run in the reactor task, they should not block and cannot
+ *    stop or destroy any client of the reactor
+ *  - Requires the eventfd support of ESP-IDF v5.0 and newer
+ *
+ * @param config    reactor configuration, could be NULL to use the defaults
+ *
+ * @return reactor handle if created, NULL on error
+ */
+esp_mqtt_reactor_handle_t esp_mqtt_reactor_create(const esp_mqtt_reactor_config_t *config);
+
+/**
+ * @brief Stops the reactor task and frees the reactor
+ *
+ *  * Notes:
+ *  - All the clients of the reactor have to be stopped before
+ *
+ * @param reactor   reactor handle
+ *
+ * @return ESP_OK on success
+ *         ESP_ERR_INVALID_ARG on wrong initialization
+ *         ESP_FAIL if the reactor still runs some clients or it's called from the reactor task
+ */
+esp_err_t esp_mqtt_reactor_destroy(esp_mqtt_reactor_handle_t reactor);
+
 #ifdef __cplusplus
 
 #define esp_mqtt_client_subscribe esp_mqtt_client_subscribe_single
@@ -554,6 +744,27 @@ int esp_mqtt_client_unsubscribe(esp_mqtt_client_handle_t client,
 int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic,
                             const char *data, int len, int qos, int retain);
 
+/**
+ * @brief Client to send a publish message to the broker, with options of this message
+ *
+ * Same as esp_mqtt_client_publish(), the options are applied only to the created message.
+ *
+ * @param client    *MQTT* client handle
+ * @param topic     topic string
+ * @param data      payload string (set to NULL, sending empty payload message)
+ * @param len       data length, if set to 0, length is calculated from payload
+ * string
+ * @param qos       QoS of publish message
+ * @param retain    retain flag
+ * @param options   options of the message, NULL for the defaults
+ *
+ * @return message_id of the publish message (for QoS 0 message_id will always
+ * be zero) on success. -1 on failure, -2 in case of full outbox.
+ */
+int esp_mqtt_client_publish_with_options(esp_mqtt_client_handle_t client, const char *topic,
+        const char *data, int len, int qos, int retain,
+        const esp_mqtt_publish_options_t *options);
+
 /**
  * @brief Enqueue a message to the outbox, to be sent later. Typically used for
  * messages with qos>0, but could be also used for qos=0 messages if store=true.
@@ -580,6 +791,115 @@ int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t client, const char *topic,
                             const char *data, int len, int qos, int retain,
                             bool store);
 
+/**
+ * @brief Enqueue a message to the outbox, to be sent later, with options of this message
+ *
+ * Same as esp_mqtt_client_enqueue(), the options are applied only to the created message.
+ *
+ * @param client    *MQTT* client handle
+ * @param topic     topic string
+ * @param data      payload string (set to NULL, sending empty payload message)
+ * @param len       data length, if set to 0, length is calculated from payload
+ * string
+ * @param qos       QoS of publish message
+ * @param retain    retain flag
+ * @param store     if true, all messages are enqueued; otherwise only QoS 1 and
+ * QoS 2 are enqueued
+ * @param options   options of the message, NULL for the defaults
+ *
+ * @return message_id if queued successfully, -1 on failure, -2 in case of full outbox.
+ */
+int esp_mqtt_client_enqueue_with_options(esp_mqtt_client_handle_t client, const char *topic,
+        const char *data, int len, int qos, int retain, bool store,
+        const esp_mqtt_publish_options_t *options);
+
+/**
+ * @brief Registers a topic to publish to with esp_mqtt_client_publish_by_handle()
+ *
+ * The topic is encoded once, so publishing by the handle only fills in the packet id,
+ * flags and lengths of the message and copies the payload.
+ *
+ * Notes:
+ * - With MQTT5, the publish properties set by esp_mqtt5_client_set_publish_property()
+ * are consumed by the registration and sent with every message published by the handle
+ * - The topic is encoded for the protocol version of the client at the registration. If the version
+ * changes later, the topic is encoded again by the next publish, without the MQTT5 publish properties
+ * - Handles are freed by esp_mqtt_client_unregister_topic() or esp_mqtt_client_destroy()
+ *
+ * @param client    *MQTT* client handle
+ * @param topic     topic string
+ *
+ * @return topic handle, NULL on failure
+ */
+esp_mqtt_topic_handle_t esp_mqtt_client_register_topic(esp_mqtt_client_handle_t client, const char *topic);
+
+/**
+ * @brief Frees a topic handle created by esp_mqtt_client_register_topic()
+ *
+ * @param client    *MQTT* client handle
+ * @param topic     topic handle
+ *
+ * @return ESP_OK on success
+ *         ESP_ERR_INVALID_ARG on wrong initialization
+ */
+esp_err_t esp_mqtt_client_unregister_topic(esp_mqtt_client_handle_t client, esp_mqtt_topic_handle_t topic);
+
+/**
+ * @brief Client to send a publish message to a registered topic, see esp_mqtt_client_publish()
+ *
+ * @param client    *MQTT* client handle
+ * @param topic     topic handle created by esp_mqtt_client_register_topic()
+ * @param data      payload string (set to NULL, sending empty payload message)
+ * @param len       data length, if set to 0, length is calculated from payload
+ * string
+ * @param qos       QoS of publish message
+ * @param retain    retain flag
+ *
+ * @return message_id of the publish message (for QoS 0 message_id will always
+ * be zero) on success. -1 on failure, -2 in case of full outbox.
+ */
+int esp_mqtt_client_publish_by_handle(esp_mqtt_client_handle_t client, esp_mqtt_topic_handle_t topic,
+                                      const char *data, int len, int qos, int retain);
+
+/**
+ * @brief Client to send a publish message to the broker without waiting for the network
+ *
+ * The topic and payload are copied and handed over to the MQTT task through a bounded
+ * lock-free queue (see CONFIG_MQTT_ASYNC_PUBLISH_QUEUE_SIZE), so the API returns right away,
+ * without taking the client lock which is held while the MQTT task writes to the network,
+ * and producer tasks don't contend on any lock with each other either.
+ * The MQTT task creates the message, writes QoS 0 messages directly and stores the QoS 1
+ * and QoS 2 messages in the outbox, to be sent as any other enqueued message.
+ * The outcome of the publish is reported by the completion callback.
+ *
+ * Notes:
+ * - QoS 0 messages are dropped if the client is not connected when the MQTT task
+ * processes them, as with esp_mqtt_client_publish()
+ * - The publish properties set by esp_mqtt5_client_set_publish_property() are not
+ * applied to, nor consumed by, asynchronous publishes, these are sent with the defaults,
+ * including the default esp_mqtt_publish_options_t
+ * - Completion callbacks of the messages in the persistent outbox are not kept across restarts
+ *
+ * @param client    *MQTT* client handle
+ * @param topic     topic string
+ * @param data      payload string (set to NULL, sending empty payload message)
+ * @param len       data length, if set to 0, length is calculated from payload
+ * string
+ * @param qos       QoS of publish message
+ * @param retain    retain flag
+ * @param cb        completion callback, could be NULL
+ * @param user_ctx  user context passed to the completion callback
+ *
+ * @return handle of the publish on success, NULL on failure (including a full submission queue),
+ * in which case the callback is not called. The handle is only valid inside the completion
+ * callback: the MQTT task might complete and free the publish before this function returns,
+ * so the returned value must not be dereferenced, nor relied upon to identify the publish
+ * in the callback (use `user_ctx` instead)
+ */
+esp_mqtt_async_publish_handle_t esp_mqtt_client_publish_async(esp_mqtt_client_handle_t client, const char *topic,
+        const char *data, int len, int qos, int retain,
+        esp_mqtt_publish_cb_t cb, void *user_ctx);
+
 /**
  * @brief Destroys the client handle
  *
@@ -638,6 +958,22 @@ esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client,
  */
 esp_err_t esp_mqtt_client_unregister_event(esp_mqtt_client_handle_t client, esp_mqtt_event_id_t event, esp_event_handler_t event_handler);
 
+/**
+ * @brief Registers a handler called directly with all events of the client
+ *
+ * The events are passed to the handler instead of being posted to the event loop of the client, which saves
+ * the copies of each event and the event loop pass. Handlers registered by esp_mqtt_client_register_event()
+ * only get MQTT_USER_EVENT (see esp_mqtt_dispatch_custom_event()) while a direct handler is registered.
+ *
+ * @param client            *MQTT* client handle
+ * @param handler           handler callback, NULL to post the events to the event loop again
+ * @param handler_args      handler context
+ *
+ * @return ESP_ERR_INVALID_ARG on wrong initialization
+ *         ESP_OK on success
+ */
+esp_err_t esp_mqtt_client_register_direct_handler(esp_mqtt_client_handle_t client, esp_mqtt_direct_handler_t handler, void *handler_args);
+
 /**
  * @brief Get outbox size
  *
@@ -647,6 +983,39 @@ esp_err_t esp_mqtt_client_unregister_event(esp_mqtt_client_handle_t client, esp_
  */
 int esp_mqtt_client_get_outbox_size(esp_mqtt_client_handle_t client);
 
+/**
+ * @brief Get number of messages dropped from the full outbox by the overflow policy
+ *
+ * Dropped messages are also reported by MQTT_EVENT_DELETED if MQTT_REPORT_DELETED_MESSAGES is enabled.
+ *
+ * @param client            *MQTT* client handle
+ * @return number of dropped messages since the client was created
+ *         0 on wrong initialization
+ */
+int esp_mqtt_client_get_outbox_evicted(esp_mqtt_client_handle_t client);
+
+/**
+ * @brief Get outbox statistics per priority class
+ *
+ * @param client            *MQTT* client handle
+ * @param stats             Output statistics
+ * @return ESP_OK on success
+ *         ESP_ERR_INVALID_ARG on wrong initialization
+ */
+esp_err_t esp_mqtt_client_get_outbox_priority_stats(esp_mqtt_client_handle_t client, esp_mqtt_outbox_priority_stats_t *stats);
+
+/**
+ * @brief Get statistics of the outbox memory pool
+ *
+ * @param client            *MQTT* client handle
+ * @param stats             Output statistics
+ * @return ESP_OK on success
+ *         ESP_ERR_INVALID_ARG on wrong initialization
+ *         ESP_ERR_INVALID_STATE if the client has no outbox, `stats` is left untouched
+ *         ESP_ERR_NOT_SUPPORTED if the outbox pool is not enabled (CONFIG_MQTT_OUTBOX_POOL)
+ */
+esp_err_t esp_mqtt_client_get_outbox_pool_stats(esp_mqtt_client_handle_t client, esp_mqtt_outbox_pool_stats_t *stats);
+
 /**
  * @brief Dispatch user event to the mqtt internal event loop
  *
@@ -64,6 +64,11 @@
 #define MQTT_SUPPORTED_FEATURE_CERTIFICATE_BUNDLE
 #endif
 
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+// Features supported in 5.0.0
+#define MQTT_SUPPORTED_FEATURE_WAKEUP_EVENTFD
+#endif
+
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
 // Features supported in 5.1.0
 #define MQTT_SUPPORTED_FEATURE_CRT_CMN_NAME
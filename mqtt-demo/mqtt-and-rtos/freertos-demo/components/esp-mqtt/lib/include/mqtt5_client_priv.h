@@ -16,14 +16,26 @@ extern "C" {
 #endif
 
 typedef struct mqtt5_topic_alias {
-    char *topic;
-    uint16_t topic_len;
-    uint16_t topic_alias;
-    STAILQ_ENTRY(mqtt5_topic_alias) next;
+    char *topic;                    // in the slot of the alias, or in the heap buffer if longer, not null terminated
+    uint16_t topic_len;             // zero if the alias is not set
+    uint16_t heap_size;             // size of the heap buffer of topics longer than the slot
+    char *heap;
 } mqtt5_topic_alias_t;
-STAILQ_HEAD(mqtt5_topic_alias_list_t, mqtt5_topic_alias);
-typedef struct mqtt5_topic_alias_list_t *mqtt5_topic_alias_handle_t;
-typedef struct mqtt5_topic_alias *mqtt5_topic_alias_item_t;
+
+/* Topics of the incoming aliases, indexed by alias - 1, each with a slot of MQTT5_TOPIC_ALIAS_SLOT_SIZE
+   bytes in the arena following the table, all in a single allocation */
+typedef struct mqtt5_topic_alias_table {
+    uint16_t count;
+    char *arena;
+    mqtt5_topic_alias_t alias[];
+} mqtt5_topic_alias_table_t;
+typedef struct mqtt5_topic_alias_table *mqtt5_topic_alias_handle_t;
+
+typedef struct mqtt5_outbound_topic_alias {
+    char *topic;                    // NULL if the alias is not assigned
+    uint32_t last_used;             // value of the alias clock when the alias was used last time
+    bool sent;                      // the topic was sent with the alias on this connection
+} mqtt5_outbound_topic_alias_t;
 
 typedef struct {
     esp_mqtt5_connection_property_storage_t connect_property_info;
@@ -34,6 +46,11 @@ typedef struct {
     const esp_mqtt5_subscribe_property_config_t *subscribe_property_info;
     const esp_mqtt5_unsubscribe_property_config_t *unsubscribe_property_info;
     mqtt5_topic_alias_handle_t peer_topic_alias;
+    bool auto_topic_alias;
+    bool user_property_view_only;   // received user properties are only exposed in place, see esp_mqtt5_event_user_property()
+    mqtt5_outbound_topic_alias_t *outbound_topic_alias; // aliases assigned by the client, index + 1 is the alias, reset on each connection
+    uint16_t outbound_topic_alias_count;
+    uint32_t outbound_topic_alias_clock;
 } mqtt5_config_storage_t;
 
 void esp_mqtt5_increment_packet_counter(esp_mqtt5_client_handle_t client);
@@ -42,12 +59,15 @@ void esp_mqtt5_parse_pubcomp(esp_mqtt5_client_handle_t client);
 void esp_mqtt5_parse_puback(esp_mqtt5_client_handle_t client);
 void esp_mqtt5_parse_unsuback(esp_mqtt5_client_handle_t client);
 void esp_mqtt5_parse_suback(esp_mqtt5_client_handle_t client);
+mqtt5_user_property_handle_t *esp_mqtt5_event_user_property(esp_mqtt5_client_handle_t client);
+void esp_mqtt5_set_user_property_view(esp_mqtt5_client_handle_t client, uint8_t *properties, size_t properties_len);
 esp_err_t esp_mqtt5_parse_connack(esp_mqtt5_client_handle_t client, int *connect_rsp_code);
 void esp_mqtt5_client_destory(esp_mqtt5_client_handle_t client);
 esp_err_t esp_mqtt5_client_publish_check(esp_mqtt5_client_handle_t client, int qos, int retain);
 esp_err_t esp_mqtt5_client_subscribe_check(esp_mqtt5_client_handle_t client, int qos);
 esp_err_t esp_mqtt5_create_default_config(esp_mqtt5_client_handle_t client);
-esp_err_t esp_mqtt5_get_publish_data(esp_mqtt5_client_handle_t client, uint8_t *msg_buf, size_t msg_read_len, char **msg_topic, size_t *msg_topic_len, char **msg_data, size_t *msg_data_len);
+void esp_mqtt5_client_alias_publish(esp_mqtt5_client_handle_t client, const char *topic, const esp_mqtt5_publish_property_config_t *property);
+esp_err_t esp_mqtt5_get_publish_data(esp_mqtt5_client_handle_t client, mqtt_publish_view_t *publish);
 #ifdef __cplusplus
 }
 #endif //__cplusplus
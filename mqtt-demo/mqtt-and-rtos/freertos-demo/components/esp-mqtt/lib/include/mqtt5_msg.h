@@ -119,11 +119,29 @@ typedef struct {
 #define mqtt5_get_pubcomp_data mqtt5_get_puback_data
 
 uint16_t mqtt5_get_id(uint8_t *buffer, size_t length);
-char *mqtt5_get_publish_property_payload(uint8_t *buffer, size_t buffer_length, char **msg_topic, size_t *msg_topic_len, esp_mqtt5_publish_resp_property_t *resp_property, uint16_t *property_len, size_t *payload_len, mqtt5_user_property_handle_t *user_property);
+esp_err_t mqtt5_msg_parse_publish_property(uint8_t *property, size_t property_len, esp_mqtt5_publish_resp_property_t *resp_property, mqtt5_user_property_handle_t *user_property);
+esp_err_t mqtt5_msg_get_property_block(uint8_t *buffer, size_t length, uint8_t **property, size_t *property_len);
+bool mqtt5_msg_next_user_property(const uint8_t *property, size_t property_len, size_t *offset, esp_mqtt5_user_property_ref_t *item);
 char *mqtt5_get_suback_data(uint8_t *buffer, size_t *length, mqtt5_user_property_handle_t *user_property);
 char *mqtt5_get_puback_data(uint8_t *buffer, size_t *length, mqtt5_user_property_handle_t *user_property);
 mqtt_message_t *mqtt5_msg_connect(mqtt_connection_t *connection, mqtt_connect_info_t *info, esp_mqtt5_connection_property_storage_t *property, esp_mqtt5_connection_will_property_storage_t *will_property);
 mqtt_message_t *mqtt5_msg_publish(mqtt_connection_t *connection, const char *topic, const char *data, int data_length, int qos, int retain, uint16_t *message_id, const esp_mqtt5_publish_property_config_t *property, const char *resp_info);
+/**
+ * @brief Rewrites the message expiry interval property of an encoded publish message in place
+ *
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if the message has no expiry interval
+ */
+esp_err_t mqtt5_msg_set_publish_expiry(uint8_t *buffer, size_t length, uint32_t message_expiry_interval);
+/**
+ * @brief Rewrites the publish message in the output buffer in place to use a topic alias
+ *
+ * The topic alias property is added and the topic is left out, unless `keep_topic` is set,
+ * i.e. the alias is sent for the first time. The payload isn't encoded again, the header is
+ * rewritten in front of it, so the message data might start at another place of the buffer.
+ *
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the message with the alias doesn't fit the buffer
+ */
+esp_err_t mqtt5_msg_publish_set_topic_alias(mqtt_connection_t *connection, uint16_t topic_alias, bool keep_topic);
 esp_err_t mqtt5_msg_parse_connack_property(uint8_t *buffer, size_t buffer_len, mqtt_connect_info_t *connection_info, esp_mqtt5_connection_property_storage_t *connection_property, esp_mqtt5_connection_server_resp_property_t *resp_property, int *reason_code, uint8_t *ack_flag, mqtt5_user_property_handle_t *user_property);
 int mqtt5_msg_get_reason_code(uint8_t *buffer, size_t length);
 mqtt_message_t *mqtt5_msg_subscribe(mqtt_connection_t *connection, const esp_mqtt_topic_t *topic, int size, uint16_t *message_id, const esp_mqtt5_subscribe_property_config_t *property);
@@ -26,7 +26,9 @@
 #include "esp_transport_ws.h"
 #include "esp_log.h"
 #include "mqtt_outbox.h"
+#include "mqtt_submit_ring.h"
 #include "freertos/event_groups.h"
+#include <sys/queue.h>
 #include <errno.h>
 #include <string.h>
 
@@ -58,18 +60,32 @@ extern "C" {
 typedef struct mqtt_state {
     uint8_t *in_buffer;
     int in_buffer_length;
+    uint8_t *in_buffer_saved;       // input buffer while in_buffer holds an oversized packet, see mqtt_receive_oversized()
+    uint8_t *bulk_read_buffer;      // data read from the transport ahead of the packet being received
+    int bulk_read_size;
+    int bulk_read_pos;
+    int bulk_read_len;
     size_t message_length;
     size_t in_buffer_read_len;
     mqtt_connection_t connection;
     uint16_t pending_msg_id;
     int pending_msg_type;
     int pending_publish_qos;
+    uint64_t pending_publish_expiry_ms;
+    bool pending_publish_coalesce;
+    esp_mqtt_priority_t pending_publish_priority;
 } mqtt_state_t;
 
+typedef struct {
+    int msg_id;
+    esp_mqtt_publish_status_t status;
+} mqtt_deleted_report_t;
+
 typedef struct {
     esp_event_loop_handle_t event_loop_handle;
     int task_stack;
     int task_prio;
+    esp_mqtt_reactor_handle_t reactor;
     char *uri;
     char *host;
     char *path;
@@ -79,6 +95,8 @@ typedef struct {
     int network_timeout_ms;
     int refresh_connection_after_ms;
     int reconnect_timeout_ms;
+    int reconnect_max_timeout_ms;
+    bool reconnect_first_immediately;
     char **alpn_protos;
     int num_alpn_protos;
     char *clientkey_password;
@@ -98,10 +116,34 @@ typedef struct {
     void *ds_data;
     int message_retransmit_timeout;
     uint64_t outbox_limit;
+    esp_mqtt_outbox_overflow_policy_t outbox_overflow_policy;
     esp_transport_handle_t transport;
     struct ifreq * if_name;
 } mqtt_config_storage_t;
 
+struct esp_mqtt_async_publish {
+    char *topic;                    // topic and payload in a single allocation, freed once the message is created
+    char *data;
+    int len;
+    int qos;
+    int retain;
+    int msg_id;                     // id of the message waiting in the outbox for acknowledgement
+    esp_mqtt_publish_cb_t cb;
+    void *user_ctx;
+    struct esp_mqtt_async_publish *index_next;
+};
+
+struct esp_mqtt_topic {
+    char *topic;                    // kept to encode the topic again if the protocol version changes
+    uint8_t *encoded;               // topic length and string, followed by the MQTT5 property block
+    int encoded_len;
+    int topic_len;                  // encoded length of the topic, the packet id goes after it
+    esp_mqtt_protocol_ver_t protocol_ver;
+    uint64_t expiry_ms;             // outbox expiry by the MQTT5 message expiry interval
+    LIST_ENTRY(esp_mqtt_topic) next;
+};
+LIST_HEAD(esp_mqtt_topic_list_t, esp_mqtt_topic);
+
 typedef enum {
     MQTT_STATE_INIT = 0,
     MQTT_STATE_DISCONNECTED,
@@ -118,6 +160,8 @@ struct esp_mqtt_client {
     uint64_t refresh_connection_tick;
     int64_t keepalive_tick;
     uint64_t reconnect_tick;
+    int reconnect_attempts;         // failed reconnection attempts since the last accepted connection
+    int reconnect_backoff_ms;       // previous reconnect delay of the backoff
 #ifdef MQTT_PROTOCOL_5
     mqtt5_config_storage_t *mqtt5_config;
     uint16_t send_publish_packet_count; // This is for MQTT v5.0 flow control
@@ -128,6 +172,28 @@ struct esp_mqtt_client {
     bool run;
     bool wait_for_ping_resp;
     outbox_handle_t outbox;
+    int outbox_evicted;             // messages dropped by the outbox overflow policy
+    mqtt_deleted_report_t *deleted_reports; // deleted messages to be reported by the client task
+    size_t deleted_report_count;
+    size_t deleted_report_size;
+    mqtt_submit_ring_handle_t async_publish_ring; // messages of esp_mqtt_client_publish_async() to be created by the client task
+    esp_mqtt_async_publish_handle_t *async_publish_index; // asynchronous publishes waiting in the outbox for completion, hashed by message id
+    size_t async_publish_index_size;
+    size_t async_publish_count;
+    struct esp_mqtt_topic_list_t topics; // topics registered by esp_mqtt_client_register_topic()
+    esp_mqtt_direct_handler_t direct_handler; // called with the events instead of posting them, see esp_mqtt_client_register_direct_handler()
+    void *direct_handler_args;
+    int wakeup_fd;                  // eventfd waking up the client task waiting for incoming data, -1 if not available
+    uint64_t last_retransmit;       // last time the client task looked for transmitted messages to resend
+    bool queued_backlog;            // queued messages were left in the outbox by the last batch
+    esp_mqtt_reactor_handle_t reactor; // reactor running the client, NULL if it runs its own task
+    LIST_ENTRY(esp_mqtt_client) reactor_next;
+    atomic_bool reactor_pending;    // the client has new work, set by mqtt_client_wakeup()
+    int reactor_wait;               // what the client waits for in the reactor, see mqtt_wait_t
+    int reactor_sock;               // socket the reactor waits on, -1 if none
+    int reactor_ready;              // result of the last wait for the socket, 1 readable, -1 error
+    uint64_t reactor_deadline;      // the reactor runs the client at this time at the latest
+    uint32_t outbox_wait_histogram[MQTT_PRIORITY_MAX][MQTT_OUTBOX_WAIT_HISTOGRAM_SIZE];
     EventGroupHandle_t status_bits;
     SemaphoreHandle_t  api_lock;
     TaskHandle_t       task_handle;
@@ -17,6 +17,8 @@
 #endif
 
 #define MQTT_RECON_DEFAULT_MS       (10*1000)
+#define MQTT_REACTOR_POLL_PERIOD_MS (10)
+#define MQTT_RECEIVE_BATCH_SIZE     (16)
 
 #ifdef CONFIG_MQTT_POLL_READ_TIMEOUT_MS
 #define MQTT_POLL_READ_TIMEOUT_MS  CONFIG_MQTT_POLL_READ_TIMEOUT_MS
@@ -24,6 +26,54 @@
 #define MQTT_POLL_READ_TIMEOUT_MS   (1000)
 #endif
 
+#ifdef CONFIG_MQTT_WAKEUP_EVENTFD_MAX_FDS
+#define MQTT_WAKEUP_EVENTFD_MAX_FDS CONFIG_MQTT_WAKEUP_EVENTFD_MAX_FDS
+#else
+#define MQTT_WAKEUP_EVENTFD_MAX_FDS (8)
+#endif
+
+#ifdef CONFIG_MQTT_OUTBOX_DRAIN_BATCH_SIZE
+#define MQTT_OUTBOX_DRAIN_BATCH_SIZE  CONFIG_MQTT_OUTBOX_DRAIN_BATCH_SIZE
+#else
+#define MQTT_OUTBOX_DRAIN_BATCH_SIZE  (16)
+#endif
+
+#ifdef CONFIG_MQTT_OUTBOX_DRAIN_BUDGET_MS
+#define MQTT_OUTBOX_DRAIN_BUDGET_MS  CONFIG_MQTT_OUTBOX_DRAIN_BUDGET_MS
+#else
+#define MQTT_OUTBOX_DRAIN_BUDGET_MS  (100)
+#endif
+
+#ifdef CONFIG_MQTT_BULK_READ_SIZE
+#define MQTT_BULK_READ_SIZE  CONFIG_MQTT_BULK_READ_SIZE
+#else
+#define MQTT_BULK_READ_SIZE  (512)
+#endif
+
+#ifdef CONFIG_MQTT_MAX_INCOMING_PACKET_SIZE
+#define MQTT_MAX_INCOMING_PACKET_SIZE  CONFIG_MQTT_MAX_INCOMING_PACKET_SIZE
+#else
+#define MQTT_MAX_INCOMING_PACKET_SIZE  (4096)
+#endif
+
+#ifdef CONFIG_MQTT_ASYNC_PUBLISH_QUEUE_SIZE
+#define MQTT_ASYNC_PUBLISH_QUEUE_SIZE  CONFIG_MQTT_ASYNC_PUBLISH_QUEUE_SIZE
+#else
+#define MQTT_ASYNC_PUBLISH_QUEUE_SIZE  (16)
+#endif
+
+#ifdef CONFIG_MQTT5_OUTBOUND_TOPIC_ALIAS_MAX
+#define MQTT5_OUTBOUND_TOPIC_ALIAS_MAX  CONFIG_MQTT5_OUTBOUND_TOPIC_ALIAS_MAX
+#else
+#define MQTT5_OUTBOUND_TOPIC_ALIAS_MAX  (16)
+#endif
+
+#ifdef CONFIG_MQTT5_TOPIC_ALIAS_SLOT_SIZE
+#define MQTT5_TOPIC_ALIAS_SLOT_SIZE  CONFIG_MQTT5_TOPIC_ALIAS_SLOT_SIZE
+#else
+#define MQTT5_TOPIC_ALIAS_SLOT_SIZE  (64)
+#endif
+
 #define MQTT_MSG_ID_INCREMENTAL     CONFIG_MQTT_MSG_ID_INCREMENTAL
 
 #define MQTT_SKIP_PUBLISH_IF_DISCONNECTED CONFIG_MQTT_SKIP_PUBLISH_IF_DISCONNECTED
@@ -97,6 +147,12 @@
 #define OUTBOX_EXPIRED_TIMEOUT_MS   (30*1000)
 #endif
 
+#ifdef  CONFIG_MQTT_OUTBOX_PRIORITY_AGING_MS
+#define OUTBOX_PRIORITY_AGING_MS    CONFIG_MQTT_OUTBOX_PRIORITY_AGING_MS
+#else
+#define OUTBOX_PRIORITY_AGING_MS    (1000)
+#endif
+
 #define MQTT_ENABLE_SSL             CONFIG_MQTT_TRANSPORT_SSL
 #define MQTT_ENABLE_WS              CONFIG_MQTT_TRANSPORT_WEBSOCKET
 #define MQTT_ENABLE_WSS             CONFIG_MQTT_TRANSPORT_WEBSOCKET_SECURE
@@ -113,5 +169,31 @@
 #define MQTT_OUTBOX_MEMORY MALLOC_CAP_DEFAULT
 #endif
 
+#ifdef CONFIG_MQTT_OUTBOX_RING
+#define MQTT_OUTBOX_RING            CONFIG_MQTT_OUTBOX_RING
+#define MQTT_OUTBOX_RING_SIZE       CONFIG_MQTT_OUTBOX_RING_SIZE
+#define MQTT_OUTBOX_RING_MAX_ITEMS  CONFIG_MQTT_OUTBOX_RING_MAX_ITEMS
+#endif
+
+#ifdef CONFIG_MQTT_OUTBOX_PERSISTENT
+#define MQTT_OUTBOX_PERSISTENT                  CONFIG_MQTT_OUTBOX_PERSISTENT
+#define MQTT_OUTBOX_PERSISTENT_SEGMENT_SIZE     CONFIG_MQTT_OUTBOX_PERSISTENT_SEGMENT_SIZE
+#define MQTT_OUTBOX_PERSISTENT_SYNC_BATCH       CONFIG_MQTT_OUTBOX_PERSISTENT_SYNC_BATCH
+#define MQTT_OUTBOX_PERSISTENT_SYNC_INTERVAL_MS CONFIG_MQTT_OUTBOX_PERSISTENT_SYNC_INTERVAL_MS
+#ifdef CONFIG_MQTT_OUTBOX_PERSISTENT_STORAGE_FILE
+#define MQTT_OUTBOX_PERSISTENT_FILE             CONFIG_MQTT_OUTBOX_PERSISTENT_STORAGE_FILE
+#define MQTT_OUTBOX_PERSISTENT_FILE_PATH        CONFIG_MQTT_OUTBOX_PERSISTENT_FILE_PATH
+#define MQTT_OUTBOX_PERSISTENT_FILE_SIZE        CONFIG_MQTT_OUTBOX_PERSISTENT_FILE_SIZE
+#else
+#define MQTT_OUTBOX_PERSISTENT_PARTITION_LABEL  CONFIG_MQTT_OUTBOX_PERSISTENT_PARTITION_LABEL
+#endif
+#endif
+
+#ifdef CONFIG_MQTT_OUTBOX_POOL
+#define MQTT_OUTBOX_POOL            CONFIG_MQTT_OUTBOX_POOL
+#define MQTT_OUTBOX_POOL_SIZE       CONFIG_MQTT_OUTBOX_POOL_SIZE
+#define MQTT_OUTBOX_POOL_SLAB_ITEMS CONFIG_MQTT_OUTBOX_POOL_SLAB_ITEMS
+#endif
+
 #define OUTBOX_MAX_SIZE             (4*1024)
 #endif
@@ -64,10 +64,24 @@ enum mqtt_message_type {
 typedef struct mqtt_message {
     uint8_t *data;
     size_t length;
-    size_t fragmented_msg_total_length;       /*!< total len of fragmented messages (zero for all other messages) */
-    size_t fragmented_msg_data_offset;        /*!< data offset of fragmented messages (zero for all other messages) */
+    size_t fragmented_msg_total_length;       /*!< total len of fragmented messages, whose payload didn't fit the buffer and is not part of `data` (zero for all other messages) */
+    size_t fragmented_msg_data_offset;        /*!< data offset of fragmented messages, i.e. the length of the header in `data` (zero for all other messages) */
 } mqtt_message_t;
 
+typedef struct mqtt_publish_view {
+    char *topic;                /*!< topic in the buffer, or of the topic alias */
+    size_t topic_len;
+    char *data;                 /*!< part of the payload in the buffer */
+    size_t data_len;
+    size_t total_data_len;      /*!< payload length of the whole message */
+    uint8_t *properties;        /*!< MQTT5 property block (NULL for MQTT 3.1.1) */
+    size_t properties_len;
+    uint16_t msg_id;            /*!< zero for QoS 0 */
+    int qos;
+    bool dup;
+    bool retain;
+} mqtt_publish_view_t;
+
 typedef struct mqtt_connect_info {
     char *client_id;
     char *username;
@@ -127,6 +141,7 @@ size_t mqtt_get_total_length(const uint8_t *buffer, size_t length, int *fixed_si
 char *mqtt_get_publish_topic(uint8_t *buffer, size_t *length);
 char *mqtt_get_publish_data(uint8_t *buffer, size_t *length);
 char *mqtt_get_suback_data(uint8_t *buffer, size_t *length);
+esp_err_t mqtt_msg_parse_publish(uint8_t *buffer, size_t length, bool has_properties, mqtt_publish_view_t *view);
 uint16_t mqtt_get_id(uint8_t *buffer, size_t length);
 int mqtt_has_valid_msg_hdr(uint8_t *buffer, size_t length);
 
@@ -135,6 +150,7 @@ void mqtt_msg_buffer_destroy(mqtt_connection_t *connection);
 
 mqtt_message_t *mqtt_msg_connect(mqtt_connection_t *connection, mqtt_connect_info_t *info);
 mqtt_message_t *mqtt_msg_publish(mqtt_connection_t *connection, const char *topic, const char *data, int data_length, int qos, int retain, uint16_t *message_id);
+mqtt_message_t *mqtt_msg_publish_encoded(mqtt_connection_t *connection, const uint8_t *encoded, int encoded_len, int topic_len, const char *data, int data_length, int qos, int retain, uint16_t *message_id);
 mqtt_message_t *mqtt_msg_puback(mqtt_connection_t *connection, uint16_t message_id);
 mqtt_message_t *mqtt_msg_pubrec(mqtt_connection_t *connection, uint16_t message_id);
 mqtt_message_t *mqtt_msg_pubrel(mqtt_connection_t *connection, uint16_t message_id);
@@ -7,6 +7,8 @@
 #define _MQTT_OUTOBX_H_
 #include "platform.h"
 #include "esp_err.h"
+#include "mqtt_config.h"
+#include "mqtt_client.h"
 
 #ifdef  __cplusplus
 extern "C" {
@@ -27,6 +29,9 @@ typedef struct outbox_message {
     int msg_type;
     uint8_t *remaining_data;
     int remaining_len;
+    outbox_tick_t deadline;     /*!< tick after which the message expires regardless of the outbox timeout, 0 if none */
+    bool coalesce;              /*!< publish message which could be replaced by a newer one on the same topic while queued */
+    esp_mqtt_priority_t priority; /*!< priority class, queued messages of higher classes are dequeued first */
 } outbox_message_t;
 
 typedef enum pending_state {
@@ -38,11 +43,37 @@ typedef enum pending_state {
 
 outbox_handle_t outbox_init(void);
 outbox_item_handle_t outbox_enqueue(outbox_handle_t outbox, outbox_message_handle_t message, outbox_tick_t tick);
+/**
+ * @brief Replaces a queued (not yet transmitted) publish message on the same topic with
+ * the given one, if both of them were enqueued with coalescing
+ *
+ * The replaced message is dropped only once the new one is stored, it stays queued otherwise.
+ *
+ * @param replaced_msg_id   set to the message id of the dropped message, untouched if none was dropped
+ *
+ * @return handle of the item holding the new message, NULL if it has to be enqueued instead
+ */
+outbox_item_handle_t outbox_coalesce(outbox_handle_t outbox, outbox_message_handle_t message, outbox_tick_t tick, int *replaced_msg_id);
+/**
+ * @brief Returns the next message in the given state to be sent, without removing it
+ *
+ * Queued messages are returned by their priority class, a message gains one class for each
+ * OUTBOX_PRIORITY_AGING_MS it waits. Messages of the same class, and messages in other states,
+ * are returned in the order of their ticks.
+ *
+ * @param tick  set to the tick of the returned message, if not NULL
+ */
 outbox_item_handle_t outbox_dequeue(outbox_handle_t outbox, pending_state_t pending, outbox_tick_t *tick);
 outbox_item_handle_t outbox_get(outbox_handle_t outbox, int msg_id);
 uint8_t *outbox_item_get_data(outbox_item_handle_t item,  size_t *len, uint16_t *msg_id, int *msg_type, int *qos);
 esp_err_t outbox_delete(outbox_handle_t outbox, int msg_id, int msg_type);
 esp_err_t outbox_delete_item(outbox_handle_t outbox, outbox_item_handle_t item);
+/**
+ * @brief Deletes all expired messages, i.e. messages older than `timeout`
+ * and messages whose own deadline has passed
+ *
+ * @return number of deleted messages
+ */
 int outbox_delete_expired(outbox_handle_t outbox, outbox_tick_t current_tick, outbox_tick_t timeout);
 /**
  * @brief Deletes single expired message returning it's message id
@@ -50,13 +81,40 @@ int outbox_delete_expired(outbox_handle_t outbox, outbox_tick_t current_tick, ou
  * @return msg id of the deleted message, -1 if no expired message in the outbox
  */
 int outbox_delete_single_expired(outbox_handle_t outbox, outbox_tick_t current_tick, outbox_tick_t timeout);
+/**
+ * @brief Deletes single publish message chosen by the overflow policy, to make room in a full outbox
+ *
+ * @param timeout   expiry timeout of the outbox, used to compare messages without their own deadline
+ *
+ * @return msg id of the deleted message, -1 if no message could be deleted (always for MQTT_OUTBOX_OVERFLOW_REJECT_NEW)
+ */
+int outbox_evict(outbox_handle_t outbox, esp_mqtt_outbox_overflow_policy_t policy, outbox_tick_t timeout);
 
 esp_err_t outbox_set_pending(outbox_handle_t outbox, int msg_id, pending_state_t pending);
+/**
+ * @brief Sets the state of the given message, e.g. of a QoS 0 message which has no unique message id
+ */
+esp_err_t outbox_item_set_pending(outbox_handle_t outbox, outbox_item_handle_t item, pending_state_t pending);
 pending_state_t outbox_item_get_pending(outbox_item_handle_t item);
+outbox_tick_t outbox_item_get_deadline(outbox_item_handle_t item);
+int outbox_item_get_priority(outbox_item_handle_t item);
+/**
+ * @brief Returns number of queued (not yet transmitted) messages of the given priority class
+ */
+size_t outbox_get_queued_count(outbox_handle_t outbox, int priority);
 esp_err_t outbox_set_tick(outbox_handle_t outbox, int msg_id, outbox_tick_t tick);
+/**
+ * @brief Returns msg id of the newest message recovered by outbox_init(), 0 if no message was recovered
+ *
+ * Lets the client continue numbering after the recovered messages, so new ids don't clash with them
+ */
+uint16_t outbox_get_recovered_msg_id(outbox_handle_t outbox);
 uint64_t outbox_get_size(outbox_handle_t outbox);
 void outbox_destroy(outbox_handle_t outbox);
 void outbox_delete_all_items(outbox_handle_t outbox);
+#if MQTT_OUTBOX_POOL
+void outbox_get_pool_stats(outbox_handle_t outbox, esp_mqtt_outbox_pool_stats_t *stats);
+#endif
 
 #ifdef  __cplusplus
 }
@@ -0,0 +1,39 @@
+/*
+ * This file is subject to the terms and conditions defined in
+ * file 'LICENSE', which is part of this source code package.
+ */
+#ifndef _MQTT_OUTBOX_POOL_H_
+#define _MQTT_OUTBOX_POOL_H_
+#include <stddef.h>
+#include <stdint.h>
+#include "mqtt_client.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+typedef struct outbox_pool *outbox_pool_handle_t;
+
+/**
+ * @brief Creates a memory pool for outbox items and their data
+ *
+ * Items of `item_size` bytes are carved out of slabs of `items_per_slab` entries, which are allocated
+ * on demand with `caps`. A single empty slab is kept, the other empty ones are returned to the heap.
+ * Data blocks are served from a single preallocated arena of `arena_size` bytes split into power of two
+ * size classes, released blocks are split to serve smaller classes and the arena starts over once it's
+ * empty. Blocks which don't fit into the largest class or into the exhausted arena fall back to the heap.
+ *
+ * @return pool handle, NULL if the arena couldn't be allocated
+ */
+outbox_pool_handle_t outbox_pool_create(size_t item_size, size_t items_per_slab, size_t arena_size, uint32_t caps);
+void *outbox_pool_item_alloc(outbox_pool_handle_t pool);
+void outbox_pool_item_free(outbox_pool_handle_t pool, void *item);
+void *outbox_pool_data_alloc(outbox_pool_handle_t pool, size_t len);
+void outbox_pool_data_free(outbox_pool_handle_t pool, void *data, size_t len);
+void outbox_pool_get_stats(outbox_pool_handle_t pool, esp_mqtt_outbox_pool_stats_t *stats);
+void outbox_pool_destroy(outbox_pool_handle_t pool);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,45 @@
+/*
+ * This file is subject to the terms and conditions defined in
+ * file 'LICENSE', which is part of this source code package.
+ */
+#ifndef _MQTT_SUBMIT_RING_H_
+#define _MQTT_SUBMIT_RING_H_
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+typedef struct mqtt_submit_ring *mqtt_submit_ring_handle_t;
+
+/**
+ * @brief Creates a bounded lock-free ring of pointers, for multiple producers and a single consumer
+ *
+ * Producers claim a slot by an atomic compare-and-swap of the write position and publish the pointer
+ * by the sequence number of the slot, so they never block each other nor the consumer.
+ * The ring is allocated in internal memory, as atomic operations are not supported in PSRAM.
+ *
+ * @param size  minimal number of slots, rounded up to a power of two
+ *
+ * @return ring handle, NULL if it couldn't be allocated
+ */
+mqtt_submit_ring_handle_t mqtt_submit_ring_create(size_t size);
+/**
+ * @brief Adds the pointer to the ring, could be called from any task
+ *
+ * @return false if the ring is full
+ */
+bool mqtt_submit_ring_push(mqtt_submit_ring_handle_t ring, void *item);
+/**
+ * @brief Removes the oldest pointer from the ring, must be called from a single task only
+ *
+ * @return the pointer, NULL if the ring is empty
+ */
+void *mqtt_submit_ring_pop(mqtt_submit_ring_handle_t ring);
+void mqtt_submit_ring_destroy(mqtt_submit_ring_handle_t ring);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
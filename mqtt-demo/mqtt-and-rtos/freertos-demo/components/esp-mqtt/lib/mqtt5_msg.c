@@ -187,6 +187,10 @@ static mqtt_message_t *fini_message(mqtt_connection_t *connection, int type, int
 
 static esp_err_t mqtt5_msg_set_user_property(mqtt5_user_property_handle_t *user_property, char *key, size_t key_len, char *value, size_t value_len)
 {
+    if (!user_property) {
+        // the caller reads the user properties in place, see mqtt5_msg_next_user_property()
+        return ESP_OK;
+    }
     if (!*user_property) {
         *user_property = calloc(1, sizeof(struct mqtt5_user_property_list_t));
         ESP_MEM_CHECK(TAG, *user_property, return ESP_FAIL);
@@ -299,38 +303,15 @@ uint16_t mqtt5_get_id(uint8_t *buffer, size_t length)
     }
 }
 
-char *mqtt5_get_publish_property_payload(uint8_t *buffer, size_t buffer_length, char **msg_topic, size_t *msg_topic_len, esp_mqtt5_publish_resp_property_t *resp_property, uint16_t *property_len, size_t *payload_len, mqtt5_user_property_handle_t *user_property)
+esp_err_t mqtt5_msg_parse_publish_property(uint8_t *property, size_t property_len, esp_mqtt5_publish_resp_property_t *resp_property, mqtt5_user_property_handle_t *user_property)
 {
-    *user_property = NULL;
-    uint8_t len_bytes = 0;
-    size_t offset = 1;
-    size_t totlen = get_variable_len(buffer, offset, buffer_length, &len_bytes);
-    offset += len_bytes;
-    totlen += offset;
-
-    size_t topic_len = buffer[offset ++] << 8;
-    topic_len |= buffer[offset ++] & 0xff;
-    *msg_topic = (char *)(buffer + offset);
-    *msg_topic_len = topic_len;
-    offset += topic_len;
-
-    if (offset >= buffer_length) {
-        return NULL;
+    if (user_property) {
+        *user_property = NULL;
     }
-
-    if (mqtt5_get_qos(buffer) > 0) {
-        if (offset + 2 >= buffer_length) {
-            return NULL;
-        }
-        offset += 2; // skip the message id
-    }
-
-    *property_len = get_variable_len(buffer, offset, buffer_length, &len_bytes);
-    offset += len_bytes;
-
-    uint16_t len = 0, property_offset = 0;
-    uint8_t *property = (buffer + offset);
-    while (property_offset < *property_len) {
+    uint8_t len_bytes = 0;
+    uint16_t len = 0;
+    size_t property_offset = 0;
+    while (property_offset < property_len) {
         uint8_t property_id = property[property_offset ++];
         switch (property_id) {
         case MQTT5_PROPERTY_PAYLOAD_FORMAT_INDICATOR:
@@ -358,7 +339,7 @@ char *mqtt5_get_publish_property_payload(uint8_t *buffer, size_t buffer_length,
             ESP_LOGD(TAG, "MQTT5_PROPERTY_CORRELATION_DATA length %d", resp_property->correlation_data_len);
             continue;
         case MQTT5_PROPERTY_SUBSCRIBE_IDENTIFIER:
-            resp_property->subscribe_id = get_variable_len(property, property_offset, buffer_length, &len_bytes);
+            resp_property->subscribe_id = get_variable_len(property, property_offset, property_len, &len_bytes);
             property_offset += len_bytes;
             ESP_LOGD(TAG, "MQTT5_PROPERTY_SUBSCRIBE_IDENTIFIER %d", resp_property->subscribe_id);
             continue;
@@ -385,7 +366,7 @@ char *mqtt5_get_publish_property_payload(uint8_t *buffer, size_t buffer_length,
                 esp_mqtt5_client_delete_user_property(*user_property);
                 *user_property = NULL;
                 ESP_LOGE(TAG, "mqtt5_msg_set_user_property fail");
-                return NULL;
+                return ESP_FAIL;
             }
             continue;
         }
@@ -396,17 +377,146 @@ char *mqtt5_get_publish_property_payload(uint8_t *buffer, size_t buffer_length,
             continue;
         default:
             ESP_LOGW(TAG, "Unknow publish property id 0x%02x", property_id);
-            return NULL;
+            return ESP_FAIL;
         }
     }
 
-    offset += property_offset;
-    if (totlen <= buffer_length) {
-        *payload_len = totlen - offset;
-    } else {
-        *payload_len = buffer_length - offset;
+    return ESP_OK;
+}
+
+/*
+ * Locates the property block of a received packet, without decoding it
+ */
+esp_err_t mqtt5_msg_get_property_block(uint8_t *buffer, size_t length, uint8_t **property, size_t *property_len)
+{
+    uint8_t len_bytes = 0;
+    size_t offset = 1;
+    size_t totlen = get_variable_len(buffer, offset, length, &len_bytes);
+    offset += len_bytes;
+    totlen += offset;
+    if (totlen > length) {
+        totlen = length;
+    }
+
+    *property = NULL;
+    *property_len = 0;
+    switch (mqtt5_get_type(buffer)) {
+    case MQTT_MSG_TYPE_PUBLISH:
+        if (offset + 2 > totlen) {
+            return ESP_FAIL;
+        }
+        offset += 2 + (buffer[offset] << 8 | buffer[offset + 1]);
+        if (mqtt5_get_qos(buffer) > 0) {
+            offset += 2; // skip the message id
+        }
+        break;
+    case MQTT_MSG_TYPE_PUBACK:
+    case MQTT_MSG_TYPE_PUBREC:
+    case MQTT_MSG_TYPE_PUBREL:
+    case MQTT_MSG_TYPE_PUBCOMP:
+        offset += 3; // skip the message id and reason code, both properties and reason code might be omitted
+        break;
+    case MQTT_MSG_TYPE_SUBACK:
+    case MQTT_MSG_TYPE_UNSUBACK:
+        offset += 2; // skip the message id
+        break;
+    case MQTT_MSG_TYPE_CONNACK:
+        offset += 2; // skip the acknowledge flags and reason code
+        break;
+    case MQTT_MSG_TYPE_DISCONNECT:
+        offset += 1; // skip the reason code
+        break;
+    default:
+        return ESP_OK;
+    }
+    if (offset >= totlen) {
+        return ESP_OK;
+    }
+    size_t len = get_variable_len(buffer, offset, totlen, &len_bytes);
+    offset += len_bytes;
+    if (len_bytes == 0 || offset + len > totlen) {
+        return ESP_FAIL;
+    }
+    *property = buffer + offset;
+    *property_len = len;
+    return ESP_OK;
+}
+
+bool mqtt5_msg_next_user_property(const uint8_t *property, size_t property_len, size_t *offset, esp_mqtt5_user_property_ref_t *item)
+{
+    size_t i = *offset;
+    while (i < property_len) {
+        uint8_t property_id = property[i ++];
+        size_t len = 0;
+        switch (property_id) {
+        case MQTT5_PROPERTY_PAYLOAD_FORMAT_INDICATOR:
+        case MQTT5_PROPERTY_REQUEST_PROBLEM_INFO:
+        case MQTT5_PROPERTY_REQUEST_RESP_INFO:
+        case MQTT5_PROPERTY_MAXIMUM_QOS:
+        case MQTT5_PROPERTY_RETAIN_AVAILABLE:
+        case MQTT5_PROPERTY_WILDCARD_SUBSCR_AVAILABLE:
+        case MQTT5_PROPERTY_SUBSCR_IDENTIFIER_AVAILABLE:
+        case MQTT5_PROPERTY_SHARED_SUBSCR_AVAILABLE:
+            len = 1;
+            break;
+        case MQTT5_PROPERTY_SERVER_KEEP_ALIVE:
+        case MQTT5_PROPERTY_RECEIVE_MAXIMUM:
+        case MQTT5_PROPERTY_TOPIC_ALIAS_MAXIMIM:
+        case MQTT5_PROPERTY_TOPIC_ALIAS:
+            len = 2;
+            break;
+        case MQTT5_PROPERTY_MESSAGE_EXPIRY_INTERVAL:
+        case MQTT5_PROPERTY_SESSION_EXPIRY_INTERVAL:
+        case MQTT5_PROPERTY_WILL_DELAY_INTERVAL:
+        case MQTT5_PROPERTY_MAXIMUM_PACKET_SIZE:
+            len = 4;
+            break;
+        case MQTT5_PROPERTY_SUBSCRIBE_IDENTIFIER: {
+            uint8_t len_bytes = 0;
+            get_variable_len((uint8_t *)property, i, property_len, &len_bytes);
+            len = len_bytes;
+            break;
+        }
+        case MQTT5_PROPERTY_CONTENT_TYPE:
+        case MQTT5_PROPERTY_RESPONSE_TOPIC:
+        case MQTT5_PROPERTY_CORRELATION_DATA:
+        case MQTT5_PROPERTY_ASSIGNED_CLIENT_IDENTIFIER:
+        case MQTT5_PROPERTY_AUTHENTICATION_METHOD:
+        case MQTT5_PROPERTY_AUTHENTICATION_DATA:
+        case MQTT5_PROPERTY_RESP_INFO:
+        case MQTT5_PROPERTY_SERVER_REFERENCE:
+        case MQTT5_PROPERTY_REASON_STRING:
+            if (i + 2 > property_len) {
+                return false;
+            }
+            len = 2 + (property[i] << 8 | property[i + 1]);
+            break;
+        case MQTT5_PROPERTY_USER_PROPERTY:
+            if (i + 2 > property_len) {
+                return false;
+            }
+            item->key_len = property[i] << 8 | property[i + 1];
+            item->key = (const char *)property + i + 2;
+            i += 2 + item->key_len;
+            if (i + 2 > property_len) {
+                return false;
+            }
+            item->value_len = property[i] << 8 | property[i + 1];
+            item->value = (const char *)property + i + 2;
+            i += 2 + item->value_len;
+            if (i > property_len) {
+                return false;
+            }
+            *offset = i;
+            return true;
+        default:
+            ESP_LOGW(TAG, "Unknow property id 0x%02x", property_id);
+            return false;
+        }
+        i += len;
     }
-    return (char *)(buffer + offset);
+    *offset = i;
+    return false;
 }
 
 char *mqtt5_get_suback_data(uint8_t *buffer, size_t *length, mqtt5_user_property_handle_t *user_property)
@@ -424,7 +534,9 @@ char *mqtt5_get_suback_data(uint8_t *buffer, size_t *length, mqtt5_user_property
     if (offset < totlen) {
         size_t property_len = get_variable_len(buffer, offset, totlen, &len_bytes);
         offset += len_bytes;
-        *user_property = mqtt5_msg_get_user_property(buffer + offset, property_len);
+        if (user_property) {
+            *user_property = mqtt5_msg_get_user_property(buffer + offset, property_len);
+        }
         offset += property_len;
         if (offset < totlen) {
             *length =  totlen - offset;
@@ -432,7 +544,9 @@ char *mqtt5_get_suback_data(uint8_t *buffer, size_t *length, mqtt5_user_property
         }
     }
 err:
-    *user_property = NULL;
+    if (user_property) {
+        *user_property = NULL;
+    }
     *length = 0;
     return NULL;
 }
@@ -453,7 +567,9 @@ char *mqtt5_get_puback_data(uint8_t *buffer, size_t *length, mqtt5_user_property
         if (offset < totlen) {
             size_t property_len = get_variable_len(buffer, offset, totlen, &len_bytes);
             offset += len_bytes;
-            *user_property = mqtt5_msg_get_user_property(buffer + offset, property_len);
+            if (user_property) {
+                *user_property = mqtt5_msg_get_user_property(buffer + offset, property_len);
+            }
         }
         return data;
     } else {
@@ -580,7 +696,9 @@ mqtt_message_t *mqtt5_msg_connect(mqtt_connection_t *connection, mqtt_connect_in
 esp_err_t mqtt5_msg_parse_connack_property(uint8_t *buffer, size_t buffer_len, mqtt_connect_info_t *connection_info, esp_mqtt5_connection_property_storage_t *connection_property, esp_mqtt5_connection_server_resp_property_t *resp_property, int *reason_code, uint8_t *ack_flag, mqtt5_user_property_handle_t *user_property)
 {
     *reason_code = 0;
-    *user_property = NULL;
+    if (user_property) {
+        *user_property = NULL;
+    }
     uint8_t len_bytes = 0;
     size_t offset = 1;
     size_t totlen = get_variable_len(buffer, offset, buffer_len, &len_bytes);
@@ -724,7 +842,8 @@ mqtt_message_t *mqtt5_msg_publish(mqtt_connection_t *connection, const char *top
 {
     init_message(connection);
 
-    if (topic == NULL || topic[0] == '\0') {
+    // empty topic refers to the topic of an alias already sent on the connection
+    if (topic == NULL || (topic[0] == '\0' && !(property && property->topic_alias))) {
         return fail_message(connection);
     }
 
@@ -791,10 +910,8 @@ mqtt_message_t *mqtt5_msg_publish(mqtt_connection_t *connection, const char *top
     APPEND_CHECK(update_property_len_value(connection, connection->outbound_message.length - properties_offset - 1, properties_offset), fail_message(connection));
 
     if (connection->outbound_message.length + data_length > connection->buffer_length) {
-        // Not enough size in buffer -> fragment this message
+        // Not enough size in buffer -> encode only the header, the payload is sent from the user data
         connection->outbound_message.fragmented_msg_data_offset = connection->outbound_message.length;
-        memcpy(connection->buffer + connection->outbound_message.length, data, connection->buffer_length - connection->outbound_message.length);
-        connection->outbound_message.length = connection->buffer_length;
         connection->outbound_message.fragmented_msg_total_length = data_length + connection->outbound_message.fragmented_msg_data_offset;
     } else {
         if (data != NULL) {
@@ -806,6 +923,128 @@ mqtt_message_t *mqtt5_msg_publish(mqtt_connection_t *connection, const char *top
     return fini_message(connection, MQTT_MSG_TYPE_PUBLISH, 0, qos, retain);
 }
 
+esp_err_t mqtt5_msg_set_publish_expiry(uint8_t *buffer, size_t length, uint32_t message_expiry_interval)
+{
+    if (length < 2 || mqtt5_get_type(buffer) != MQTT_MSG_TYPE_PUBLISH) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    uint8_t len_bytes = 0;
+    size_t offset = 1;
+    get_variable_len(buffer, offset, length, &len_bytes);
+    offset += len_bytes;
+    if (offset + 2 > length) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    size_t topic_len = buffer[offset] << 8 | buffer[offset + 1];
+    offset += 2 + topic_len;
+    if (mqtt5_get_qos(buffer) > 0) {
+        offset += 2; // skip the message id
+    }
+    if (offset >= length) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    size_t property_len = get_variable_len(buffer, offset, length, &len_bytes);
+    offset += len_bytes;
+    size_t property_end = offset + property_len;
+    // mqtt5_msg_publish() encodes the expiry interval first, only preceded by the payload format indicator
+    while (offset < property_end && property_end <= length) {
+        uint8_t property_id = buffer[offset ++];
+        if (property_id == MQTT5_PROPERTY_PAYLOAD_FORMAT_INDICATOR) {
+            offset ++;
+        } else if (property_id == MQTT5_PROPERTY_MESSAGE_EXPIRY_INTERVAL && offset + 4 <= property_end) {
+            buffer[offset ++] = (message_expiry_interval >> 24) & 0xff;
+            buffer[offset ++] = (message_expiry_interval >> 16) & 0xff;
+            buffer[offset ++] = (message_expiry_interval >> 8) & 0xff;
+            buffer[offset ++] = message_expiry_interval & 0xff;
+            return ESP_OK;
+        } else {
+            break;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t mqtt5_msg_publish_set_topic_alias(mqtt_connection_t *connection, uint16_t topic_alias, bool keep_topic)
+{
+    mqtt_message_t *message = &connection->outbound_message;
+    uint8_t *buffer = message->data;
+    size_t length = message->length;
+    if (length < 2 || mqtt5_get_type(buffer) != MQTT_MSG_TYPE_PUBLISH) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    uint8_t fixed_header = buffer[0];
+    uint8_t len_bytes = 0;
+    size_t remaining_len = get_variable_len(buffer, 1, length, &len_bytes);
+    size_t variable_header_offset = 1 + len_bytes;
+    size_t offset = variable_header_offset;
+    if (offset + 2 > length) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    size_t topic_len = buffer[offset] << 8 | buffer[offset + 1];
+    offset += 2;
+    size_t topic_offset = offset;
+    offset += topic_len;
+    uint8_t message_id[2] = {0};
+    size_t message_id_len = mqtt5_get_qos(buffer) > 0 ? 2 : 0;
+    if (offset + message_id_len >= length) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(message_id, buffer + offset, message_id_len);
+    offset += message_id_len;
+    size_t property_len = get_variable_len(buffer, offset, length, &len_bytes);
+    size_t payload_offset = offset + len_bytes + property_len;
+    if (payload_offset > length || payload_offset - variable_header_offset > remaining_len) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    size_t payload_len = remaining_len - (payload_offset - variable_header_offset);
+
+    uint8_t property_lens[4] = {0}, property_len_bytes = 0;
+    uint8_t remaining_lens[4] = {0}, remaining_len_bytes = 0;
+    generate_variable_len(property_len + 3, &property_len_bytes, property_lens);
+    size_t new_topic_len = keep_topic ? topic_len : 0;
+    size_t variable_header_len = 2 + new_topic_len + message_id_len + property_len_bytes + property_len + 3;
+    generate_variable_len(variable_header_len + payload_len, &remaining_len_bytes, remaining_lens);
+    size_t header_len = 1 + remaining_len_bytes + variable_header_len;
+
+    // the payload stays in place, the message is moved only if the header grows beyond the room in front of it
+    size_t room = buffer - connection->buffer;
+    if (header_len > payload_offset + room) {
+        size_t shift = header_len - payload_offset - room;
+        if (room + length + shift > connection->buffer_length) {
+            return ESP_ERR_NO_MEM;
+        }
+        memmove(buffer + shift, buffer, length);
+        buffer += shift;
+    }
+    uint8_t *payload = buffer + payload_offset;
+    // properties keep their place right in front of the payload, the other fields are written backwards,
+    // starting with the topic as the fields in front of it might overwrite its old place
+    uint8_t *pos = payload - property_len - 3 - property_len_bytes - message_id_len - new_topic_len;
+    memmove(pos, buffer + topic_offset, new_topic_len);
+    pos = payload - property_len;
+    *--pos = topic_alias & 0xff;
+    *--pos = topic_alias >> 8;
+    *--pos = MQTT5_PROPERTY_TOPIC_ALIAS;
+    pos -= property_len_bytes;
+    memcpy(pos, property_lens, property_len_bytes);
+    pos -= message_id_len;
+    memcpy(pos, message_id, message_id_len);
+    pos -= new_topic_len;
+    *--pos = new_topic_len & 0xff;
+    *--pos = new_topic_len >> 8;
+    pos -= remaining_len_bytes;
+    memcpy(pos, remaining_lens, remaining_len_bytes);
+    *--pos = fixed_header;
+
+    message->data = pos;
+    message->length = header_len + (length - payload_offset);
+    if (message->fragmented_msg_total_length) {
+        message->fragmented_msg_total_length += header_len - payload_offset;
+        message->fragmented_msg_data_offset = header_len;
+    }
+    return ESP_OK;
+}
+
 int mqtt5_msg_get_reason_code(uint8_t *buffer, size_t length)
 {
     uint8_t len_bytes = 0;
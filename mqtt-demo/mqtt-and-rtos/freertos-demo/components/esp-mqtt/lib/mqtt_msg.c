@@ -263,13 +263,74 @@ char *mqtt_get_publish_data(uint8_t *buffer, size_t *length)
     return (char *)(buffer + i);
 }
 
+/*
+ * Decodes all fields of a PUBLISH message in a single pass, `length` is the part of the message in the buffer
+ * (at least the whole header). The MQTT5 property block is only located, see mqtt5_msg_parse_publish_property().
+ */
+esp_err_t mqtt_msg_parse_publish(uint8_t *buffer, size_t length, bool has_properties, mqtt_publish_view_t *view)
+{
+    int fixed_header_len = 0;
+    size_t total_len = mqtt_get_total_length(buffer, length, &fixed_header_len);
+    size_t end = total_len < length ? total_len : length;
+    size_t offset = fixed_header_len;
+
+    view->qos = mqtt_get_qos(buffer);
+    view->dup = mqtt_get_dup(buffer);
+    view->retain = mqtt_get_retain(buffer);
+    if (offset + 2 > end) {
+        return ESP_FAIL;
+    }
+    view->topic_len = buffer[offset] << 8 | buffer[offset + 1];
+    offset += 2;
+    if (offset + view->topic_len > end) {
+        return ESP_FAIL;
+    }
+    view->topic = (char *)(buffer + offset);
+    offset += view->topic_len;
+
+    view->msg_id = 0;
+    if (view->qos > 0) {
+        if (offset + 2 > end) {
+            return ESP_FAIL;
+        }
+        view->msg_id = buffer[offset] << 8 | buffer[offset + 1];
+        offset += 2;
+    }
+
+    view->properties = NULL;
+    view->properties_len = 0;
+    if (has_properties) {
+        size_t properties_len = 0;
+        int shift = 0;
+        do {
+            if (offset >= end || shift > 21) {
+                return ESP_FAIL;
+            }
+            properties_len |= (size_t)(buffer[offset] & 0x7f) << shift;
+            shift += 7;
+        } while (buffer[offset++] & 0x80);
+        if (offset + properties_len > end) {
+            return ESP_FAIL;
+        }
+        view->properties = buffer + offset;
+        view->properties_len = properties_len;
+        offset += properties_len;
+    }
+
+    view->data = (char *)(buffer + offset);
+    view->data_len = end - offset;
+    view->total_data_len = total_len - offset;
+    return ESP_OK;
+}
+
 char *mqtt_get_suback_data(uint8_t *buffer, size_t *length)
 {
-    // SUBACK payload length = total length - (fixed header (2 bytes) + variable header (2 bytes))
-    // This requires the remaining length to be encoded in 1 byte.
-    if (*length > 4) {
-        *length -= 4;
-        return (char *)(buffer + 4);
+    // SUBACK payload length = total length - (fixed header + variable header (2 bytes))
+    int fixed_header_len = 0;
+    mqtt_get_total_length(buffer, *length, &fixed_header_len);
+    if (*length > fixed_header_len + 2) {
+        *length -= fixed_header_len + 2;
+        return (char *)(buffer + fixed_header_len + 2);
     }
     *length = 0;
     return NULL;
@@ -323,10 +384,11 @@ uint16_t mqtt_get_id(uint8_t *buffer, size_t length)
     case MQTT_MSG_TYPE_UNSUBACK:
     case MQTT_MSG_TYPE_SUBSCRIBE:
     case MQTT_MSG_TYPE_UNSUBSCRIBE: {
-        // This requires the remaining length to be encoded in 1 byte,
-        // which it should be.
-        if (length >= 4 && (buffer[1] & 0x80) == 0) {
-            return (buffer[2] << 8) | buffer[3];
+        // SUBACK of many topics might have the remaining length encoded in more than 1 byte
+        int fixed_header_len = 0;
+        mqtt_get_total_length(buffer, length, &fixed_header_len);
+        if (length >= fixed_header_len + 2) {
+            return (buffer[fixed_header_len] << 8) | buffer[fixed_header_len + 1];
         } else {
             return 0;
         }
@@ -462,10 +524,8 @@ mqtt_message_t *mqtt_msg_publish(mqtt_connection_t *connection, const char *topi
 
     if (data != NULL) {
         if (connection->outbound_message.length + data_length > connection->buffer_length) {
-            // Not enough size in buffer -> fragment this message
+            // Not enough size in buffer -> encode only the header, the payload is sent from the user data
             connection->outbound_message.fragmented_msg_data_offset = connection->outbound_message.length;
-            memcpy(connection->buffer + connection->outbound_message.length, data, connection->buffer_length - connection->outbound_message.length);
-            connection->outbound_message.length = connection->buffer_length;
             connection->outbound_message.fragmented_msg_total_length = data_length + connection->outbound_message.fragmented_msg_data_offset;
         } else {
             memcpy(connection->buffer + connection->outbound_message.length, data, data_length);
@@ -476,6 +536,52 @@ mqtt_message_t *mqtt_msg_publish(mqtt_connection_t *connection, const char *topi
     return fini_message(connection, MQTT_MSG_TYPE_PUBLISH, 0, qos, retain);
 }
 
+/*
+ * Creates a publish message of an already encoded topic (and MQTT5 properties following
+ * the topic at topic_len), the packet id is inserted between the two for QoS > 0
+ */
+mqtt_message_t *mqtt_msg_publish_encoded(mqtt_connection_t *connection, const uint8_t *encoded, int encoded_len, int topic_len, const char *data, int data_length, int qos, int retain, uint16_t *message_id)
+{
+    set_message_header_size(connection);
+
+    if (connection->outbound_message.length + encoded_len > connection->buffer_length) {
+        return fail_message(connection);
+    }
+    memcpy(connection->buffer + connection->outbound_message.length, encoded, topic_len);
+    connection->outbound_message.length += topic_len;
+
+    if (data == NULL && data_length > 0) {
+        return fail_message(connection);
+    }
+
+    if (qos > 0) {
+        if ((*message_id = append_message_id(connection, 0)) == 0) {
+            return fail_message(connection);
+        }
+    } else {
+        *message_id = 0;
+    }
+
+    if (connection->outbound_message.length + encoded_len - topic_len > connection->buffer_length) {
+        return fail_message(connection);
+    }
+    memcpy(connection->buffer + connection->outbound_message.length, encoded + topic_len, encoded_len - topic_len);
+    connection->outbound_message.length += encoded_len - topic_len;
+
+    if (connection->outbound_message.length + data_length > connection->buffer_length) {
+        // Not enough size in buffer -> encode only the header, the payload is sent from the user data
+        connection->outbound_message.fragmented_msg_data_offset = connection->outbound_message.length;
+        connection->outbound_message.fragmented_msg_total_length = data_length + connection->outbound_message.fragmented_msg_data_offset;
+    } else {
+        if (data != NULL) {
+            memcpy(connection->buffer + connection->outbound_message.length, data, data_length);
+            connection->outbound_message.length += data_length;
+        }
+        connection->outbound_message.fragmented_msg_total_length = 0;
+    }
+    return fini_message(connection, MQTT_MSG_TYPE_PUBLISH, 0, qos, retain);
+}
+
 mqtt_message_t *mqtt_msg_puback(mqtt_connection_t *connection, uint16_t message_id)
 {
     set_message_header_size(connection);
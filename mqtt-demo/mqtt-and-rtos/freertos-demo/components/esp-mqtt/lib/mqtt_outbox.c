@@ -3,13 +3,47 @@
 #include <stdlib.h>
 #include <string.h>
 #include "mqtt_config.h"
+#include "mqtt_msg.h"
 #include "sys/queue.h"
 #include "esp_heap_caps.h"
 #include "esp_log.h"
+#if MQTT_OUTBOX_POOL
+#include "mqtt_outbox_pool.h"
+#endif
 
-#ifndef CONFIG_MQTT_CUSTOM_OUTBOX
+#if !defined(CONFIG_MQTT_CUSTOM_OUTBOX) && !MQTT_OUTBOX_RING && !MQTT_OUTBOX_PERSISTENT
 static const char *TAG = "outbox";
 
+/*
+ * Items are kept in insertion order in a doubly linked list and are also
+ * chained into a hash index keyed by the 16-bit packet id, so that lookups
+ * and removals driven by incoming acknowledgements don't need to walk
+ * the whole outbox. QoS 0 messages carry no packet id and are not indexed.
+ * Each item is additionally linked into the FIFO of its pending state, kept
+ * in tick order, so the next item to send or retransmit is always the head
+ * of the respective queue. Queued items wait in a FIFO per priority class,
+ * the next one to send is picked among the heads of these FIFOs.
+ * Expiry uses a binary min-heap ordered by item tick, so the oldest item is
+ * checked in constant time and each expired item costs a logarithmic removal,
+ * instead of scanning the whole outbox on every iteration of the client loop.
+ * Items with their own deadline are also kept in a second heap ordered by it.
+ * Queued publish messages enqueued with coalescing are hashed by topic,
+ * so that a newer message on the same topic replaces the queued one in place.
+ * Publish messages are also linked into a FIFO per QoS level, so that the overflow
+ * policies find the message to evict without scanning the outbox.
+ */
+#define OUTBOX_INDEX_INITIAL_SIZE   (16)
+#define OUTBOX_INDEX_MAX_SIZE       (1 << 16)
+#define OUTBOX_HEAP_INITIAL_SIZE    (16)
+#define OUTBOX_COALESCE_BUCKETS     (16)
+#define OUTBOX_QOS_LEVELS           (3)
+
+enum {
+    OUTBOX_HEAP_TICK,
+    OUTBOX_HEAP_DEADLINE,
+    OUTBOX_HEAPS
+};
+
 typedef struct outbox_item {
     char *buffer;
     int len;
@@ -17,57 +51,533 @@ typedef struct outbox_item {
     int msg_type;
     int msg_qos;
     outbox_tick_t tick;
+    outbox_tick_t deadline;
+    int priority;
     pending_state_t pending;
-    STAILQ_ENTRY(outbox_item) next;
+    TAILQ_ENTRY(outbox_item) next;
+    TAILQ_ENTRY(outbox_item) state_next;
+    TAILQ_ENTRY(outbox_item) qos_next;
+    uint32_t qos_seq;
+    struct outbox_item *index_next;
+    size_t heap_pos[OUTBOX_HEAPS];
+    bool coalesce;
+    uint32_t topic_hash;
+    struct outbox_item *coalesce_next;
 } outbox_item_t;
 
-STAILQ_HEAD(outbox_list_t, outbox_item);
+TAILQ_HEAD(outbox_list_t, outbox_item);
+
+typedef struct outbox_heap {
+    outbox_item_handle_t *items;
+    size_t count;
+    size_t size;
+} outbox_heap_t;
 
 struct outbox_t {
     uint64_t size;
     struct outbox_list_t *list;
+    struct outbox_list_t state_queue[CONFIRMED + 1];  // the queue of QUEUED items is split by priority
+    struct outbox_list_t priority_queue[MQTT_PRIORITY_MAX];
+    size_t queued_count[MQTT_PRIORITY_MAX];
+    struct outbox_list_t qos_queue[OUTBOX_QOS_LEVELS];
+    uint32_t qos_seq;   // numbers publish messages in the order they join the QoS FIFOs
+    outbox_item_handle_t *index;
+    size_t index_size;
+    size_t count;       // items in the index
+    outbox_heap_t heap[OUTBOX_HEAPS];
+    outbox_item_handle_t coalesce_index[OUTBOX_COALESCE_BUCKETS];
+#if MQTT_OUTBOX_POOL
+    outbox_pool_handle_t pool;
+#endif
 };
 
+static outbox_item_handle_t outbox_item_alloc(outbox_handle_t outbox)
+{
+#if MQTT_OUTBOX_POOL
+    return outbox_pool_item_alloc(outbox->pool);
+#else
+    return calloc(1, sizeof(outbox_item_t));
+#endif
+}
+
+static char *outbox_data_alloc(outbox_handle_t outbox, size_t len)
+{
+#if MQTT_OUTBOX_POOL
+    return outbox_pool_data_alloc(outbox->pool, len);
+#else
+    return heap_caps_malloc(len, MQTT_OUTBOX_MEMORY);
+#endif
+}
+
+static void outbox_data_free(outbox_handle_t outbox, char *data, size_t len)
+{
+#if MQTT_OUTBOX_POOL
+    if (data) {
+        outbox_pool_data_free(outbox->pool, data, len);
+    }
+#else
+    free(data);
+#endif
+}
+
+static void outbox_item_release(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    outbox_data_free(outbox, item->buffer, item->len);
+#if MQTT_OUTBOX_POOL
+    outbox_pool_item_free(outbox->pool, item);
+#else
+    free(item);
+#endif
+}
+
+static inline outbox_item_handle_t *outbox_index_bucket(outbox_handle_t outbox, int msg_id)
+{
+    return &outbox->index[(unsigned)msg_id & (outbox->index_size - 1)];
+}
+
+// Appends to the tail of the bucket chain, so items sharing the same id are found in the same order
+// as they were enqueued
+static void outbox_index_append(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    outbox_item_handle_t *slot = outbox_index_bucket(outbox, item->msg_id);
+    while (*slot) {
+        slot = &(*slot)->index_next;
+    }
+    item->index_next = NULL;
+    *slot = item;
+}
+
+static void outbox_index_grow(outbox_handle_t outbox)
+{
+    if (outbox->count <= outbox->index_size || outbox->index_size >= OUTBOX_INDEX_MAX_SIZE) {
+        return;
+    }
+    outbox_item_handle_t *index = calloc(outbox->index_size * 2, sizeof(outbox_item_handle_t));
+    if (index == NULL) {
+        // keep the current index, lookups remain correct only with longer chains
+        ESP_LOGW(TAG, "Failed to grow outbox index of %zu buckets", outbox->index_size);
+        return;
+    }
+    free(outbox->index);
+    outbox->index = index;
+    outbox->index_size *= 2;
+    // rehash in list order to keep the enqueue order of items with the same id
+    outbox_item_handle_t item;
+    TAILQ_FOREACH(item, outbox->list, next) {
+        if (item->msg_id != 0) {
+            outbox_index_append(outbox, item);
+        }
+    }
+}
+
+/*
+ * QoS 0 publish messages have no packet id, they all share id 0 and are never looked up by it,
+ * so they're left out of the index instead of piling up in a single bucket chain
+ */
+static void outbox_index_insert(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    if (item->msg_id == 0) {
+        return;
+    }
+    outbox_index_append(outbox, item);
+    outbox->count++;
+    outbox_index_grow(outbox);
+}
+
+static void outbox_index_remove(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    if (item->msg_id == 0) {
+        return;
+    }
+    outbox_item_handle_t *slot = outbox_index_bucket(outbox, item->msg_id);
+    while (*slot) {
+        if (*slot == item) {
+            *slot = item->index_next;
+            item->index_next = NULL;
+            outbox->count--;
+            return;
+        }
+        slot = &(*slot)->index_next;
+    }
+}
+
+static inline outbox_tick_t outbox_heap_key(int heap, outbox_item_handle_t item)
+{
+    return heap == OUTBOX_HEAP_TICK ? item->tick : item->deadline;
+}
+
+static inline void outbox_heap_set(outbox_heap_t *h, int heap, size_t pos, outbox_item_handle_t item)
+{
+    h->items[pos] = item;
+    item->heap_pos[heap] = pos;
+}
+
+static void outbox_heap_sift_up(outbox_handle_t outbox, int heap, size_t pos)
+{
+    outbox_heap_t *h = &outbox->heap[heap];
+    outbox_item_handle_t item = h->items[pos];
+    while (pos > 0) {
+        size_t parent = (pos - 1) / 2;
+        if (outbox_heap_key(heap, h->items[parent]) <= outbox_heap_key(heap, item)) {
+            break;
+        }
+        outbox_heap_set(h, heap, pos, h->items[parent]);
+        pos = parent;
+    }
+    outbox_heap_set(h, heap, pos, item);
+}
+
+static void outbox_heap_sift_down(outbox_handle_t outbox, int heap, size_t pos)
+{
+    outbox_heap_t *h = &outbox->heap[heap];
+    outbox_item_handle_t item = h->items[pos];
+    for (;;) {
+        size_t child = 2 * pos + 1;
+        if (child >= h->count) {
+            break;
+        }
+        if (child + 1 < h->count && outbox_heap_key(heap, h->items[child + 1]) < outbox_heap_key(heap, h->items[child])) {
+            child++;
+        }
+        if (outbox_heap_key(heap, item) <= outbox_heap_key(heap, h->items[child])) {
+            break;
+        }
+        outbox_heap_set(h, heap, pos, h->items[child]);
+        pos = child;
+    }
+    outbox_heap_set(h, heap, pos, item);
+}
+
+static esp_err_t outbox_heap_reserve(outbox_handle_t outbox, int heap)
+{
+    outbox_heap_t *h = &outbox->heap[heap];
+    if (h->count < h->size) {
+        return ESP_OK;
+    }
+    outbox_item_handle_t *items = realloc(h->items, h->size * 2 * sizeof(outbox_item_handle_t));
+    ESP_MEM_CHECK(TAG, items, return ESP_ERR_NO_MEM);
+    h->items = items;
+    h->size *= 2;
+    return ESP_OK;
+}
+
+// Expects the space to be reserved by outbox_heap_reserve()
+static void outbox_heap_insert(outbox_handle_t outbox, int heap, outbox_item_handle_t item)
+{
+    outbox_heap_t *h = &outbox->heap[heap];
+    outbox_heap_set(h, heap, h->count++, item);
+    outbox_heap_sift_up(outbox, heap, item->heap_pos[heap]);
+}
+
+static void outbox_heap_remove(outbox_handle_t outbox, int heap, outbox_item_handle_t item)
+{
+    outbox_heap_t *h = &outbox->heap[heap];
+    size_t pos = item->heap_pos[heap];
+    outbox_item_handle_t last = h->items[--h->count];
+    if (last == item) {
+        return;
+    }
+    outbox_heap_set(h, heap, pos, last);
+    if (pos > 0 && outbox_heap_key(heap, h->items[(pos - 1) / 2]) > outbox_heap_key(heap, last)) {
+        outbox_heap_sift_up(outbox, heap, pos);
+    } else {
+        outbox_heap_sift_down(outbox, heap, pos);
+    }
+}
+
+static inline outbox_item_handle_t outbox_heap_top(outbox_handle_t outbox, int heap)
+{
+    return outbox->heap[heap].count > 0 ? outbox->heap[heap].items[0] : NULL;
+}
+
+// Returns the item which expired first, either by the outbox timeout or by its own deadline
+static outbox_item_handle_t outbox_get_expired(outbox_handle_t outbox, outbox_tick_t current_tick, outbox_tick_t timeout)
+{
+    outbox_item_handle_t item = outbox_heap_top(outbox, OUTBOX_HEAP_TICK);
+    if (item && current_tick - item->tick > timeout) {
+        return item;
+    }
+    item = outbox_heap_top(outbox, OUTBOX_HEAP_DEADLINE);
+    if (item && current_tick >= item->deadline) {
+        return item;
+    }
+    return NULL;
+}
+
+static uint32_t outbox_topic_hash(const char *topic, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)topic[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void outbox_coalesce_insert(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    size_t topic_len = item->len;
+    const char *topic = mqtt_get_publish_topic((uint8_t *)item->buffer, &topic_len);
+    if (topic == NULL || topic_len == 0) {
+        // e.g. MQTT5 publish using a topic alias
+        return;
+    }
+    item->coalesce = true;
+    item->topic_hash = outbox_topic_hash(topic, topic_len);
+    outbox_item_handle_t *bucket = &outbox->coalesce_index[item->topic_hash % OUTBOX_COALESCE_BUCKETS];
+    item->coalesce_next = *bucket;
+    *bucket = item;
+}
+
+static void outbox_coalesce_remove(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    if (!item->coalesce) {
+        return;
+    }
+    outbox_item_handle_t *slot = &outbox->coalesce_index[item->topic_hash % OUTBOX_COALESCE_BUCKETS];
+    while (*slot) {
+        if (*slot == item) {
+            *slot = item->coalesce_next;
+            break;
+        }
+        slot = &(*slot)->coalesce_next;
+    }
+    item->coalesce = false;
+    item->coalesce_next = NULL;
+}
+
+static outbox_item_handle_t outbox_coalesce_find(outbox_handle_t outbox, const char *topic, size_t topic_len)
+{
+    uint32_t hash = outbox_topic_hash(topic, topic_len);
+    outbox_item_handle_t item;
+    for (item = outbox->coalesce_index[hash % OUTBOX_COALESCE_BUCKETS]; item; item = item->coalesce_next) {
+        size_t len = item->len;
+        const char *item_topic = item->topic_hash == hash ? mqtt_get_publish_topic((uint8_t *)item->buffer, &len) : NULL;
+        if (item_topic && len == topic_len && memcmp(item_topic, topic, len) == 0) {
+            return item;
+        }
+    }
+    return NULL;
+}
+
+static inline int outbox_message_priority(outbox_message_handle_t message)
+{
+    return message->priority >= MQTT_PRIORITY_CONTROL && message->priority < MQTT_PRIORITY_MAX ? message->priority : MQTT_PRIORITY_NORMAL;
+}
+
+static void outbox_state_queue_insert(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    if (item->pending == QUEUED) {
+        TAILQ_INSERT_TAIL(&outbox->priority_queue[item->priority], item, state_next);
+        outbox->queued_count[item->priority]++;
+    } else {
+        TAILQ_INSERT_TAIL(&outbox->state_queue[item->pending], item, state_next);
+    }
+}
+
+static void outbox_state_queue_remove(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    if (item->pending == QUEUED) {
+        TAILQ_REMOVE(&outbox->priority_queue[item->priority], item, state_next);
+        outbox->queued_count[item->priority]--;
+    } else {
+        TAILQ_REMOVE(&outbox->state_queue[item->pending], item, state_next);
+    }
+}
+
+// Queued items gain one class for each aging interval they wait, but never overtake the control class
+static outbox_tick_t outbox_item_effective_priority(outbox_item_handle_t item, outbox_tick_t current_tick)
+{
+    outbox_tick_t priority = item->priority;
+    if (OUTBOX_PRIORITY_AGING_MS > 0 && current_tick > item->tick) {
+        priority -= (current_tick - item->tick) / OUTBOX_PRIORITY_AGING_MS;
+    }
+    return priority < MQTT_PRIORITY_CONTROL ? MQTT_PRIORITY_CONTROL : priority;
+}
+
+static inline bool outbox_item_in_qos_queue(outbox_item_handle_t item)
+{
+    return item->msg_type == MQTT_MSG_TYPE_PUBLISH && item->msg_qos >= 0 && item->msg_qos < OUTBOX_QOS_LEVELS;
+}
+
+static void outbox_qos_queue_insert(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    item->qos_seq = outbox->qos_seq++;
+    TAILQ_INSERT_TAIL(&outbox->qos_queue[item->msg_qos], item, qos_next);
+}
+
+// Returns the oldest publish message, i.e. the oldest head of the QoS FIFOs, other messages are never evicted
+static outbox_item_handle_t outbox_oldest_publish(outbox_handle_t outbox)
+{
+    outbox_item_handle_t oldest = NULL;
+    for (int qos = 0; qos < OUTBOX_QOS_LEVELS; qos++) {
+        outbox_item_handle_t head = TAILQ_FIRST(&outbox->qos_queue[qos]);
+        if (head && (oldest == NULL || (int32_t)(head->qos_seq - oldest->qos_seq) < 0)) {
+            oldest = head;
+        }
+    }
+    return oldest;
+}
+
+static void outbox_item_free(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    TAILQ_REMOVE(outbox->list, item, next);
+    outbox_state_queue_remove(outbox, item);
+    if (outbox_item_in_qos_queue(item)) {
+        TAILQ_REMOVE(&outbox->qos_queue[item->msg_qos], item, qos_next);
+    }
+    outbox_index_remove(outbox, item);
+    outbox_coalesce_remove(outbox, item);
+    outbox->size -= item->len;
+    outbox_heap_remove(outbox, OUTBOX_HEAP_TICK, item);
+    if (item->deadline) {
+        outbox_heap_remove(outbox, OUTBOX_HEAP_DEADLINE, item);
+    }
+    outbox_item_release(outbox, item);
+}
+
 outbox_handle_t outbox_init(void)
 {
     outbox_handle_t outbox = calloc(1, sizeof(struct outbox_t));
     ESP_MEM_CHECK(TAG, outbox, return NULL);
     outbox->list = calloc(1, sizeof(struct outbox_list_t));
     ESP_MEM_CHECK(TAG, outbox->list, {free(outbox); return NULL;});
+    outbox->index = calloc(OUTBOX_INDEX_INITIAL_SIZE, sizeof(outbox_item_handle_t));
+    ESP_MEM_CHECK(TAG, outbox->index, {free(outbox->list); free(outbox); return NULL;});
+    for (int i = 0; i < OUTBOX_HEAPS; i++) {
+        outbox->heap[i].items = calloc(OUTBOX_HEAP_INITIAL_SIZE, sizeof(outbox_item_handle_t));
+        ESP_MEM_CHECK(TAG, outbox->heap[i].items, {outbox_destroy(outbox); return NULL;});
+        outbox->heap[i].size = OUTBOX_HEAP_INITIAL_SIZE;
+    }
+#if MQTT_OUTBOX_POOL
+    outbox->pool = outbox_pool_create(sizeof(outbox_item_t), MQTT_OUTBOX_POOL_SLAB_ITEMS, MQTT_OUTBOX_POOL_SIZE, MQTT_OUTBOX_MEMORY);
+    ESP_MEM_CHECK(TAG, outbox->pool, {outbox_destroy(outbox); return NULL;});
+#endif
+    outbox->index_size = OUTBOX_INDEX_INITIAL_SIZE;
     outbox->size = 0;
-    STAILQ_INIT(outbox->list);
+    outbox->count = 0;
+    TAILQ_INIT(outbox->list);
+    for (int i = QUEUED; i <= CONFIRMED; i++) {
+        TAILQ_INIT(&outbox->state_queue[i]);
+    }
+    for (int i = 0; i < MQTT_PRIORITY_MAX; i++) {
+        TAILQ_INIT(&outbox->priority_queue[i]);
+    }
+    for (int i = 0; i < OUTBOX_QOS_LEVELS; i++) {
+        TAILQ_INIT(&outbox->qos_queue[i]);
+    }
     return outbox;
 }
 
 outbox_item_handle_t outbox_enqueue(outbox_handle_t outbox, outbox_message_handle_t message, outbox_tick_t tick)
 {
-    outbox_item_handle_t item = calloc(1, sizeof(outbox_item_t));
+    if (outbox_heap_reserve(outbox, OUTBOX_HEAP_TICK) != ESP_OK ||
+            (message->deadline && outbox_heap_reserve(outbox, OUTBOX_HEAP_DEADLINE) != ESP_OK)) {
+        return NULL;
+    }
+    outbox_item_handle_t item = outbox_item_alloc(outbox);
     ESP_MEM_CHECK(TAG, item, return NULL);
     item->msg_id = message->msg_id;
     item->msg_type = message->msg_type;
     item->msg_qos = message->msg_qos;
     item->tick = tick;
+    item->deadline = message->deadline;
+    item->priority = outbox_message_priority(message);
     item->len =  message->len + message->remaining_len;
     item->pending = QUEUED;
-    item->buffer = heap_caps_malloc(message->len + message->remaining_len, MQTT_OUTBOX_MEMORY);
+    item->buffer = outbox_data_alloc(outbox, item->len);
     ESP_MEM_CHECK(TAG, item->buffer, {
-        free(item);
+        outbox_item_release(outbox, item);
         return NULL;
     });
     memcpy(item->buffer, message->data, message->len);
     if (message->remaining_data) {
         memcpy(item->buffer + message->len, message->remaining_data, message->remaining_len);
     }
-    STAILQ_INSERT_TAIL(outbox->list, item, next);
+    TAILQ_INSERT_TAIL(outbox->list, item, next);
+    outbox_state_queue_insert(outbox, item);
+    if (outbox_item_in_qos_queue(item)) {
+        outbox_qos_queue_insert(outbox, item);
+    }
+    outbox_index_insert(outbox, item);
+    outbox_heap_insert(outbox, OUTBOX_HEAP_TICK, item);
+    if (item->deadline) {
+        outbox_heap_insert(outbox, OUTBOX_HEAP_DEADLINE, item);
+    }
+    if (message->coalesce && item->msg_type == MQTT_MSG_TYPE_PUBLISH) {
+        outbox_coalesce_insert(outbox, item);
+    }
     outbox->size += item->len;
     ESP_LOGD(TAG, "ENQUEUE msgid=%d, msg_type=%d, len=%d, size=%"PRIu64, message->msg_id, message->msg_type, message->len + message->remaining_len, outbox_get_size(outbox));
     return item;
 }
 
+outbox_item_handle_t outbox_coalesce(outbox_handle_t outbox, outbox_message_handle_t message, outbox_tick_t tick, int *replaced_msg_id)
+{
+    if (!message->coalesce || message->msg_type != MQTT_MSG_TYPE_PUBLISH) {
+        return NULL;
+    }
+    size_t topic_len = message->len;
+    const char *topic = mqtt_get_publish_topic(message->data, &topic_len);
+    if (topic == NULL || topic_len == 0) {
+        return NULL;
+    }
+    outbox_item_handle_t item = outbox_coalesce_find(outbox, topic, topic_len);
+    if (item == NULL) {
+        return NULL;
+    }
+    if (message->deadline && !item->deadline && outbox_heap_reserve(outbox, OUTBOX_HEAP_DEADLINE) != ESP_OK) {
+        return NULL;
+    }
+    int len = message->len + message->remaining_len;
+    char *buffer = outbox_data_alloc(outbox, len);
+    ESP_MEM_CHECK(TAG, buffer, return NULL);
+    memcpy(buffer, message->data, message->len);
+    if (message->remaining_data) {
+        memcpy(buffer + message->len, message->remaining_data, message->remaining_len);
+    }
+    *replaced_msg_id = item->msg_id;
+    ESP_LOGD(TAG, "COALESCE msgid=%d replaced by msgid=%d", item->msg_id, message->msg_id);
+    // the item keeps its place in the list and in the queue, only its content is replaced
+    outbox_data_free(outbox, item->buffer, item->len);
+    outbox->size -= item->len;
+    outbox->size += len;
+    item->buffer = buffer;
+    item->len = len;
+    if (item->msg_qos != message->msg_qos) {
+        if (outbox_item_in_qos_queue(item)) {
+            TAILQ_REMOVE(&outbox->qos_queue[item->msg_qos], item, qos_next);
+        }
+        item->msg_qos = message->msg_qos;
+        if (outbox_item_in_qos_queue(item)) {
+            outbox_qos_queue_insert(outbox, item);
+        }
+    }
+    if (item->msg_id != message->msg_id) {
+        outbox_index_remove(outbox, item);
+        item->msg_id = message->msg_id;
+        outbox_index_insert(outbox, item);
+    }
+    if (item->deadline) {
+        outbox_heap_remove(outbox, OUTBOX_HEAP_DEADLINE, item);
+    }
+    item->deadline = message->deadline;
+    if (item->deadline) {
+        outbox_heap_insert(outbox, OUTBOX_HEAP_DEADLINE, item);
+    }
+    item->tick = tick;
+    outbox_heap_sift_down(outbox, OUTBOX_HEAP_TICK, item->heap_pos[OUTBOX_HEAP_TICK]);
+    if (outbox_message_priority(message) != item->priority) {
+        outbox_state_queue_remove(outbox, item);
+        item->priority = outbox_message_priority(message);
+        outbox_state_queue_insert(outbox, item);
+    }
+    return item;
+}
+
 outbox_item_handle_t outbox_get(outbox_handle_t outbox, int msg_id)
 {
     outbox_item_handle_t item;
-    STAILQ_FOREACH(item, outbox->list, next) {
+    for (item = *outbox_index_bucket(outbox, msg_id); item; item = item->index_next) {
         if (item->msg_id == msg_id) {
             return item;
         }
@@ -77,31 +587,39 @@ outbox_item_handle_t outbox_get(outbox_handle_t outbox, int msg_id)
 
 outbox_item_handle_t outbox_dequeue(outbox_handle_t outbox, pending_state_t pending, outbox_tick_t *tick)
 {
-    outbox_item_handle_t item;
-    STAILQ_FOREACH(item, outbox->list, next) {
-        if (item->pending == pending) {
-            if (tick) {
-                *tick = item->tick;
+    if (pending > CONFIRMED) {
+        return NULL;
+    }
+    outbox_item_handle_t item = NULL;
+    if (pending == QUEUED) {
+        // the head of each class waits longest, take the one of the best class after aging
+        outbox_tick_t current_tick = platform_tick_get_ms();
+        outbox_tick_t best = MQTT_PRIORITY_MAX;
+        for (int i = MQTT_PRIORITY_CONTROL; i < MQTT_PRIORITY_MAX; i++) {
+            outbox_item_handle_t head = TAILQ_FIRST(&outbox->priority_queue[i]);
+            if (head && outbox_item_effective_priority(head, current_tick) < best) {
+                best = outbox_item_effective_priority(head, current_tick);
+                item = head;
             }
-            return item;
         }
+    } else {
+        item = TAILQ_FIRST(&outbox->state_queue[pending]);
     }
-    return NULL;
+    if (item && tick) {
+        *tick = item->tick;
+    }
+    return item;
 }
 
-esp_err_t outbox_delete_item(outbox_handle_t outbox, outbox_item_handle_t item_to_delete)
+esp_err_t outbox_delete_item(outbox_handle_t outbox, outbox_item_handle_t item)
 {
-    outbox_item_handle_t item;
-    STAILQ_FOREACH(item, outbox->list, next) {
-        if (item == item_to_delete) {
-            STAILQ_REMOVE(outbox->list, item, outbox_item, next);
-            outbox->size -= item->len;
-            free(item->buffer);
-            free(item);
-            return ESP_OK;
-        }
+    // every item is in the tick heap, which makes it cheap to check the handle, also of QoS 0 messages
+    outbox_heap_t *h = &outbox->heap[OUTBOX_HEAP_TICK];
+    if (item == NULL || item->heap_pos[OUTBOX_HEAP_TICK] >= h->count || h->items[item->heap_pos[OUTBOX_HEAP_TICK]] != item) {
+        return ESP_FAIL;
     }
-    return ESP_FAIL;
+    outbox_item_free(outbox, item);
+    return ESP_OK;
 }
 
 uint8_t *outbox_item_get_data(outbox_item_handle_t item,  size_t *len, uint16_t *msg_id, int *msg_type, int *qos)
@@ -118,31 +636,37 @@ uint8_t *outbox_item_get_data(outbox_item_handle_t item,  size_t *len, uint16_t
 
 esp_err_t outbox_delete(outbox_handle_t outbox, int msg_id, int msg_type)
 {
-    outbox_item_handle_t item, tmp;
-    STAILQ_FOREACH_SAFE(item, outbox->list, next, tmp) {
+    outbox_item_handle_t item;
+    for (item = *outbox_index_bucket(outbox, msg_id); item; item = item->index_next) {
         if (item->msg_id == msg_id && (0xFF & (item->msg_type)) == msg_type) {
-            STAILQ_REMOVE(outbox->list, item, outbox_item, next);
-            outbox->size -= item->len;
-            free(item->buffer);
-            free(item);
+            outbox_item_free(outbox, item);
             ESP_LOGD(TAG, "DELETED msgid=%d, msg_type=%d, remain size=%"PRIu64, msg_id, msg_type, outbox_get_size(outbox));
             return ESP_OK;
         }
-
     }
     return ESP_FAIL;
 }
 
-esp_err_t outbox_set_pending(outbox_handle_t outbox, int msg_id, pending_state_t pending)
+esp_err_t outbox_item_set_pending(outbox_handle_t outbox, outbox_item_handle_t item, pending_state_t pending)
 {
-    outbox_item_handle_t item = outbox_get(outbox, msg_id);
-    if (item) {
-        item->pending = pending;
+    if (item && pending <= CONFIRMED) {
+        if (item->pending != pending) {
+            // only messages which weren't transmitted yet could be replaced
+            outbox_coalesce_remove(outbox, item);
+            outbox_state_queue_remove(outbox, item);
+            item->pending = pending;
+            outbox_state_queue_insert(outbox, item);
+        }
         return ESP_OK;
     }
     return ESP_FAIL;
 }
 
+esp_err_t outbox_set_pending(outbox_handle_t outbox, int msg_id, pending_state_t pending)
+{
+    return outbox_item_set_pending(outbox, outbox_get(outbox, msg_id), pending);
+}
+
 pending_state_t outbox_item_get_pending(outbox_item_handle_t item)
 {
     if (item) {
@@ -151,11 +675,39 @@ pending_state_t outbox_item_get_pending(outbox_item_handle_t item)
     return QUEUED;
 }
 
+int outbox_item_get_priority(outbox_item_handle_t item)
+{
+    if (item) {
+        return item->priority;
+    }
+    return MQTT_PRIORITY_NORMAL;
+}
+
+size_t outbox_get_queued_count(outbox_handle_t outbox, int priority)
+{
+    if (priority < MQTT_PRIORITY_CONTROL || priority >= MQTT_PRIORITY_MAX) {
+        return 0;
+    }
+    return outbox->queued_count[priority];
+}
+
+outbox_tick_t outbox_item_get_deadline(outbox_item_handle_t item)
+{
+    if (item) {
+        return item->deadline;
+    }
+    return 0;
+}
+
 esp_err_t outbox_set_tick(outbox_handle_t outbox, int msg_id, outbox_tick_t tick)
 {
     outbox_item_handle_t item = outbox_get(outbox, msg_id);
     if (item) {
         item->tick = tick;
+        // ticks only move forward, re-queueing at the tail keeps the state queue sorted
+        outbox_state_queue_remove(outbox, item);
+        outbox_state_queue_insert(outbox, item);
+        outbox_heap_sift_down(outbox, OUTBOX_HEAP_TICK, item->heap_pos[OUTBOX_HEAP_TICK]);
         return ESP_OK;
     }
     return ESP_FAIL;
@@ -164,17 +716,11 @@ esp_err_t outbox_set_tick(outbox_handle_t outbox, int msg_id, outbox_tick_t tick
 int outbox_delete_single_expired(outbox_handle_t outbox, outbox_tick_t current_tick, outbox_tick_t timeout)
 {
     int msg_id = -1;
-    outbox_item_handle_t item;
-    STAILQ_FOREACH(item, outbox->list, next) {
-        if (current_tick - item->tick > timeout) {
-            STAILQ_REMOVE(outbox->list, item, outbox_item, next);
-            free(item->buffer);
-            outbox->size -= item->len;
-            msg_id = item->msg_id;
-            free(item);
-            return msg_id;
-        }
-
+    // the roots of the heaps expire first, if they haven't expired, nothing has
+    outbox_item_handle_t item = outbox_get_expired(outbox, current_tick, timeout);
+    if (item) {
+        msg_id = item->msg_id;
+        outbox_item_free(outbox, item);
     }
     return msg_id;
 }
@@ -182,20 +728,57 @@ int outbox_delete_single_expired(outbox_handle_t outbox, outbox_tick_t current_t
 int outbox_delete_expired(outbox_handle_t outbox, outbox_tick_t current_tick, outbox_tick_t timeout)
 {
     int deleted_items = 0;
-    outbox_item_handle_t item, tmp;
-    STAILQ_FOREACH_SAFE(item, outbox->list, next, tmp) {
-        if (current_tick - item->tick > timeout) {
-            STAILQ_REMOVE(outbox->list, item, outbox_item, next);
-            free(item->buffer);
-            outbox->size -= item->len;
-            free(item);
-            deleted_items ++;
-        }
-
+    outbox_item_handle_t item;
+    while ((item = outbox_get_expired(outbox, current_tick, timeout)) != NULL) {
+        outbox_item_free(outbox, item);
+        deleted_items ++;
     }
     return deleted_items;
 }
 
+int outbox_evict(outbox_handle_t outbox, esp_mqtt_outbox_overflow_policy_t policy, outbox_tick_t timeout)
+{
+    outbox_item_handle_t item = NULL;
+    switch (policy) {
+    case MQTT_OUTBOX_OVERFLOW_DROP_OLDEST:
+        item = outbox_oldest_publish(outbox);
+        break;
+    case MQTT_OUTBOX_OVERFLOW_DROP_LOWEST_QOS:
+        for (int qos = 0; qos < OUTBOX_QOS_LEVELS && item == NULL; qos++) {
+            item = TAILQ_FIRST(&outbox->qos_queue[qos]);
+        }
+        break;
+    case MQTT_OUTBOX_OVERFLOW_DROP_EXPIRING_SOONEST: {
+        // messages without their own deadline expire by the timeout in the order of their tick,
+        // if the root of the tick heap isn't a publish message, the oldest publish is taken instead
+        item = outbox_heap_top(outbox, OUTBOX_HEAP_TICK);
+        if (item && !outbox_item_in_qos_queue(item)) {
+            item = outbox_oldest_publish(outbox);
+        }
+        outbox_item_handle_t first_deadline = outbox_heap_top(outbox, OUTBOX_HEAP_DEADLINE);
+        if (first_deadline && (item == NULL || first_deadline->deadline < item->tick + timeout)) {
+            item = first_deadline;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    if (item == NULL) {
+        return -1;
+    }
+    int msg_id = item->msg_id;
+    ESP_LOGD(TAG, "EVICTED msgid=%d, msg_qos=%d, len=%d", msg_id, item->msg_qos, item->len);
+    outbox_item_free(outbox, item);
+    return msg_id;
+}
+
+uint16_t outbox_get_recovered_msg_id(outbox_handle_t outbox)
+{
+    // messages are kept in RAM only, nothing survives a reboot
+    return 0;
+}
+
 uint64_t outbox_get_size(outbox_handle_t outbox)
 {
     return outbox->size;
@@ -204,18 +787,31 @@ uint64_t outbox_get_size(outbox_handle_t outbox)
 void outbox_delete_all_items(outbox_handle_t outbox)
 {
     outbox_item_handle_t item, tmp;
-    STAILQ_FOREACH_SAFE(item, outbox->list, next, tmp) {
-        STAILQ_REMOVE(outbox->list, item, outbox_item, next);
-        outbox->size -= item->len;
-        free(item->buffer);
-        free(item);
+    TAILQ_FOREACH_SAFE(item, outbox->list, next, tmp) {
+        outbox_item_free(outbox, item);
     }
 }
 void outbox_destroy(outbox_handle_t outbox)
 {
     outbox_delete_all_items(outbox);
+    for (int i = 0; i < OUTBOX_HEAPS; i++) {
+        free(outbox->heap[i].items);
+    }
+    free(outbox->index);
     free(outbox->list);
+#if MQTT_OUTBOX_POOL
+    if (outbox->pool) {
+        outbox_pool_destroy(outbox->pool);
+    }
+#endif
     free(outbox);
 }
 
-#endif /* CONFIG_MQTT_CUSTOM_OUTBOX */
+#if MQTT_OUTBOX_POOL
+void outbox_get_pool_stats(outbox_handle_t outbox, esp_mqtt_outbox_pool_stats_t *stats)
+{
+    outbox_pool_get_stats(outbox->pool, stats);
+}
+#endif
+
+#endif /* !CONFIG_MQTT_CUSTOM_OUTBOX && !MQTT_OUTBOX_RING && !MQTT_OUTBOX_PERSISTENT */
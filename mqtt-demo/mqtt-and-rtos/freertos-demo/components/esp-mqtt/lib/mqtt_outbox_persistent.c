@@ -0,0 +1,1284 @@
+/*
+ * This file is subject to the terms and conditions defined in
+ * file 'LICENSE', which is part of this source code package.
+ */
+#include "mqtt_outbox.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mqtt_config.h"
+#include "mqtt_msg.h"
+#include "sys/queue.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#if MQTT_OUTBOX_PERSISTENT
+#if MQTT_OUTBOX_PERSISTENT_FILE
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include "esp_partition.h"
+#endif
+
+static const char *TAG = "outbox_log";
+
+/*
+ * Persistent outbox
+ *
+ * All messages are kept in RAM, QoS1 and QoS2 publish messages are additionally appended
+ * to a log on the storage, so they could be recovered in outbox_init() after a reboot.
+ *
+ * Storage layout: equally sized segments.
+ *  - A segment starts with a header carrying an increasing sequence number and a bitmap of deleted
+ *    records, followed by records (header with crc + message data), written append-only.
+ *  - Acknowledged (or otherwise deleted) records are marked by clearing their bit in the bitmap,
+ *    and transmitted messages by clearing a flag in their record header. Both are updated in place,
+ *    flash bits can be cleared without an erase, so the storage must not be encrypted.
+ *  - A segment is erased only when it's reused, once all of its records were deleted. When the last free segment
+ *    is taken, the live records of the emptiest segment are moved into it, so one long-lived message
+ *    cannot pin the whole log. Records carry an enqueue order number, which keeps the original order
+ *    on recovery and identifies duplicates left by an interrupted relocation.
+ *
+ * Writes are made durable in batches (group commit) after MQTT_OUTBOX_PERSISTENT_SYNC_BATCH records
+ * or MQTT_OUTBOX_PERSISTENT_SYNC_INTERVAL_MS, whichever comes first, together with the bitmaps.
+ * A crash could therefore lose the messages queued since the last sync, and resend the messages
+ * acknowledged since the last sync. Recovered messages which were transmitted before are resent
+ * as duplicates.
+ *
+ * In RAM, items are indexed and queued the same way as in the default outbox: a hash index keyed
+ * by the packet id, a FIFO per pending state (split by priority for queued items), min-heaps
+ * ordered by tick and by deadline, and a FIFO of publish messages per QoS level, so that
+ * acknowledgements, dequeueing, expiry and overflow eviction don't walk the whole outbox.
+ */
+
+#define OUTBOX_LOG_SEGMENT_MAGIC    (0x4c53514d)
+#define OUTBOX_LOG_RECORD_MAGIC     (0x5252514d)
+#define OUTBOX_LOG_RECORD_SENT      (1u << 0)   // cleared once the message was transmitted
+#define OUTBOX_LOG_ALIGN(x)         (((x) + 3) & ~((size_t)3))
+#define OUTBOX_LOG_SEGMENT_SIZE     MQTT_OUTBOX_PERSISTENT_SEGMENT_SIZE
+#define OUTBOX_LOG_SEGMENT_OFFSET(i) ((size_t)(i) * OUTBOX_LOG_SEGMENT_SIZE)
+#define OUTBOX_INDEX_INITIAL_SIZE   (16)
+#define OUTBOX_INDEX_MAX_SIZE       (1 << 16)
+#define OUTBOX_HEAP_INITIAL_SIZE    (16)
+#define OUTBOX_QOS_LEVELS           (3)
+
+typedef struct outbox_log_segment_header {
+    uint32_t magic;
+    uint32_t seq;
+} outbox_log_segment_header_t;
+
+typedef struct outbox_log_record {
+    uint32_t magic;
+    uint16_t msg_id;
+    uint8_t msg_type;
+    uint8_t msg_qos;
+    uint32_t len;
+    uint32_t order;
+    uint32_t crc;
+    uint32_t flags;     // OUTBOX_LOG_RECORD_*, not covered by the crc, bits are cleared in place
+} outbox_log_record_t;
+
+#define OUTBOX_LOG_MAX_RECORDS      ((OUTBOX_LOG_SEGMENT_SIZE - sizeof(outbox_log_segment_header_t)) / sizeof(outbox_log_record_t))
+#define OUTBOX_LOG_BITMAP_WORDS     ((OUTBOX_LOG_MAX_RECORDS + 31) / 32)
+// the bitmap of deleted records follows the segment header, stored inverted, so that erased bits mean live records
+#define OUTBOX_LOG_BITMAP_OFFSET    (sizeof(outbox_log_segment_header_t))
+#define OUTBOX_LOG_RECORDS_OFFSET   (OUTBOX_LOG_BITMAP_OFFSET + OUTBOX_LOG_BITMAP_WORDS * sizeof(uint32_t))
+
+typedef struct outbox_log_segment {
+    uint32_t seq;           // 0 if the segment is erased
+    uint32_t records;
+    uint32_t write_offset;
+    uint32_t live;          // records not deleted yet
+    uint32_t acked[OUTBOX_LOG_BITMAP_WORDS];
+    uint32_t synced[OUTBOX_LOG_BITMAP_WORDS];   // the part of acked already written to the storage
+} outbox_log_segment_t;
+
+enum {
+    OUTBOX_HEAP_TICK,
+    OUTBOX_HEAP_DEADLINE,
+    OUTBOX_HEAPS
+};
+
+typedef struct outbox_item {
+    char *buffer;
+    int len;
+    int msg_id;
+    int msg_type;
+    int msg_qos;
+    outbox_tick_t tick;
+    outbox_tick_t deadline;
+    int priority;           // not persisted, recovered messages are of the normal class
+    pending_state_t pending;
+    bool coalesce;          // not persisted, recovered messages are never replaced
+    int segment;            // -1 if the message isn't persisted
+    uint32_t record;
+    uint32_t offset;        // of the record in its segment
+    uint32_t order;
+    bool sent;              // the record is flagged as transmitted
+    TAILQ_ENTRY(outbox_item) next;
+    TAILQ_ENTRY(outbox_item) state_next;
+    TAILQ_ENTRY(outbox_item) qos_next;
+    uint32_t qos_seq;
+    struct outbox_item *index_next;
+    size_t heap_pos[OUTBOX_HEAPS];
+} outbox_item_t;
+
+TAILQ_HEAD(outbox_list_t, outbox_item);
+
+typedef struct outbox_heap {
+    outbox_item_handle_t *items;
+    size_t count;
+    size_t size;
+} outbox_heap_t;
+
+struct outbox_t {
+    uint64_t size;
+    struct outbox_list_t list;
+    struct outbox_list_t state_queue[CONFIRMED + 1];  // the queue of QUEUED items is split by priority
+    struct outbox_list_t priority_queue[MQTT_PRIORITY_MAX];
+    size_t queued_count[MQTT_PRIORITY_MAX];
+    struct outbox_list_t qos_queue[OUTBOX_QOS_LEVELS];
+    uint32_t qos_seq;   // numbers publish messages in the order they join the QoS FIFOs
+    size_t count;       // items in the index
+    outbox_item_handle_t *index;
+    size_t index_size;
+    outbox_heap_t heap[OUTBOX_HEAPS];
+#if MQTT_OUTBOX_PERSISTENT_FILE
+    int fd;
+#else
+    const esp_partition_t *partition;
+#endif
+    outbox_log_segment_t *segments;
+    int segment_count;
+    int active;
+    uint32_t next_seq;
+    uint32_t next_order;
+    uint16_t recovered_msg_id;
+    int unsynced;
+    bool acks_dirty;
+    outbox_tick_t last_sync;
+};
+
+static uint32_t outbox_log_crc32(uint32_t crc, const uint8_t *data, size_t len)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+    };
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ data[i]) & 0x0f] ^ (crc >> 4);
+        crc = table[(crc ^ (data[i] >> 4)) & 0x0f] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+/*
+ * Storage access, the file backend mimics flash semantics by filling erased areas with 0xFF
+ */
+#if MQTT_OUTBOX_PERSISTENT_FILE
+static esp_err_t outbox_storage_open(outbox_handle_t outbox, size_t *size)
+{
+    outbox->fd = open(MQTT_OUTBOX_PERSISTENT_FILE_PATH, O_RDWR | O_CREAT, 0644);
+    if (outbox->fd < 0) {
+        ESP_LOGE(TAG, "Failed to open %s", MQTT_OUTBOX_PERSISTENT_FILE_PATH);
+        return ESP_FAIL;
+    }
+    *size = MQTT_OUTBOX_PERSISTENT_FILE_SIZE;
+    return ESP_OK;
+}
+
+static void outbox_storage_close(outbox_handle_t outbox)
+{
+    close(outbox->fd);
+}
+
+static esp_err_t outbox_storage_read(outbox_handle_t outbox, size_t offset, void *dst, size_t len)
+{
+    ssize_t ret = pread(outbox->fd, dst, len, offset);
+    if (ret < 0) {
+        return ESP_FAIL;
+    }
+    // reading beyond the end of the file is the same as reading erased storage
+    memset((uint8_t *)dst + ret, 0xFF, len - ret);
+    return ESP_OK;
+}
+
+static esp_err_t outbox_storage_write(outbox_handle_t outbox, size_t offset, const void *src, size_t len)
+{
+    return pwrite(outbox->fd, src, len, offset) == (ssize_t)len ? ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t outbox_storage_erase(outbox_handle_t outbox, size_t offset, size_t len)
+{
+    uint8_t erased[64];
+    memset(erased, 0xFF, sizeof(erased));
+    for (size_t done = 0; done < len; done += sizeof(erased)) {
+        size_t chunk = len - done < sizeof(erased) ? len - done : sizeof(erased);
+        if (outbox_storage_write(outbox, offset + done, erased, chunk) != ESP_OK) {
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t outbox_storage_sync(outbox_handle_t outbox)
+{
+    return fsync(outbox->fd) == 0 ? ESP_OK : ESP_FAIL;
+}
+#else
+static esp_err_t outbox_storage_open(outbox_handle_t outbox, size_t *size)
+{
+    outbox->partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                        MQTT_OUTBOX_PERSISTENT_PARTITION_LABEL);
+    if (outbox->partition == NULL) {
+        ESP_LOGE(TAG, "Partition %s not found", MQTT_OUTBOX_PERSISTENT_PARTITION_LABEL);
+        return ESP_FAIL;
+    }
+    *size = outbox->partition->size;
+    return ESP_OK;
+}
+
+static void outbox_storage_close(outbox_handle_t outbox)
+{
+}
+
+static esp_err_t outbox_storage_read(outbox_handle_t outbox, size_t offset, void *dst, size_t len)
+{
+    return esp_partition_read(outbox->partition, offset, dst, len);
+}
+
+static esp_err_t outbox_storage_write(outbox_handle_t outbox, size_t offset, const void *src, size_t len)
+{
+    return esp_partition_write(outbox->partition, offset, src, len);
+}
+
+static esp_err_t outbox_storage_erase(outbox_handle_t outbox, size_t offset, size_t len)
+{
+    return esp_partition_erase_range(outbox->partition, offset, len);
+}
+
+static esp_err_t outbox_storage_sync(outbox_handle_t outbox)
+{
+    // flash writes are complete once esp_partition_write() returns
+    return ESP_OK;
+}
+#endif
+
+static inline outbox_item_handle_t *outbox_index_bucket(outbox_handle_t outbox, int msg_id)
+{
+    return &outbox->index[(unsigned)msg_id & (outbox->index_size - 1)];
+}
+
+// Appends to the tail of the bucket chain, so items sharing the same id are found in the same order
+// as they were enqueued
+static void outbox_index_append(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    outbox_item_handle_t *slot = outbox_index_bucket(outbox, item->msg_id);
+    while (*slot) {
+        slot = &(*slot)->index_next;
+    }
+    item->index_next = NULL;
+    *slot = item;
+}
+
+static void outbox_index_grow(outbox_handle_t outbox)
+{
+    if (outbox->count <= outbox->index_size || outbox->index_size >= OUTBOX_INDEX_MAX_SIZE) {
+        return;
+    }
+    outbox_item_handle_t *index = calloc(outbox->index_size * 2, sizeof(outbox_item_handle_t));
+    if (index == NULL) {
+        // keep the current index, lookups remain correct only with longer chains
+        ESP_LOGW(TAG, "Failed to grow outbox index of %zu buckets", outbox->index_size);
+        return;
+    }
+    free(outbox->index);
+    outbox->index = index;
+    outbox->index_size *= 2;
+    // rehash in list order to keep the enqueue order of items with the same id
+    outbox_item_handle_t item;
+    TAILQ_FOREACH(item, &outbox->list, next) {
+        if (item->msg_id != 0) {
+            outbox_index_append(outbox, item);
+        }
+    }
+}
+
+/*
+ * QoS 0 publish messages have no packet id, they all share id 0 and are never looked up by it,
+ * so they're left out of the index instead of piling up in a single bucket chain
+ */
+static void outbox_index_insert(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    if (item->msg_id == 0) {
+        return;
+    }
+    outbox_index_append(outbox, item);
+    outbox->count++;
+    outbox_index_grow(outbox);
+}
+
+static void outbox_index_remove(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    if (item->msg_id == 0) {
+        return;
+    }
+    outbox_item_handle_t *slot = outbox_index_bucket(outbox, item->msg_id);
+    while (*slot) {
+        if (*slot == item) {
+            *slot = item->index_next;
+            item->index_next = NULL;
+            outbox->count--;
+            return;
+        }
+        slot = &(*slot)->index_next;
+    }
+}
+
+static inline outbox_tick_t outbox_heap_key(int heap, outbox_item_handle_t item)
+{
+    return heap == OUTBOX_HEAP_TICK ? item->tick : item->deadline;
+}
+
+static inline void outbox_heap_set(outbox_heap_t *h, int heap, size_t pos, outbox_item_handle_t item)
+{
+    h->items[pos] = item;
+    item->heap_pos[heap] = pos;
+}
+
+static void outbox_heap_sift_up(outbox_handle_t outbox, int heap, size_t pos)
+{
+    outbox_heap_t *h = &outbox->heap[heap];
+    outbox_item_handle_t item = h->items[pos];
+    while (pos > 0) {
+        size_t parent = (pos - 1) / 2;
+        if (outbox_heap_key(heap, h->items[parent]) <= outbox_heap_key(heap, item)) {
+            break;
+        }
+        outbox_heap_set(h, heap, pos, h->items[parent]);
+        pos = parent;
+    }
+    outbox_heap_set(h, heap, pos, item);
+}
+
+static void outbox_heap_sift_down(outbox_handle_t outbox, int heap, size_t pos)
+{
+    outbox_heap_t *h = &outbox->heap[heap];
+    outbox_item_handle_t item = h->items[pos];
+    for (;;) {
+        size_t child = 2 * pos + 1;
+        if (child >= h->count) {
+            break;
+        }
+        if (child + 1 < h->count && outbox_heap_key(heap, h->items[child + 1]) < outbox_heap_key(heap, h->items[child])) {
+            child++;
+        }
+        if (outbox_heap_key(heap, item) <= outbox_heap_key(heap, h->items[child])) {
+            break;
+        }
+        outbox_heap_set(h, heap, pos, h->items[child]);
+        pos = child;
+    }
+    outbox_heap_set(h, heap, pos, item);
+}
+
+static esp_err_t outbox_heap_reserve(outbox_handle_t outbox, int heap)
+{
+    outbox_heap_t *h = &outbox->heap[heap];
+    if (h->count < h->size) {
+        return ESP_OK;
+    }
+    outbox_item_handle_t *items = realloc(h->items, h->size * 2 * sizeof(outbox_item_handle_t));
+    ESP_MEM_CHECK(TAG, items, return ESP_ERR_NO_MEM);
+    h->items = items;
+    h->size *= 2;
+    return ESP_OK;
+}
+
+// Expects the space to be reserved by outbox_heap_reserve()
+static void outbox_heap_insert(outbox_handle_t outbox, int heap, outbox_item_handle_t item)
+{
+    outbox_heap_t *h = &outbox->heap[heap];
+    outbox_heap_set(h, heap, h->count++, item);
+    outbox_heap_sift_up(outbox, heap, item->heap_pos[heap]);
+}
+
+static void outbox_heap_remove(outbox_handle_t outbox, int heap, outbox_item_handle_t item)
+{
+    outbox_heap_t *h = &outbox->heap[heap];
+    size_t pos = item->heap_pos[heap];
+    outbox_item_handle_t last = h->items[--h->count];
+    if (last == item) {
+        return;
+    }
+    outbox_heap_set(h, heap, pos, last);
+    if (pos > 0 && outbox_heap_key(heap, h->items[(pos - 1) / 2]) > outbox_heap_key(heap, last)) {
+        outbox_heap_sift_up(outbox, heap, pos);
+    } else {
+        outbox_heap_sift_down(outbox, heap, pos);
+    }
+}
+
+static inline outbox_item_handle_t outbox_heap_top(outbox_handle_t outbox, int heap)
+{
+    return outbox->heap[heap].count > 0 ? outbox->heap[heap].items[0] : NULL;
+}
+
+// Returns the item which expired first, either by the outbox timeout or by its own deadline
+static outbox_item_handle_t outbox_get_expired(outbox_handle_t outbox, outbox_tick_t current_tick, outbox_tick_t timeout)
+{
+    outbox_item_handle_t item = outbox_heap_top(outbox, OUTBOX_HEAP_TICK);
+    if (item && current_tick - item->tick > timeout) {
+        return item;
+    }
+    item = outbox_heap_top(outbox, OUTBOX_HEAP_DEADLINE);
+    if (item && current_tick >= item->deadline) {
+        return item;
+    }
+    return NULL;
+}
+
+static void outbox_state_queue_insert(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    if (item->pending == QUEUED) {
+        TAILQ_INSERT_TAIL(&outbox->priority_queue[item->priority], item, state_next);
+        outbox->queued_count[item->priority]++;
+    } else {
+        TAILQ_INSERT_TAIL(&outbox->state_queue[item->pending], item, state_next);
+    }
+}
+
+static void outbox_state_queue_remove(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    if (item->pending == QUEUED) {
+        TAILQ_REMOVE(&outbox->priority_queue[item->priority], item, state_next);
+        outbox->queued_count[item->priority]--;
+    } else {
+        TAILQ_REMOVE(&outbox->state_queue[item->pending], item, state_next);
+    }
+}
+
+static inline bool outbox_item_in_qos_queue(outbox_item_handle_t item)
+{
+    return item->msg_type == MQTT_MSG_TYPE_PUBLISH && item->msg_qos >= 0 && item->msg_qos < OUTBOX_QOS_LEVELS;
+}
+
+static void outbox_qos_queue_insert(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    item->qos_seq = outbox->qos_seq++;
+    TAILQ_INSERT_TAIL(&outbox->qos_queue[item->msg_qos], item, qos_next);
+}
+
+// Returns the oldest publish message, i.e. the oldest head of the QoS FIFOs, other messages are never evicted
+static outbox_item_handle_t outbox_oldest_publish(outbox_handle_t outbox)
+{
+    outbox_item_handle_t oldest = NULL;
+    for (int qos = 0; qos < OUTBOX_QOS_LEVELS; qos++) {
+        outbox_item_handle_t head = TAILQ_FIRST(&outbox->qos_queue[qos]);
+        if (head && (oldest == NULL || (int32_t)(head->qos_seq - oldest->qos_seq) < 0)) {
+            oldest = head;
+        }
+    }
+    return oldest;
+}
+
+// Writes the changed words of the bitmaps, only clearing bits of the stored (inverted) words
+static esp_err_t outbox_log_write_acks(outbox_handle_t outbox)
+{
+    for (int i = 0; i < outbox->segment_count; i++) {
+        outbox_log_segment_t *segment = &outbox->segments[i];
+        for (int w = 0; segment->seq && w < OUTBOX_LOG_BITMAP_WORDS; w++) {
+            if (segment->acked[w] == segment->synced[w]) {
+                continue;
+            }
+            uint32_t stored = ~segment->acked[w];
+            if (outbox_storage_write(outbox, OUTBOX_LOG_SEGMENT_OFFSET(i) + OUTBOX_LOG_BITMAP_OFFSET + w * sizeof(uint32_t),
+                                     &stored, sizeof(stored)) != ESP_OK) {
+                return ESP_FAIL;
+            }
+            segment->synced[w] = segment->acked[w];
+        }
+    }
+    return ESP_OK;
+}
+
+static esp_err_t outbox_log_sync(outbox_handle_t outbox, outbox_tick_t tick)
+{
+    esp_err_t err = ESP_OK;
+    bool written = outbox->unsynced > 0;
+    if (outbox->acks_dirty) {
+        err = outbox_log_write_acks(outbox);
+        outbox->acks_dirty = false;
+        written = true;
+    }
+    if (written && outbox_storage_sync(outbox) != ESP_OK) {
+        err = ESP_FAIL;
+    }
+    outbox->unsynced = 0;
+    outbox->last_sync = tick;
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to sync the outbox log");
+    }
+    return err;
+}
+
+static void outbox_log_maybe_sync(outbox_handle_t outbox, outbox_tick_t tick)
+{
+    if (outbox->unsynced >= MQTT_OUTBOX_PERSISTENT_SYNC_BATCH ||
+            ((outbox->unsynced > 0 || outbox->acks_dirty) &&
+             tick - outbox->last_sync >= MQTT_OUTBOX_PERSISTENT_SYNC_INTERVAL_MS)) {
+        outbox_log_sync(outbox, tick);
+    }
+}
+
+static esp_err_t outbox_log_open_segment(outbox_handle_t outbox, int index)
+{
+    outbox_log_segment_t *segment = &outbox->segments[index];
+    outbox_log_segment_header_t header = { .magic = OUTBOX_LOG_SEGMENT_MAGIC, .seq = outbox->next_seq };
+    // records relocated out of this segment have to be durable before it's erased
+    if (outbox->unsynced > 0 && outbox_storage_sync(outbox) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    if (outbox_storage_erase(outbox, OUTBOX_LOG_SEGMENT_OFFSET(index), OUTBOX_LOG_SEGMENT_SIZE) != ESP_OK ||
+            outbox_storage_write(outbox, OUTBOX_LOG_SEGMENT_OFFSET(index), &header, sizeof(header)) != ESP_OK) {
+        segment->seq = 0;
+        return ESP_FAIL;
+    }
+    memset(segment, 0, sizeof(outbox_log_segment_t));
+    segment->seq = outbox->next_seq++;
+    segment->write_offset = OUTBOX_LOG_RECORDS_OFFSET;
+    outbox->active = index;
+    return ESP_OK;
+}
+
+static void outbox_log_remove(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    if (item->segment < 0) {
+        return;
+    }
+    outbox_log_segment_t *segment = &outbox->segments[item->segment];
+    segment->acked[item->record / 32] |= 1u << (item->record % 32);
+    segment->live--;
+    outbox->acks_dirty = true;
+}
+
+// Flags the record as transmitted, so the message is recovered as a duplicate
+static void outbox_log_mark_sent(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    if (item->segment < 0 || item->sent) {
+        return;
+    }
+    uint32_t flags = ~OUTBOX_LOG_RECORD_SENT;
+    size_t offset = OUTBOX_LOG_SEGMENT_OFFSET(item->segment) + item->offset + offsetof(outbox_log_record_t, flags);
+    if (outbox_storage_write(outbox, offset, &flags, sizeof(flags)) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to flag msgid=%d as transmitted", item->msg_id);
+        return;
+    }
+    item->sent = true;
+    outbox->unsynced++;
+}
+
+static inline size_t outbox_log_record_size(outbox_item_handle_t item)
+{
+    return OUTBOX_LOG_ALIGN(sizeof(outbox_log_record_t) + item->len);
+}
+
+static inline bool outbox_log_fits(outbox_handle_t outbox, size_t len)
+{
+    outbox_log_segment_t *segment = &outbox->segments[outbox->active];
+    return segment->write_offset + len <= OUTBOX_LOG_SEGMENT_SIZE && segment->records < OUTBOX_LOG_MAX_RECORDS;
+}
+
+static int outbox_log_free_segment(outbox_handle_t outbox)
+{
+    for (int i = 1; i < outbox->segment_count; i++) {
+        int candidate = (outbox->active + i) % outbox->segment_count;
+        if (outbox->segments[candidate].live == 0) {
+            return candidate;
+        }
+    }
+    return -1;
+}
+
+static esp_err_t outbox_log_write_record(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    outbox_log_segment_t *segment = &outbox->segments[outbox->active];
+    outbox_log_record_t record = {
+        .magic = OUTBOX_LOG_RECORD_MAGIC,
+        .msg_id = item->msg_id,
+        .msg_type = item->msg_type,
+        .msg_qos = item->msg_qos,
+        .len = item->len,
+        .order = item->order,
+        .crc = 0,
+        .flags = UINT32_MAX,
+    };
+    record.crc = outbox_log_crc32(outbox_log_crc32(0, (uint8_t *)&record, sizeof(record)), (uint8_t *)item->buffer, item->len);
+    if (item->sent) {
+        record.flags &= ~OUTBOX_LOG_RECORD_SENT;
+    }
+    size_t offset = OUTBOX_LOG_SEGMENT_OFFSET(outbox->active) + segment->write_offset;
+    // the header goes last, so a torn write never looks like a valid record
+    if (outbox_storage_write(outbox, offset + sizeof(record), item->buffer, item->len) != ESP_OK ||
+            outbox_storage_write(outbox, offset, &record, sizeof(record)) != ESP_OK) {
+        // the space might have been partially written, don't use the rest of this segment
+        segment->write_offset = OUTBOX_LOG_SEGMENT_SIZE;
+        item->segment = -1;
+        return ESP_FAIL;
+    }
+    item->segment = outbox->active;
+    item->record = segment->records++;
+    item->offset = segment->write_offset;
+    segment->write_offset += outbox_log_record_size(item);
+    segment->live++;
+    outbox->unsynced++;
+    return ESP_OK;
+}
+
+/*
+ * Moves the live records of the emptiest segment to the active one, which has just been opened,
+ * so they always fit. The cleaned segment becomes free for the next switch.
+ */
+static void outbox_log_clean(outbox_handle_t outbox)
+{
+    int victim = -1;
+    for (int i = 0; i < outbox->segment_count; i++) {
+        if (i != outbox->active && (victim < 0 || outbox->segments[i].live < outbox->segments[victim].live)) {
+            victim = i;
+        }
+    }
+    if (victim < 0) {
+        return;
+    }
+    ESP_LOGD(TAG, "Relocating %"PRIu32" records of segment %d", outbox->segments[victim].live, victim);
+    outbox_item_handle_t item;
+    TAILQ_FOREACH(item, &outbox->list, next) {
+        if (item->segment == victim) {
+            if (!outbox_log_fits(outbox, outbox_log_record_size(item))) {
+                break;
+            }
+            outbox_log_remove(outbox, item);
+            if (outbox_log_write_record(outbox, item) != ESP_OK) {
+                break;
+            }
+        }
+    }
+}
+
+static esp_err_t outbox_log_switch_segment(outbox_handle_t outbox)
+{
+    int next = outbox_log_free_segment(outbox);
+    if (next < 0) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (outbox_log_open_segment(outbox, next) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    // keep one segment in reserve
+    if (outbox_log_free_segment(outbox) < 0) {
+        outbox_log_clean(outbox);
+    }
+    return ESP_OK;
+}
+
+static esp_err_t outbox_log_append(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    size_t len = outbox_log_record_size(item);
+    if (len > OUTBOX_LOG_SEGMENT_SIZE - OUTBOX_LOG_RECORDS_OFFSET) {
+        ESP_LOGW(TAG, "Message msgid=%d of %d bytes doesn't fit into a log segment", item->msg_id, item->len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    esp_err_t err = ESP_OK;
+    // a second switch is needed if the relocated records took the space of the new segment
+    for (int i = 0; i < 2 && err == ESP_OK && !outbox_log_fits(outbox, len); i++) {
+        err = outbox_log_switch_segment(outbox);
+    }
+    if (err == ESP_OK && !outbox_log_fits(outbox, len)) {
+        err = ESP_ERR_NO_MEM;
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Outbox log is full, msgid=%d is kept in RAM only", item->msg_id);
+        return err;
+    }
+    item->order = outbox->next_order++;
+    return outbox_log_write_record(outbox, item);
+}
+
+static void outbox_item_free(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    TAILQ_REMOVE(&outbox->list, item, next);
+    outbox_state_queue_remove(outbox, item);
+    if (outbox_item_in_qos_queue(item)) {
+        TAILQ_REMOVE(&outbox->qos_queue[item->msg_qos], item, qos_next);
+    }
+    outbox_index_remove(outbox, item);
+    outbox_heap_remove(outbox, OUTBOX_HEAP_TICK, item);
+    if (item->deadline) {
+        outbox_heap_remove(outbox, OUTBOX_HEAP_DEADLINE, item);
+    }
+    outbox->size -= item->len;
+    free(item->buffer);
+    free(item);
+}
+
+// Expects the space in the tick heap to be reserved
+static void outbox_log_insert_recovered(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    // segments are replayed in order, so only relocated records have to be moved back
+    outbox_item_handle_t prev = TAILQ_LAST(&outbox->list, outbox_list_t);
+    while (prev && prev->order > item->order) {
+        prev = TAILQ_PREV(prev, outbox_list_t, next);
+    }
+    if (prev && prev->order == item->order) {
+        // both copies of a record whose relocation was interrupted, keep the older one
+        outbox_log_remove(outbox, item);
+        free(item->buffer);
+        free(item);
+        return;
+    }
+    // the state and QoS queues are linked once the list is complete, see outbox_log_link_recovered()
+    if (prev) {
+        TAILQ_INSERT_AFTER(&outbox->list, prev, item, next);
+    } else {
+        TAILQ_INSERT_HEAD(&outbox->list, item, next);
+    }
+    outbox_index_insert(outbox, item);
+    // recovered messages have no deadline
+    outbox_heap_insert(outbox, OUTBOX_HEAP_TICK, item);
+    outbox->size += item->len;
+}
+
+// Queues the recovered items in the order of the list
+static void outbox_log_link_recovered(outbox_handle_t outbox)
+{
+    outbox_item_handle_t item;
+    TAILQ_FOREACH(item, &outbox->list, next) {
+        outbox_state_queue_insert(outbox, item);
+        if (outbox_item_in_qos_queue(item)) {
+            outbox_qos_queue_insert(outbox, item);
+        }
+    }
+}
+
+static void outbox_log_recover_segment(outbox_handle_t outbox, int index)
+{
+    outbox_log_segment_t *segment = &outbox->segments[index];
+    size_t offset = OUTBOX_LOG_RECORDS_OFFSET;
+    outbox_tick_t tick = platform_tick_get_ms();
+    if (outbox_storage_read(outbox, OUTBOX_LOG_SEGMENT_OFFSET(index) + OUTBOX_LOG_BITMAP_OFFSET, segment->acked, sizeof(segment->acked)) != ESP_OK) {
+        // without the bitmap, all records are considered live and acknowledged messages resent
+        memset(segment->acked, 0xFF, sizeof(segment->acked));
+    }
+    for (int w = 0; w < OUTBOX_LOG_BITMAP_WORDS; w++) {
+        segment->acked[w] = ~segment->acked[w];
+        segment->synced[w] = segment->acked[w];
+    }
+    while (segment->records < OUTBOX_LOG_MAX_RECORDS && offset + sizeof(outbox_log_record_t) <= OUTBOX_LOG_SEGMENT_SIZE) {
+        outbox_log_record_t record;
+        if (outbox_storage_read(outbox, OUTBOX_LOG_SEGMENT_OFFSET(index) + offset, &record, sizeof(record)) != ESP_OK) {
+            break;
+        }
+        if (record.magic != OUTBOX_LOG_RECORD_MAGIC || record.len > OUTBOX_LOG_SEGMENT_SIZE - offset - sizeof(record)) {
+            if (record.magic != UINT32_MAX) {
+                // garbage of an interrupted write, the rest of this segment cannot be written anymore
+                offset = OUTBOX_LOG_SEGMENT_SIZE;
+            }
+            break;
+        }
+        outbox_item_handle_t item = calloc(1, sizeof(outbox_item_t));
+        char *buffer = heap_caps_malloc(record.len, MQTT_OUTBOX_MEMORY);
+        if (item == NULL || buffer == NULL || outbox_heap_reserve(outbox, OUTBOX_HEAP_TICK) != ESP_OK ||
+                outbox_storage_read(outbox, OUTBOX_LOG_SEGMENT_OFFSET(index) + offset + sizeof(record), buffer, record.len) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to recover record %"PRIu32" of segment %d", segment->records, index);
+            free(item);
+            free(buffer);
+            offset = OUTBOX_LOG_SEGMENT_SIZE;
+            break;
+        }
+        uint32_t crc = record.crc;
+        uint32_t flags = record.flags;
+        record.crc = 0;
+        record.flags = UINT32_MAX;
+        if (outbox_log_crc32(outbox_log_crc32(0, (uint8_t *)&record, sizeof(record)), (uint8_t *)buffer, record.len) != crc) {
+            free(item);
+            free(buffer);
+            offset = OUTBOX_LOG_SEGMENT_SIZE;
+            break;
+        }
+        uint32_t n = segment->records++;
+        item->offset = offset;
+        offset += OUTBOX_LOG_ALIGN(sizeof(record) + record.len);
+        if (segment->acked[n / 32] & (1u << (n % 32))) {
+            free(item);
+            free(buffer);
+            continue;
+        }
+        item->buffer = buffer;
+        item->len = record.len;
+        item->msg_id = record.msg_id;
+        item->msg_type = record.msg_type;
+        item->msg_qos = record.msg_qos;
+        item->tick = tick;
+        // deadlines are ticks of the previous run, recovered messages only expire by the outbox timeout
+        item->deadline = 0;
+        item->priority = MQTT_PRIORITY_NORMAL;
+        // transmitted messages are resent on the retransmit path, which sets the DUP flag
+        item->sent = (flags & OUTBOX_LOG_RECORD_SENT) == 0;
+        item->pending = item->sent ? TRANSMITTED : QUEUED;
+        item->segment = index;
+        item->record = n;
+        item->order = record.order;
+        segment->live++;
+        if (record.order >= outbox->next_order) {
+            outbox->next_order = record.order + 1;
+        }
+        outbox_log_insert_recovered(outbox, item);
+    }
+    segment->write_offset = offset;
+}
+
+static esp_err_t outbox_log_recover(outbox_handle_t outbox)
+{
+    uint32_t max_seq = 0;
+    for (int i = 0; i < outbox->segment_count; i++) {
+        outbox_log_segment_header_t header;
+        if (outbox_storage_read(outbox, OUTBOX_LOG_SEGMENT_OFFSET(i), &header, sizeof(header)) != ESP_OK) {
+            return ESP_FAIL;
+        }
+        outbox->segments[i].seq = header.magic == OUTBOX_LOG_SEGMENT_MAGIC ? header.seq : 0;
+        if (outbox->segments[i].seq > max_seq) {
+            max_seq = outbox->segments[i].seq;
+            outbox->active = i;
+        }
+    }
+    // replay the segments from the oldest one to keep the original order of messages
+    uint32_t last_seq = 0;
+    for (;;) {
+        int oldest = -1;
+        for (int i = 0; i < outbox->segment_count; i++) {
+            uint32_t seq = outbox->segments[i].seq;
+            if (seq > last_seq && (oldest < 0 || seq < outbox->segments[oldest].seq)) {
+                oldest = i;
+            }
+        }
+        if (oldest < 0) {
+            break;
+        }
+        outbox_log_recover_segment(outbox, oldest);
+        last_seq = outbox->segments[oldest].seq;
+    }
+    outbox_log_link_recovered(outbox);
+    outbox->next_seq = max_seq + 1;
+    if (max_seq == 0) {
+        return outbox_log_open_segment(outbox, 0);
+    }
+    // the list is in enqueue order, so the last item carries the most recently assigned id
+    if (!TAILQ_EMPTY(&outbox->list)) {
+        outbox->recovered_msg_id = TAILQ_LAST(&outbox->list, outbox_list_t)->msg_id;
+    }
+    ESP_LOGI(TAG, "Recovered %"PRIu64" bytes of messages from the outbox log", outbox->size);
+    return ESP_OK;
+}
+
+// Releases the memory of an outbox without items
+static void outbox_free(outbox_handle_t outbox)
+{
+    for (int i = 0; i < OUTBOX_HEAPS; i++) {
+        free(outbox->heap[i].items);
+    }
+    free(outbox->index);
+    free(outbox->segments);
+    free(outbox);
+}
+
+outbox_handle_t outbox_init(void)
+{
+    outbox_handle_t outbox = calloc(1, sizeof(struct outbox_t));
+    ESP_MEM_CHECK(TAG, outbox, return NULL);
+    outbox->index = calloc(OUTBOX_INDEX_INITIAL_SIZE, sizeof(outbox_item_handle_t));
+    ESP_MEM_CHECK(TAG, outbox->index, {outbox_free(outbox); return NULL;});
+    outbox->index_size = OUTBOX_INDEX_INITIAL_SIZE;
+    for (int i = 0; i < OUTBOX_HEAPS; i++) {
+        outbox->heap[i].items = calloc(OUTBOX_HEAP_INITIAL_SIZE, sizeof(outbox_item_handle_t));
+        ESP_MEM_CHECK(TAG, outbox->heap[i].items, {outbox_free(outbox); return NULL;});
+        outbox->heap[i].size = OUTBOX_HEAP_INITIAL_SIZE;
+    }
+    TAILQ_INIT(&outbox->list);
+    for (int i = 0; i <= CONFIRMED; i++) {
+        TAILQ_INIT(&outbox->state_queue[i]);
+    }
+    for (int i = 0; i < MQTT_PRIORITY_MAX; i++) {
+        TAILQ_INIT(&outbox->priority_queue[i]);
+    }
+    for (int i = 0; i < OUTBOX_QOS_LEVELS; i++) {
+        TAILQ_INIT(&outbox->qos_queue[i]);
+    }
+    size_t storage_size = 0;
+    if (outbox_storage_open(outbox, &storage_size) != ESP_OK) {
+        outbox_free(outbox);
+        return NULL;
+    }
+    if (storage_size < 2 * OUTBOX_LOG_SEGMENT_SIZE) {
+        ESP_LOGE(TAG, "Storage of %zu bytes is too small for the outbox log", storage_size);
+        outbox_storage_close(outbox);
+        outbox_free(outbox);
+        return NULL;
+    }
+    outbox->segment_count = storage_size / OUTBOX_LOG_SEGMENT_SIZE;
+    outbox->segments = calloc(outbox->segment_count, sizeof(outbox_log_segment_t));
+    ESP_MEM_CHECK(TAG, outbox->segments, {outbox_storage_close(outbox); outbox_free(outbox); return NULL;});
+    if (outbox_log_recover(outbox) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to recover the outbox log");
+        outbox_delete_all_items(outbox);
+        outbox_storage_close(outbox);
+        outbox_free(outbox);
+        return NULL;
+    }
+    outbox->last_sync = platform_tick_get_ms();
+    return outbox;
+}
+
+static inline int outbox_message_priority(outbox_message_handle_t message)
+{
+    return message->priority >= MQTT_PRIORITY_CONTROL && message->priority < MQTT_PRIORITY_MAX ? message->priority : MQTT_PRIORITY_NORMAL;
+}
+
+// Queued items gain one class for each aging interval they wait, but never overtake the control class
+static outbox_tick_t outbox_item_effective_priority(outbox_item_handle_t item, outbox_tick_t current_tick)
+{
+    outbox_tick_t priority = item->priority;
+    if (OUTBOX_PRIORITY_AGING_MS > 0 && current_tick > item->tick) {
+        priority -= (current_tick - item->tick) / OUTBOX_PRIORITY_AGING_MS;
+    }
+    return priority < MQTT_PRIORITY_CONTROL ? MQTT_PRIORITY_CONTROL : priority;
+}
+
+outbox_item_handle_t outbox_enqueue(outbox_handle_t outbox, outbox_message_handle_t message, outbox_tick_t tick)
+{
+    if (outbox_heap_reserve(outbox, OUTBOX_HEAP_TICK) != ESP_OK ||
+            (message->deadline && outbox_heap_reserve(outbox, OUTBOX_HEAP_DEADLINE) != ESP_OK)) {
+        return NULL;
+    }
+    outbox_item_handle_t item = calloc(1, sizeof(outbox_item_t));
+    ESP_MEM_CHECK(TAG, item, return NULL);
+    item->msg_id = message->msg_id;
+    item->msg_type = message->msg_type;
+    item->msg_qos = message->msg_qos;
+    item->tick = tick;
+    item->deadline = message->deadline;
+    item->priority = outbox_message_priority(message);
+    item->len =  message->len + message->remaining_len;
+    item->pending = QUEUED;
+    item->coalesce = message->coalesce && message->msg_type == MQTT_MSG_TYPE_PUBLISH;
+    item->segment = -1;
+    item->buffer = heap_caps_malloc(message->len + message->remaining_len, MQTT_OUTBOX_MEMORY);
+    ESP_MEM_CHECK(TAG, item->buffer, {
+        free(item);
+        return NULL;
+    });
+    memcpy(item->buffer, message->data, message->len);
+    if (message->remaining_data) {
+        memcpy(item->buffer + message->len, message->remaining_data, message->remaining_len);
+    }
+    // only messages which have to be delivered at least once are worth surviving a reboot
+    if (item->msg_type == MQTT_MSG_TYPE_PUBLISH && item->msg_qos > 0) {
+        outbox_log_append(outbox, item);
+        outbox_log_maybe_sync(outbox, tick);
+    }
+    TAILQ_INSERT_TAIL(&outbox->list, item, next);
+    outbox_state_queue_insert(outbox, item);
+    if (outbox_item_in_qos_queue(item)) {
+        outbox_qos_queue_insert(outbox, item);
+    }
+    outbox_index_insert(outbox, item);
+    outbox_heap_insert(outbox, OUTBOX_HEAP_TICK, item);
+    if (item->deadline) {
+        outbox_heap_insert(outbox, OUTBOX_HEAP_DEADLINE, item);
+    }
+    outbox->size += item->len;
+    ESP_LOGD(TAG, "ENQUEUE msgid=%d, msg_type=%d, len=%d, size=%"PRIu64, message->msg_id, message->msg_type, message->len + message->remaining_len, outbox_get_size(outbox));
+    return item;
+}
+
+/*
+ * The new message is appended first and the replaced one is deleted (and acknowledged in the log)
+ * afterwards, so it's kept if the new one can't be stored. After a crash in between, both records
+ * are recovered and sent.
+ */
+outbox_item_handle_t outbox_coalesce(outbox_handle_t outbox, outbox_message_handle_t message, outbox_tick_t tick, int *replaced_msg_id)
+{
+    if (!message->coalesce || message->msg_type != MQTT_MSG_TYPE_PUBLISH) {
+        return NULL;
+    }
+    size_t topic_len = message->len;
+    const char *topic = mqtt_get_publish_topic(message->data, &topic_len);
+    if (topic == NULL || topic_len == 0) {
+        return NULL;
+    }
+    // only messages which weren't transmitted yet could be replaced
+    for (int i = MQTT_PRIORITY_CONTROL; i < MQTT_PRIORITY_MAX; i++) {
+        outbox_item_handle_t item;
+        TAILQ_FOREACH(item, &outbox->priority_queue[i], state_next) {
+            if (!item->coalesce) {
+                continue;
+            }
+            size_t len = item->len;
+            const char *item_topic = mqtt_get_publish_topic((uint8_t *)item->buffer, &len);
+            if (item_topic && len == topic_len && memcmp(item_topic, topic, len) == 0) {
+                outbox_item_handle_t new_item = outbox_enqueue(outbox, message, tick);
+                if (new_item == NULL) {
+                    return NULL;
+                }
+                ESP_LOGD(TAG, "COALESCE msgid=%d replaced by msgid=%d", item->msg_id, message->msg_id);
+                *replaced_msg_id = item->msg_id;
+                outbox_log_remove(outbox, item);
+                outbox_item_free(outbox, item);
+                return new_item;
+            }
+        }
+    }
+    return NULL;
+}
+
+outbox_item_handle_t outbox_get(outbox_handle_t outbox, int msg_id)
+{
+    outbox_item_handle_t item;
+    for (item = *outbox_index_bucket(outbox, msg_id); item; item = item->index_next) {
+        if (item->msg_id == msg_id) {
+            return item;
+        }
+    }
+    return NULL;
+}
+
+outbox_item_handle_t outbox_dequeue(outbox_handle_t outbox, pending_state_t pending, outbox_tick_t *tick)
+{
+    if (pending > CONFIRMED) {
+        return NULL;
+    }
+    outbox_item_handle_t item = NULL;
+    if (pending == QUEUED) {
+        // the head of each class waits longest, take the one of the best class after aging
+        outbox_tick_t current_tick = platform_tick_get_ms();
+        outbox_tick_t best = MQTT_PRIORITY_MAX;
+        for (int i = MQTT_PRIORITY_CONTROL; i < MQTT_PRIORITY_MAX; i++) {
+            outbox_item_handle_t head = TAILQ_FIRST(&outbox->priority_queue[i]);
+            if (head && outbox_item_effective_priority(head, current_tick) < best) {
+                best = outbox_item_effective_priority(head, current_tick);
+                item = head;
+            }
+        }
+    } else {
+        item = TAILQ_FIRST(&outbox->state_queue[pending]);
+    }
+    if (item && tick) {
+        *tick = item->tick;
+    }
+    return item;
+}
+
+esp_err_t outbox_delete_item(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    // every item is in the tick heap, which makes it cheap to check the handle, also of QoS 0 messages
+    outbox_heap_t *h = &outbox->heap[OUTBOX_HEAP_TICK];
+    if (item == NULL || item->heap_pos[OUTBOX_HEAP_TICK] >= h->count || h->items[item->heap_pos[OUTBOX_HEAP_TICK]] != item) {
+        return ESP_FAIL;
+    }
+    outbox_log_remove(outbox, item);
+    outbox_item_free(outbox, item);
+    return ESP_OK;
+}
+
+uint8_t *outbox_item_get_data(outbox_item_handle_t item,  size_t *len, uint16_t *msg_id, int *msg_type, int *qos)
+{
+    if (item) {
+        *len = item->len;
+        *msg_id = item->msg_id;
+        *msg_type = item->msg_type;
+        *qos = item->msg_qos;
+        return (uint8_t *)item->buffer;
+    }
+    return NULL;
+}
+
+esp_err_t outbox_delete(outbox_handle_t outbox, int msg_id, int msg_type)
+{
+    outbox_item_handle_t item;
+    for (item = *outbox_index_bucket(outbox, msg_id); item; item = item->index_next) {
+        if (item->msg_id == msg_id && (0xFF & (item->msg_type)) == msg_type) {
+            outbox_log_remove(outbox, item);
+            outbox_item_free(outbox, item);
+            ESP_LOGD(TAG, "DELETED msgid=%d, msg_type=%d, remain size=%"PRIu64, msg_id, msg_type, outbox_get_size(outbox));
+            return ESP_OK;
+        }
+    }
+    return ESP_FAIL;
+}
+
+esp_err_t outbox_item_set_pending(outbox_handle_t outbox, outbox_item_handle_t item, pending_state_t pending)
+{
+    if (item && pending <= CONFIRMED) {
+        if (pending != QUEUED) {
+            outbox_log_mark_sent(outbox, item);
+        }
+        if (item->pending != pending) {
+            outbox_state_queue_remove(outbox, item);
+            item->pending = pending;
+            outbox_state_queue_insert(outbox, item);
+        }
+        return ESP_OK;
+    }
+    return ESP_FAIL;
+}
+
+esp_err_t outbox_set_pending(outbox_handle_t outbox, int msg_id, pending_state_t pending)
+{
+    return outbox_item_set_pending(outbox, outbox_get(outbox, msg_id), pending);
+}
+
+pending_state_t outbox_item_get_pending(outbox_item_handle_t item)
+{
+    if (item) {
+        return item->pending;
+    }
+    return QUEUED;
+}
+
+int outbox_item_get_priority(outbox_item_handle_t item)
+{
+    if (item) {
+        return item->priority;
+    }
+    return MQTT_PRIORITY_NORMAL;
+}
+
+outbox_tick_t outbox_item_get_deadline(outbox_item_handle_t item)
+{
+    if (item) {
+        return item->deadline;
+    }
+    return 0;
+}
+
+esp_err_t outbox_set_tick(outbox_handle_t outbox, int msg_id, outbox_tick_t tick)
+{
+    outbox_item_handle_t item = outbox_get(outbox, msg_id);
+    if (item) {
+        item->tick = tick;
+        // ticks only move forward, re-queueing at the tail keeps the state queue sorted
+        outbox_state_queue_remove(outbox, item);
+        outbox_state_queue_insert(outbox, item);
+        outbox_heap_sift_down(outbox, OUTBOX_HEAP_TICK, item->heap_pos[OUTBOX_HEAP_TICK]);
+        return ESP_OK;
+    }
+    return ESP_FAIL;
+}
+
+int outbox_delete_single_expired(outbox_handle_t outbox, outbox_tick_t current_tick, outbox_tick_t timeout)
+{
+    int msg_id = -1;
+    // the roots of the heaps expire first, if they haven't expired, nothing has
+    outbox_item_handle_t item = outbox_get_expired(outbox, current_tick, timeout);
+    if (item) {
+        msg_id = item->msg_id;
+        outbox_log_remove(outbox, item);
+        outbox_item_free(outbox, item);
+    }
+    // called periodically from the client task, a good place to commit pending writes
+    outbox_log_maybe_sync(outbox, current_tick);
+    return msg_id;
+}
+
+int outbox_delete_expired(outbox_handle_t outbox, outbox_tick_t current_tick, outbox_tick_t timeout)
+{
+    int deleted_items = 0;
+    outbox_item_handle_t item;
+    while ((item = outbox_get_expired(outbox, current_tick, timeout)) != NULL) {
+        outbox_log_remove(outbox, item);
+        outbox_item_free(outbox, item);
+        deleted_items ++;
+    }
+    outbox_log_maybe_sync(outbox, current_tick);
+    return deleted_items;
+}
+
+int outbox_evict(outbox_handle_t outbox, esp_mqtt_outbox_overflow_policy_t policy, outbox_tick_t timeout)
+{
+    outbox_item_handle_t item = NULL;
+    switch (policy) {
+    case MQTT_OUTBOX_OVERFLOW_DROP_OLDEST:
+        item = outbox_oldest_publish(outbox);
+        break;
+    case MQTT_OUTBOX_OVERFLOW_DROP_LOWEST_QOS:
+        for (int qos = 0; qos < OUTBOX_QOS_LEVELS && item == NULL; qos++) {
+            item = TAILQ_FIRST(&outbox->qos_queue[qos]);
+        }
+        break;
+    case MQTT_OUTBOX_OVERFLOW_DROP_EXPIRING_SOONEST: {
+        // messages without their own deadline expire by the timeout in the order of their tick,
+        // if the root of the tick heap isn't a publish message, the oldest publish is taken instead
+        item = outbox_heap_top(outbox, OUTBOX_HEAP_TICK);
+        if (item && !outbox_item_in_qos_queue(item)) {
+            item = outbox_oldest_publish(outbox);
+        }
+        outbox_item_handle_t first_deadline = outbox_heap_top(outbox, OUTBOX_HEAP_DEADLINE);
+        if (first_deadline && (item == NULL || first_deadline->deadline < item->tick + timeout)) {
+            item = first_deadline;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    if (item == NULL) {
+        return -1;
+    }
+    int msg_id = item->msg_id;
+    ESP_LOGD(TAG, "EVICTED msgid=%d, msg_qos=%d, len=%d", msg_id, item->msg_qos, item->len);
+    outbox_log_remove(outbox, item);
+    outbox_item_free(outbox, item);
+    return msg_id;
+}
+
+size_t outbox_get_queued_count(outbox_handle_t outbox, int priority)
+{
+    if (priority < MQTT_PRIORITY_CONTROL || priority >= MQTT_PRIORITY_MAX) {
+        return 0;
+    }
+    return outbox->queued_count[priority];
+}
+
+uint16_t outbox_get_recovered_msg_id(outbox_handle_t outbox)
+{
+    return outbox->recovered_msg_id;
+}
+
+uint64_t outbox_get_size(outbox_handle_t outbox)
+{
+    return outbox->size;
+}
+
+void outbox_delete_all_items(outbox_handle_t outbox)
+{
+    outbox_item_handle_t item, tmp;
+    TAILQ_FOREACH_SAFE(item, &outbox->list, next, tmp) {
+        outbox_log_remove(outbox, item);
+        outbox_item_free(outbox, item);
+    }
+}
+
+void outbox_destroy(outbox_handle_t outbox)
+{
+    // commit pending writes, but keep the persisted messages to be recovered by the next outbox_init()
+    outbox_log_sync(outbox, platform_tick_get_ms());
+    outbox_item_handle_t item, tmp;
+    TAILQ_FOREACH_SAFE(item, &outbox->list, next, tmp) {
+        outbox_item_free(outbox, item);
+    }
+    outbox_storage_close(outbox);
+    outbox_free(outbox);
+}
+
+#endif /* MQTT_OUTBOX_PERSISTENT */
@@ -0,0 +1,249 @@
+/*
+ * This file is subject to the terms and conditions defined in
+ * file 'LICENSE', which is part of this source code package.
+ */
+#include "mqtt_outbox_pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include "platform.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+static const char *TAG = "outbox_pool";
+
+#define OUTBOX_POOL_ALIGN(x)            (((x) + 7) & ~((size_t)7))
+#define OUTBOX_POOL_MIN_BLOCK_SHIFT     (5)
+#define OUTBOX_POOL_CLASSES             (8)
+#define OUTBOX_POOL_BLOCK_SIZE(c)       ((size_t)1 << (OUTBOX_POOL_MIN_BLOCK_SHIFT + (c)))
+// every item is preceded by a pointer to its slab
+#define OUTBOX_POOL_ITEM_HEADER         OUTBOX_POOL_ALIGN(sizeof(struct outbox_pool_slab *))
+
+typedef struct outbox_pool_free {
+    struct outbox_pool_free *next;
+} outbox_pool_free_t;
+
+typedef struct outbox_pool_slab {
+    LIST_ENTRY(outbox_pool_slab) all;
+    TAILQ_ENTRY(outbox_pool_slab) available;    // only linked while the slab has free items
+    outbox_pool_free_t *free_items;
+    size_t used;
+} outbox_pool_slab_t;
+
+struct outbox_pool {
+    size_t item_size;
+    size_t items_per_slab;
+    uint32_t caps;
+    LIST_HEAD(, outbox_pool_slab) slabs;
+    // partially used slabs first, empty ones at the tail, so the empty ones could be released
+    TAILQ_HEAD(, outbox_pool_slab) available;
+    size_t empty_slabs;
+    uint8_t *arena;
+    size_t arena_top;
+    outbox_pool_free_t *free_blocks[OUTBOX_POOL_CLASSES];
+    esp_mqtt_outbox_pool_stats_t stats;
+};
+
+static int outbox_pool_class(size_t len)
+{
+    for (int c = 0; c < OUTBOX_POOL_CLASSES; c++) {
+        if (len <= OUTBOX_POOL_BLOCK_SIZE(c)) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+static inline bool outbox_pool_in_arena(outbox_pool_handle_t pool, const void *data)
+{
+    return pool->arena && (const uint8_t *)data >= pool->arena && (const uint8_t *)data < pool->arena + pool->stats.arena_size;
+}
+
+outbox_pool_handle_t outbox_pool_create(size_t item_size, size_t items_per_slab, size_t arena_size, uint32_t caps)
+{
+    outbox_pool_handle_t pool = calloc(1, sizeof(struct outbox_pool));
+    ESP_MEM_CHECK(TAG, pool, return NULL);
+    pool->item_size = OUTBOX_POOL_ALIGN(item_size < sizeof(outbox_pool_free_t) ? sizeof(outbox_pool_free_t) : item_size);
+    pool->items_per_slab = items_per_slab ? items_per_slab : 1;
+    pool->caps = caps;
+    LIST_INIT(&pool->slabs);
+    TAILQ_INIT(&pool->available);
+    if (arena_size) {
+        pool->arena = heap_caps_malloc(arena_size, caps);
+        ESP_MEM_CHECK(TAG, pool->arena, {free(pool); return NULL;});
+        pool->stats.arena_size = arena_size;
+    }
+    return pool;
+}
+
+static outbox_pool_slab_t *outbox_pool_slab_create(outbox_pool_handle_t pool)
+{
+    size_t header = OUTBOX_POOL_ALIGN(sizeof(outbox_pool_slab_t));
+    size_t slot_size = OUTBOX_POOL_ITEM_HEADER + pool->item_size;
+    outbox_pool_slab_t *slab = heap_caps_malloc(header + slot_size * pool->items_per_slab, pool->caps);
+    ESP_MEM_CHECK(TAG, slab, return NULL);
+    slab->free_items = NULL;
+    slab->used = 0;
+    uint8_t *slots = (uint8_t *)slab + header;
+    for (size_t i = pool->items_per_slab; i > 0; i--) {
+        uint8_t *slot = slots + (i - 1) * slot_size;
+        *(outbox_pool_slab_t **)slot = slab;
+        outbox_pool_free_t *free_item = (outbox_pool_free_t *)(slot + OUTBOX_POOL_ITEM_HEADER);
+        free_item->next = slab->free_items;
+        slab->free_items = free_item;
+    }
+    LIST_INSERT_HEAD(&pool->slabs, slab, all);
+    TAILQ_INSERT_TAIL(&pool->available, slab, available);
+    pool->empty_slabs++;
+    pool->stats.item_slabs++;
+    return slab;
+}
+
+void *outbox_pool_item_alloc(outbox_pool_handle_t pool)
+{
+    outbox_pool_slab_t *slab = TAILQ_FIRST(&pool->available);
+    if (slab == NULL) {
+        slab = outbox_pool_slab_create(pool);
+        if (slab == NULL) {
+            return NULL;
+        }
+    }
+    outbox_pool_free_t *item = slab->free_items;
+    slab->free_items = item->next;
+    if (slab->used++ == 0) {
+        pool->empty_slabs--;
+    }
+    if (slab->free_items == NULL) {
+        TAILQ_REMOVE(&pool->available, slab, available);
+    }
+    memset(item, 0, pool->item_size);
+    if (++pool->stats.items_in_use > pool->stats.items_high_water) {
+        pool->stats.items_high_water = pool->stats.items_in_use;
+    }
+    return item;
+}
+
+void outbox_pool_item_free(outbox_pool_handle_t pool, void *item)
+{
+    if (item == NULL) {
+        return;
+    }
+    outbox_pool_slab_t *slab = *(outbox_pool_slab_t **)((uint8_t *)item - OUTBOX_POOL_ITEM_HEADER);
+    outbox_pool_free_t *free_item = item;
+    if (slab->free_items == NULL) {
+        TAILQ_INSERT_HEAD(&pool->available, slab, available);
+    }
+    free_item->next = slab->free_items;
+    slab->free_items = free_item;
+    pool->stats.items_in_use--;
+    if (--slab->used) {
+        return;
+    }
+    // a single empty slab is kept to absorb bursts, others are returned to the heap
+    if (pool->empty_slabs) {
+        TAILQ_REMOVE(&pool->available, slab, available);
+        LIST_REMOVE(slab, all);
+        free(slab);
+        pool->stats.item_slabs--;
+    } else {
+        TAILQ_REMOVE(&pool->available, slab, available);
+        TAILQ_INSERT_TAIL(&pool->available, slab, available);
+        pool->empty_slabs++;
+    }
+}
+
+/*
+ * Takes a released block of a bigger class than `c` and splits it in halves down to class `c`,
+ * the remaining halves are put to the free lists of the classes in between
+ */
+static void *outbox_pool_split_block(outbox_pool_handle_t pool, int c)
+{
+    int k = c + 1;
+    while (k < OUTBOX_POOL_CLASSES && pool->free_blocks[k] == NULL) {
+        k++;
+    }
+    if (k == OUTBOX_POOL_CLASSES) {
+        return NULL;
+    }
+    uint8_t *block = (uint8_t *)pool->free_blocks[k];
+    pool->free_blocks[k] = pool->free_blocks[k]->next;
+    // the upper halves are released, the lowest block of class `c` is returned
+    while (--k >= c) {
+        outbox_pool_free_t *half = (outbox_pool_free_t *)(block + OUTBOX_POOL_BLOCK_SIZE(k));
+        half->next = pool->free_blocks[k];
+        pool->free_blocks[k] = half;
+    }
+    pool->stats.free_block_bytes -= OUTBOX_POOL_BLOCK_SIZE(c);
+    return block;
+}
+
+void *outbox_pool_data_alloc(outbox_pool_handle_t pool, size_t len)
+{
+    int c = outbox_pool_class(len);
+    void *data = NULL;
+    if (c >= 0) {
+        size_t block_size = OUTBOX_POOL_BLOCK_SIZE(c);
+        if (pool->free_blocks[c]) {
+            data = pool->free_blocks[c];
+            pool->free_blocks[c] = pool->free_blocks[c]->next;
+            pool->stats.free_block_bytes -= block_size;
+        } else if ((data = outbox_pool_split_block(pool, c)) == NULL &&
+                   pool->arena_top + block_size <= pool->stats.arena_size) {
+            // released blocks are split first, so they don't stay unused in the free lists
+            data = pool->arena + pool->arena_top;
+            pool->arena_top += block_size;
+        }
+        if (data) {
+            pool->stats.arena_used += block_size;
+            pool->stats.data_requested += len;
+            if (pool->stats.arena_used > pool->stats.arena_high_water) {
+                pool->stats.arena_high_water = pool->stats.arena_used;
+            }
+            return data;
+        }
+    }
+    data = heap_caps_malloc(len, pool->caps);
+    if (data) {
+        pool->stats.heap_fallbacks++;
+        ESP_LOGD(TAG, "Data block of %zu bytes allocated from heap", len);
+    }
+    return data;
+}
+
+void outbox_pool_data_free(outbox_pool_handle_t pool, void *data, size_t len)
+{
+    if (!outbox_pool_in_arena(pool, data)) {
+        free(data);
+        return;
+    }
+    int c = outbox_pool_class(len);
+    outbox_pool_free_t *block = data;
+    block->next = pool->free_blocks[c];
+    pool->free_blocks[c] = block;
+    pool->stats.arena_used -= OUTBOX_POOL_BLOCK_SIZE(c);
+    pool->stats.data_requested -= len;
+    pool->stats.free_block_bytes += OUTBOX_POOL_BLOCK_SIZE(c);
+    if (pool->stats.arena_used == 0) {
+        // nothing is stored in the arena, so its split into size classes could start over
+        memset(pool->free_blocks, 0, sizeof(pool->free_blocks));
+        pool->stats.free_block_bytes = 0;
+        pool->arena_top = 0;
+    }
+}
+
+void outbox_pool_get_stats(outbox_pool_handle_t pool, esp_mqtt_outbox_pool_stats_t *stats)
+{
+    *stats = pool->stats;
+    stats->arena_unused = pool->stats.arena_size - pool->arena_top;
+}
+
+void outbox_pool_destroy(outbox_pool_handle_t pool)
+{
+    outbox_pool_slab_t *slab;
+    while ((slab = LIST_FIRST(&pool->slabs)) != NULL) {
+        LIST_REMOVE(slab, all);
+        free(slab);
+    }
+    free(pool->arena);
+    free(pool);
+}
@@ -0,0 +1,490 @@
+/*
+ * This file is subject to the terms and conditions defined in
+ * file 'LICENSE', which is part of this source code package.
+ */
+#include "mqtt_outbox.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mqtt_config.h"
+#include "mqtt_msg.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+#if MQTT_OUTBOX_RING
+static const char *TAG = "outbox_ring";
+
+/*
+ * Ring buffer outbox
+ *
+ * Messages are stored back-to-back in a single preallocated data ring, a message never wraps
+ * around the end of the ring, so it could be passed to the transport as one contiguous block.
+ * The index keeps one entry per message in the enqueue order. Deleting a message only marks
+ * its entry as a hole, the space is reclaimed once the hole reaches the head of the index,
+ * or by compaction if a new message doesn't fit into the remaining free space.
+ *
+ * Note: Item handles refer to index entries which are moved by compaction, so they're only
+ * valid until the next outbox_enqueue().
+ */
+
+typedef struct outbox_item {
+    uint8_t *buffer;
+    size_t len;
+    int msg_id;
+    int msg_type;
+    int msg_qos;
+    outbox_tick_t tick;
+    outbox_tick_t deadline;
+    int priority;
+    pending_state_t pending;
+    bool hole;
+    bool coalesce;
+} outbox_item_t;
+
+struct outbox_t {
+    uint64_t size;
+    uint8_t *data;
+    size_t data_size;
+    size_t write_pos;
+    outbox_item_t *index;
+    int index_size;
+    int first;      // first live entry
+    int count;      // used entries, including holes
+    int wrap_at;    // first entry stored after the data wrapped to the start of the ring, -1 if not wrapped
+    int holes;
+};
+
+static void outbox_ring_reset(outbox_handle_t outbox)
+{
+    outbox->first = 0;
+    outbox->count = 0;
+    outbox->holes = 0;
+    outbox->wrap_at = -1;
+    outbox->write_pos = 0;
+    outbox->size = 0;
+}
+
+static void outbox_ring_remove(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    item->hole = true;
+    outbox->holes++;
+    outbox->size -= item->len;
+    // release the space of leading holes right away
+    while (outbox->first < outbox->count && outbox->index[outbox->first].hole) {
+        outbox->first++;
+        outbox->holes--;
+        if (outbox->first == outbox->wrap_at) {
+            outbox->wrap_at = -1;
+        }
+    }
+    if (outbox->first == outbox->count) {
+        outbox_ring_reset(outbox);
+    }
+}
+
+/*
+ * Removes all holes from the index and slides the data of live entries so that the free space
+ * becomes one contiguous block. Entries stored before the wrap are moved towards the end
+ * of the ring, entries after the wrap (or all of them if not wrapped) towards its start,
+ * so memmove() never overwrites data which wasn't moved yet.
+ */
+static void outbox_ring_compact(outbox_handle_t outbox)
+{
+    int live = 0;
+    int wrapped_live = 0;
+    for (int i = outbox->first; i < outbox->count; i++) {
+        if (!outbox->index[i].hole) {
+            if (outbox->wrap_at >= 0 && i < outbox->wrap_at) {
+                wrapped_live++;
+            }
+            outbox->index[live++] = outbox->index[i];
+        }
+    }
+    size_t pos = outbox->data_size;
+    for (int i = wrapped_live - 1; i >= 0; i--) {
+        outbox_item_t *entry = &outbox->index[i];
+        pos -= entry->len;
+        if (outbox->data + pos != entry->buffer) {
+            memmove(outbox->data + pos, entry->buffer, entry->len);
+            entry->buffer = outbox->data + pos;
+        }
+    }
+    pos = 0;
+    for (int i = wrapped_live; i < live; i++) {
+        outbox_item_t *entry = &outbox->index[i];
+        if (outbox->data + pos != entry->buffer) {
+            memmove(outbox->data + pos, entry->buffer, entry->len);
+            entry->buffer = outbox->data + pos;
+        }
+        pos += entry->len;
+    }
+    outbox->first = 0;
+    outbox->count = live;
+    outbox->holes = 0;
+    outbox->write_pos = pos;
+    outbox->wrap_at = wrapped_live > 0 ? wrapped_live : -1;
+    ESP_LOGD(TAG, "Compacted ring, %d items, free %zu bytes", live, outbox->data_size - (size_t)outbox->size);
+}
+
+static bool outbox_ring_reserve(outbox_handle_t outbox, size_t len, size_t *offset)
+{
+    if (outbox->count == 0) {
+        outbox_ring_reset(outbox);
+    }
+    size_t head = outbox->count > outbox->first ? outbox->index[outbox->first].buffer - outbox->data : 0;
+    if (outbox->wrap_at < 0) {
+        if (outbox->write_pos + len <= outbox->data_size) {
+            *offset = outbox->write_pos;
+            return true;
+        }
+        if (len <= head) {
+            outbox->wrap_at = outbox->count;
+            *offset = 0;
+            return true;
+        }
+    } else if (outbox->write_pos + len <= head) {
+        *offset = outbox->write_pos;
+        return true;
+    }
+    return false;
+}
+
+static inline int outbox_message_priority(outbox_message_handle_t message)
+{
+    return message->priority >= MQTT_PRIORITY_CONTROL && message->priority < MQTT_PRIORITY_MAX ? message->priority : MQTT_PRIORITY_NORMAL;
+}
+
+// Queued items gain one class for each aging interval they wait, but never overtake the control class
+static outbox_tick_t outbox_item_effective_priority(outbox_item_handle_t item, outbox_tick_t current_tick)
+{
+    outbox_tick_t priority = item->priority;
+    if (OUTBOX_PRIORITY_AGING_MS > 0 && current_tick > item->tick) {
+        priority -= (current_tick - item->tick) / OUTBOX_PRIORITY_AGING_MS;
+    }
+    return priority < MQTT_PRIORITY_CONTROL ? MQTT_PRIORITY_CONTROL : priority;
+}
+
+outbox_handle_t outbox_init(void)
+{
+    outbox_handle_t outbox = calloc(1, sizeof(struct outbox_t));
+    ESP_MEM_CHECK(TAG, outbox, return NULL);
+    outbox->data = heap_caps_malloc(MQTT_OUTBOX_RING_SIZE, MQTT_OUTBOX_MEMORY);
+    ESP_MEM_CHECK(TAG, outbox->data, {free(outbox); return NULL;});
+    outbox->index = calloc(MQTT_OUTBOX_RING_MAX_ITEMS, sizeof(outbox_item_t));
+    ESP_MEM_CHECK(TAG, outbox->index, {free(outbox->data); free(outbox); return NULL;});
+    outbox->data_size = MQTT_OUTBOX_RING_SIZE;
+    outbox->index_size = MQTT_OUTBOX_RING_MAX_ITEMS;
+    outbox_ring_reset(outbox);
+    return outbox;
+}
+
+outbox_item_handle_t outbox_enqueue(outbox_handle_t outbox, outbox_message_handle_t message, outbox_tick_t tick)
+{
+    size_t len = message->len + message->remaining_len;
+    size_t offset = 0;
+    // released leading entries and holes are only reclaimed by compaction
+    if (outbox->count == outbox->index_size && (outbox->holes > 0 || outbox->first > 0)) {
+        outbox_ring_compact(outbox);
+    }
+    if (outbox->count == outbox->index_size) {
+        ESP_LOGE(TAG, "No free index entry for msgid=%d", message->msg_id);
+        return NULL;
+    }
+    if (!outbox_ring_reserve(outbox, len, &offset)) {
+        if (outbox->holes > 0 || outbox->first > 0 || outbox->wrap_at >= 0) {
+            outbox_ring_compact(outbox);
+        }
+        if (!outbox_ring_reserve(outbox, len, &offset)) {
+            ESP_LOGE(TAG, "No space for msgid=%d, len=%zu, size=%"PRIu64, message->msg_id, len, outbox_get_size(outbox));
+            return NULL;
+        }
+    }
+    outbox_item_handle_t item = &outbox->index[outbox->count++];
+    item->buffer = outbox->data + offset;
+    item->len = len;
+    item->msg_id = message->msg_id;
+    item->msg_type = message->msg_type;
+    item->msg_qos = message->msg_qos;
+    item->tick = tick;
+    item->deadline = message->deadline;
+    item->priority = outbox_message_priority(message);
+    item->pending = QUEUED;
+    item->hole = false;
+    item->coalesce = message->coalesce && message->msg_type == MQTT_MSG_TYPE_PUBLISH;
+    memcpy(item->buffer, message->data, message->len);
+    if (message->remaining_data) {
+        memcpy(item->buffer + message->len, message->remaining_data, message->remaining_len);
+    }
+    outbox->write_pos = offset + len;
+    outbox->size += len;
+    ESP_LOGD(TAG, "ENQUEUE msgid=%d, msg_type=%d, len=%zu, size=%"PRIu64, message->msg_id, message->msg_type, len, outbox_get_size(outbox));
+    return item;
+}
+
+static outbox_item_handle_t outbox_ring_coalesce_find(outbox_handle_t outbox, const char *topic, size_t topic_len, int end)
+{
+    for (int i = outbox->first; i < end; i++) {
+        outbox_item_handle_t item = &outbox->index[i];
+        if (item->hole || !item->coalesce || item->pending != QUEUED) {
+            continue;
+        }
+        size_t len = item->len;
+        const char *item_topic = mqtt_get_publish_topic(item->buffer, &len);
+        if (item_topic && len == topic_len && memcmp(item_topic, topic, len) == 0) {
+            return item;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Messages can't be resized in place in the ring, so the new message is enqueued at the end
+ * and the replaced one is deleted afterwards. Enqueueing might compact the index, so the
+ * replaced message is looked up again, it's the only other queued message on the topic.
+ */
+outbox_item_handle_t outbox_coalesce(outbox_handle_t outbox, outbox_message_handle_t message, outbox_tick_t tick, int *replaced_msg_id)
+{
+    if (!message->coalesce || message->msg_type != MQTT_MSG_TYPE_PUBLISH) {
+        return NULL;
+    }
+    size_t topic_len = message->len;
+    const char *topic = mqtt_get_publish_topic(message->data, &topic_len);
+    if (topic == NULL || topic_len == 0 || outbox_ring_coalesce_find(outbox, topic, topic_len, outbox->count) == NULL) {
+        return NULL;
+    }
+    outbox_item_handle_t item = outbox_enqueue(outbox, message, tick);
+    if (item == NULL) {
+        return NULL;
+    }
+    outbox_item_handle_t replaced = outbox_ring_coalesce_find(outbox, topic, topic_len, item - outbox->index);
+    if (replaced) {
+        ESP_LOGD(TAG, "COALESCE msgid=%d replaced by msgid=%d", replaced->msg_id, message->msg_id);
+        *replaced_msg_id = replaced->msg_id;
+        outbox_ring_remove(outbox, replaced);
+    }
+    return item;
+}
+
+outbox_item_handle_t outbox_get(outbox_handle_t outbox, int msg_id)
+{
+    for (int i = outbox->first; i < outbox->count; i++) {
+        if (!outbox->index[i].hole && outbox->index[i].msg_id == msg_id) {
+            return &outbox->index[i];
+        }
+    }
+    return NULL;
+}
+
+outbox_item_handle_t outbox_dequeue(outbox_handle_t outbox, pending_state_t pending, outbox_tick_t *tick)
+{
+    outbox_item_handle_t found = NULL;
+    outbox_tick_t best = MQTT_PRIORITY_MAX;
+    outbox_tick_t current_tick = platform_tick_get_ms();
+    for (int i = outbox->first; i < outbox->count; i++) {
+        outbox_item_handle_t item = &outbox->index[i];
+        if (item->hole || item->pending != pending) {
+            continue;
+        }
+        if (pending != QUEUED) {
+            found = item;
+            break;
+        }
+        // queued messages are sent by priority, the first one of each class waits longest
+        outbox_tick_t priority = outbox_item_effective_priority(item, current_tick);
+        if (priority < best) {
+            best = priority;
+            found = item;
+        }
+    }
+    if (found && tick) {
+        *tick = found->tick;
+    }
+    return found;
+}
+
+esp_err_t outbox_delete_item(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    if (item < &outbox->index[outbox->first] || item >= &outbox->index[outbox->count] || item->hole) {
+        return ESP_FAIL;
+    }
+    outbox_ring_remove(outbox, item);
+    return ESP_OK;
+}
+
+uint8_t *outbox_item_get_data(outbox_item_handle_t item,  size_t *len, uint16_t *msg_id, int *msg_type, int *qos)
+{
+    if (item) {
+        *len = item->len;
+        *msg_id = item->msg_id;
+        *msg_type = item->msg_type;
+        *qos = item->msg_qos;
+        return item->buffer;
+    }
+    return NULL;
+}
+
+esp_err_t outbox_delete(outbox_handle_t outbox, int msg_id, int msg_type)
+{
+    for (int i = outbox->first; i < outbox->count; i++) {
+        outbox_item_handle_t item = &outbox->index[i];
+        if (!item->hole && item->msg_id == msg_id && (0xFF & (item->msg_type)) == msg_type) {
+            outbox_ring_remove(outbox, item);
+            ESP_LOGD(TAG, "DELETED msgid=%d, msg_type=%d, remain size=%"PRIu64, msg_id, msg_type, outbox_get_size(outbox));
+            return ESP_OK;
+        }
+    }
+    return ESP_FAIL;
+}
+
+esp_err_t outbox_item_set_pending(outbox_handle_t outbox, outbox_item_handle_t item, pending_state_t pending)
+{
+    if (item) {
+        item->pending = pending;
+        return ESP_OK;
+    }
+    return ESP_FAIL;
+}
+
+esp_err_t outbox_set_pending(outbox_handle_t outbox, int msg_id, pending_state_t pending)
+{
+    return outbox_item_set_pending(outbox, outbox_get(outbox, msg_id), pending);
+}
+
+pending_state_t outbox_item_get_pending(outbox_item_handle_t item)
+{
+    if (item) {
+        return item->pending;
+    }
+    return QUEUED;
+}
+
+int outbox_item_get_priority(outbox_item_handle_t item)
+{
+    if (item) {
+        return item->priority;
+    }
+    return MQTT_PRIORITY_NORMAL;
+}
+
+outbox_tick_t outbox_item_get_deadline(outbox_item_handle_t item)
+{
+    if (item) {
+        return item->deadline;
+    }
+    return 0;
+}
+
+esp_err_t outbox_set_tick(outbox_handle_t outbox, int msg_id, outbox_tick_t tick)
+{
+    outbox_item_handle_t item = outbox_get(outbox, msg_id);
+    if (item) {
+        item->tick = tick;
+        return ESP_OK;
+    }
+    return ESP_FAIL;
+}
+
+static inline bool outbox_item_expired(outbox_item_handle_t item, outbox_tick_t current_tick, outbox_tick_t timeout)
+{
+    return current_tick - item->tick > timeout || (item->deadline && current_tick >= item->deadline);
+}
+
+int outbox_delete_single_expired(outbox_handle_t outbox, outbox_tick_t current_tick, outbox_tick_t timeout)
+{
+    for (int i = outbox->first; i < outbox->count; i++) {
+        outbox_item_handle_t item = &outbox->index[i];
+        if (!item->hole && outbox_item_expired(item, current_tick, timeout)) {
+            int msg_id = item->msg_id;
+            outbox_ring_remove(outbox, item);
+            return msg_id;
+        }
+    }
+    return -1;
+}
+
+int outbox_delete_expired(outbox_handle_t outbox, outbox_tick_t current_tick, outbox_tick_t timeout)
+{
+    int deleted_items = 0;
+    // removal only advances the first entry or resets the ring, so keep scanning from the current one
+    for (int i = outbox->first; i < outbox->count; i++) {
+        outbox_item_handle_t item = &outbox->index[i];
+        if (!item->hole && outbox_item_expired(item, current_tick, timeout)) {
+            outbox_ring_remove(outbox, item);
+            deleted_items ++;
+        }
+    }
+    return deleted_items;
+}
+
+// Time at which the message expires, either by the outbox timeout or by its own deadline
+static inline outbox_tick_t outbox_item_expiry(outbox_item_handle_t item, outbox_tick_t timeout)
+{
+    outbox_tick_t expiry = item->tick + timeout;
+    return item->deadline && item->deadline < expiry ? item->deadline : expiry;
+}
+
+int outbox_evict(outbox_handle_t outbox, esp_mqtt_outbox_overflow_policy_t policy, outbox_tick_t timeout)
+{
+    if (policy == MQTT_OUTBOX_OVERFLOW_REJECT_NEW) {
+        return -1;
+    }
+    outbox_item_handle_t victim = NULL;
+    for (int i = outbox->first; i < outbox->count; i++) {
+        outbox_item_handle_t item = &outbox->index[i];
+        if (item->hole || item->msg_type != MQTT_MSG_TYPE_PUBLISH) {
+            continue;
+        }
+        if (victim == NULL) {
+            victim = item;
+            if (policy == MQTT_OUTBOX_OVERFLOW_DROP_OLDEST) {
+                break;
+            }
+        } else if (policy == MQTT_OUTBOX_OVERFLOW_DROP_LOWEST_QOS ? item->msg_qos < victim->msg_qos :
+                   outbox_item_expiry(item, timeout) < outbox_item_expiry(victim, timeout)) {
+            victim = item;
+        }
+    }
+    if (victim == NULL) {
+        return -1;
+    }
+    int msg_id = victim->msg_id;
+    ESP_LOGD(TAG, "EVICTED msgid=%d, msg_qos=%d, len=%zu", msg_id, victim->msg_qos, victim->len);
+    outbox_ring_remove(outbox, victim);
+    return msg_id;
+}
+
+size_t outbox_get_queued_count(outbox_handle_t outbox, int priority)
+{
+    size_t count = 0;
+    for (int i = outbox->first; i < outbox->count; i++) {
+        if (!outbox->index[i].hole && outbox->index[i].pending == QUEUED && outbox->index[i].priority == priority) {
+            count++;
+        }
+    }
+    return count;
+}
+
+uint16_t outbox_get_recovered_msg_id(outbox_handle_t outbox)
+{
+    // messages are kept in RAM only, nothing survives a reboot
+    return 0;
+}
+
+uint64_t outbox_get_size(outbox_handle_t outbox)
+{
+    return outbox->size;
+}
+
+void outbox_delete_all_items(outbox_handle_t outbox)
+{
+    outbox_ring_reset(outbox);
+}
+
+void outbox_destroy(outbox_handle_t outbox)
+{
+    free(outbox->index);
+    free(outbox->data);
+    free(outbox);
+}
+
+#endif /* MQTT_OUTBOX_RING */
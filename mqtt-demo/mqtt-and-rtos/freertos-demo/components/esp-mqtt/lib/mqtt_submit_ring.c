@@ -0,0 +1,87 @@
+/*
+ * This file is subject to the terms and conditions defined in
+ * file 'LICENSE', which is part of this source code package.
+ */
+#include "mqtt_submit_ring.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "platform.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+static const char *TAG = "submit_ring";
+
+typedef struct mqtt_submit_ring_slot {
+    atomic_size_t sequence;     /*!< equals the position of the slot when free, position + 1 when holding an item */
+    void *item;
+} mqtt_submit_ring_slot_t;
+
+struct mqtt_submit_ring {
+    size_t mask;
+    atomic_size_t write_pos;
+    size_t read_pos;            /*!< owned by the consumer */
+    mqtt_submit_ring_slot_t slots[];
+};
+
+mqtt_submit_ring_handle_t mqtt_submit_ring_create(size_t size)
+{
+    size_t slots = 1;
+    while (slots < size) {
+        slots <<= 1;
+    }
+    mqtt_submit_ring_handle_t ring = heap_caps_calloc(1, sizeof(struct mqtt_submit_ring) + slots * sizeof(mqtt_submit_ring_slot_t),
+                                     MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    ESP_MEM_CHECK(TAG, ring, return NULL);
+    ring->mask = slots - 1;
+    atomic_init(&ring->write_pos, 0);
+    for (size_t i = 0; i < slots; i++) {
+        atomic_init(&ring->slots[i].sequence, i);
+    }
+    return ring;
+}
+
+bool mqtt_submit_ring_push(mqtt_submit_ring_handle_t ring, void *item)
+{
+    size_t pos = atomic_load_explicit(&ring->write_pos, memory_order_relaxed);
+    mqtt_submit_ring_slot_t *slot;
+    for (;;) {
+        slot = &ring->slots[pos & ring->mask];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            // the slot is free, claim it unless another producer was faster (pos is reloaded then)
+            if (atomic_compare_exchange_weak_explicit(&ring->write_pos, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // the slot still holds an item from the previous lap
+            return false;
+        } else {
+            pos = atomic_load_explicit(&ring->write_pos, memory_order_relaxed);
+        }
+    }
+    slot->item = item;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    return true;
+}
+
+void *mqtt_submit_ring_pop(mqtt_submit_ring_handle_t ring)
+{
+    mqtt_submit_ring_slot_t *slot = &ring->slots[ring->read_pos & ring->mask];
+    size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    if (sequence != ring->read_pos + 1) {
+        // empty, or the producer which claimed the slot hasn't published its item yet
+        return NULL;
+    }
+    void *item = slot->item;
+    atomic_store_explicit(&slot->sequence, ring->read_pos + ring->mask + 1, memory_order_release);
+    ring->read_pos++;
+    return item;
+}
+
+void mqtt_submit_ring_destroy(mqtt_submit_ring_handle_t ring)
+{
+    free(ring);
+}
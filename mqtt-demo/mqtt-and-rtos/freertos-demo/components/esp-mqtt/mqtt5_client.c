@@ -7,13 +7,17 @@
 #include "mqtt_client_priv.h"
 #include "esp_log.h"
 #include <string.h>
+#include <sys/param.h>
 
 static const char *TAG = "mqtt5_client";
 
 static void esp_mqtt5_print_error_code(esp_mqtt5_client_handle_t client, int code);
+static mqtt5_topic_alias_handle_t esp_mqtt5_client_create_topic_alias(uint16_t count);
 static esp_err_t esp_mqtt5_client_update_topic_alias(mqtt5_topic_alias_handle_t topic_alias_handle, uint16_t topic_alias, char *topic, size_t topic_len);
 static char *esp_mqtt5_client_get_topic_alias(mqtt5_topic_alias_handle_t topic_alias_handle, uint16_t topic_alias, size_t *topic_length);
 static void esp_mqtt5_client_delete_topic_alias(mqtt5_topic_alias_handle_t topic_alias_handle);
+static esp_err_t esp_mqtt5_client_reset_outbound_topic_alias(esp_mqtt5_client_handle_t client);
+static void esp_mqtt5_client_delete_outbound_topic_alias(esp_mqtt5_client_handle_t client);
 static esp_err_t esp_mqtt5_user_property_copy(mqtt5_user_property_handle_t user_property_new, const mqtt5_user_property_handle_t user_property_old);
 
 void esp_mqtt5_increment_packet_counter(esp_mqtt5_client_handle_t client)
@@ -38,7 +42,8 @@ void esp_mqtt5_parse_pubcomp(esp_mqtt5_client_handle_t client)
     if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5) {
         ESP_LOGI(TAG, "MQTT_MSG_TYPE_PUBCOMP return code is %d", mqtt5_msg_get_reason_code(client->mqtt_state.in_buffer, client->mqtt_state.in_buffer_read_len));
         size_t msg_data_len = client->mqtt_state.in_buffer_read_len;
-        client->event.data = mqtt5_get_pubcomp_data(client->mqtt_state.in_buffer, &msg_data_len, &client->event.property->user_property);
+        esp_mqtt5_set_user_property_view(client, NULL, 0);
+        client->event.data = mqtt5_get_pubcomp_data(client->mqtt_state.in_buffer, &msg_data_len, esp_mqtt5_event_user_property(client));
         client->event.data_len = msg_data_len;
         client->event.total_data_len = msg_data_len;
         client->event.current_data_offset = 0;
@@ -50,7 +55,8 @@ void esp_mqtt5_parse_puback(esp_mqtt5_client_handle_t client)
     if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5) {
         ESP_LOGI(TAG, "MQTT_MSG_TYPE_PUBACK return code is %d", mqtt5_msg_get_reason_code(client->mqtt_state.in_buffer, client->mqtt_state.in_buffer_read_len));
         size_t msg_data_len = client->mqtt_state.in_buffer_read_len;
-        client->event.data = mqtt5_get_puback_data(client->mqtt_state.in_buffer, &msg_data_len, &client->event.property->user_property);
+        esp_mqtt5_set_user_property_view(client, NULL, 0);
+        client->event.data = mqtt5_get_puback_data(client->mqtt_state.in_buffer, &msg_data_len, esp_mqtt5_event_user_property(client));
         client->event.data_len = msg_data_len;
         client->event.total_data_len = msg_data_len;
         client->event.current_data_offset = 0;
@@ -62,13 +68,33 @@ void esp_mqtt5_parse_unsuback(esp_mqtt5_client_handle_t client)
     if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5) {
         ESP_LOGI(TAG, "MQTT_MSG_TYPE_UNSUBACK return code is %d", mqtt5_msg_get_reason_code(client->mqtt_state.in_buffer, client->mqtt_state.in_buffer_read_len));
         size_t msg_data_len = client->mqtt_state.in_buffer_read_len;
-        client->event.data = mqtt5_get_unsuback_data(client->mqtt_state.in_buffer, &msg_data_len, &client->event.property->user_property);
+        esp_mqtt5_set_user_property_view(client, NULL, 0);
+        client->event.data = mqtt5_get_unsuback_data(client->mqtt_state.in_buffer, &msg_data_len, esp_mqtt5_event_user_property(client));
         client->event.data_len = msg_data_len;
         client->event.total_data_len = msg_data_len;
         client->event.current_data_offset = 0;
     }
 }
 
+mqtt5_user_property_handle_t *esp_mqtt5_event_user_property(esp_mqtt5_client_handle_t client)
+{
+    return client->mqtt5_config->user_property_view_only ? NULL : &client->event.property->user_property;
+}
+
+/*
+ * Exposes the user properties of the received packet to the next event, `properties` NULL to locate them in the packet
+ */
+void esp_mqtt5_set_user_property_view(esp_mqtt5_client_handle_t client, uint8_t *properties, size_t properties_len)
+{
+    if (!properties && mqtt5_msg_get_property_block(client->mqtt_state.in_buffer, client->mqtt_state.message_length,
+                                                    &properties, &properties_len) != ESP_OK) {
+        properties = NULL;
+        properties_len = 0;
+    }
+    client->event.property->user_property_view.properties = properties;
+    client->event.property->user_property_view.properties_len = properties_len;
+}
+
 void esp_mqtt5_parse_suback(esp_mqtt5_client_handle_t client)
 {
     if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5) {
@@ -81,28 +107,32 @@ esp_err_t esp_mqtt5_parse_connack(esp_mqtt5_client_handle_t client, int *connect
     size_t len = client->mqtt_state.in_buffer_read_len;
     client->mqtt_state.in_buffer_read_len = 0;
     uint8_t ack_flag = 0;
+    esp_mqtt5_set_user_property_view(client, NULL, 0);
     if (mqtt5_msg_parse_connack_property(client->mqtt_state.in_buffer, len, &client->mqtt_state.
-                                         connection.information, &client->mqtt5_config->connect_property_info, &client->mqtt5_config->server_resp_property_info, connect_rsp_code, &ack_flag, &client->event.property->user_property) != ESP_OK) {
+                                         connection.information, &client->mqtt5_config->connect_property_info, &client->mqtt5_config->server_resp_property_info, connect_rsp_code, &ack_flag, esp_mqtt5_event_user_property(client)) != ESP_OK) {
         ESP_LOGE(TAG, "Failed to parse CONNACK packet");
         return ESP_FAIL;
     }
     if (*connect_rsp_code == MQTT_CONNECTION_ACCEPTED) {
         ESP_LOGD(TAG, "Connected");
         client->event.session_present = ack_flag & 0x01;
+        // topic aliases are valid only within a connection
+        if (esp_mqtt5_client_reset_outbound_topic_alias(client) != ESP_OK) {
+            return ESP_FAIL;
+        }
         return ESP_OK;
     }
     esp_mqtt5_print_error_code(client, *connect_rsp_code);
     return ESP_FAIL;
 }
 
-esp_err_t esp_mqtt5_get_publish_data(esp_mqtt5_client_handle_t client, uint8_t *msg_buf, size_t msg_read_len, char **msg_topic, size_t *msg_topic_len, char **msg_data, size_t *msg_data_len)
+esp_err_t esp_mqtt5_get_publish_data(esp_mqtt5_client_handle_t client, mqtt_publish_view_t *publish)
 {
     // get property
-    uint16_t property_len = 0;
     esp_mqtt5_publish_resp_property_t property = {0};
-    *msg_data = mqtt5_get_publish_property_payload(msg_buf, msg_read_len, msg_topic, msg_topic_len, &property, &property_len, msg_data_len, &client->event.property->user_property);
-     if (*msg_data == NULL) {
-        ESP_LOGE(TAG, "%s: mqtt5_get_publish_property_payload() failed", __func__);
+    esp_mqtt5_set_user_property_view(client, publish->properties, publish->properties_len);
+    if (mqtt5_msg_parse_publish_property(publish->properties, publish->properties_len, &property, esp_mqtt5_event_user_property(client)) != ESP_OK) {
+        ESP_LOGE(TAG, "%s: mqtt5_msg_parse_publish_property() failed", __func__);
         return ESP_FAIL;
     }
 
@@ -112,15 +142,15 @@ esp_err_t esp_mqtt5_get_publish_data(esp_mqtt5_client_handle_t client, uint8_t *
     }
 
     if (property.topic_alias) {
-        if (*msg_topic_len == 0) {
+        if (publish->topic_len == 0) {
             ESP_LOGI(TAG, "Publish topic is empty, use topic alias");
-            *msg_topic = esp_mqtt5_client_get_topic_alias(client->mqtt5_config->peer_topic_alias, property.topic_alias, msg_topic_len);
-            if (!*msg_topic) {
+            publish->topic = esp_mqtt5_client_get_topic_alias(client->mqtt5_config->peer_topic_alias, property.topic_alias, &publish->topic_len);
+            if (!publish->topic) {
                 ESP_LOGE(TAG, "%s: esp_mqtt5_client_get_topic_alias() failed", __func__);
                 return ESP_FAIL;
             }
         } else {
-            if (esp_mqtt5_client_update_topic_alias(client->mqtt5_config->peer_topic_alias, property.topic_alias, *msg_topic, *msg_topic_len) != ESP_OK) {
+            if (esp_mqtt5_client_update_topic_alias(client->mqtt5_config->peer_topic_alias, property.topic_alias, publish->topic, publish->topic_len) != ESP_OK) {
                 ESP_LOGE(TAG, "%s: esp_mqtt5_client_update_topic_alias() failed", __func__);
                 return ESP_FAIL;
             }
@@ -312,6 +342,7 @@ void esp_mqtt5_client_destory(esp_mqtt5_client_handle_t client)
             free(client->mqtt5_config->will_property_info.correlation_data);
             free(client->mqtt5_config->server_resp_property_info.response_info);
             esp_mqtt5_client_delete_topic_alias(client->mqtt5_config->peer_topic_alias);
+            esp_mqtt5_client_delete_outbound_topic_alias(client);
             esp_mqtt5_client_delete_user_property(client->mqtt5_config->connect_property_info.user_property);
             esp_mqtt5_client_delete_user_property(client->mqtt5_config->will_property_info.user_property);
             esp_mqtt5_client_delete_user_property(client->mqtt5_config->disconnect_property_info.user_property);
@@ -321,14 +352,21 @@ void esp_mqtt5_client_destory(esp_mqtt5_client_handle_t client)
     }
 }
 
+static mqtt5_topic_alias_handle_t esp_mqtt5_client_create_topic_alias(uint16_t count)
+{
+    size_t table_size = sizeof(mqtt5_topic_alias_table_t) + count * sizeof(mqtt5_topic_alias_t);
+    mqtt5_topic_alias_handle_t topic_alias_handle = calloc(1, table_size + (size_t)count * MQTT5_TOPIC_ALIAS_SLOT_SIZE);
+    ESP_MEM_CHECK(TAG, topic_alias_handle, return NULL);
+    topic_alias_handle->count = count;
+    topic_alias_handle->arena = (char *)topic_alias_handle + table_size;
+    return topic_alias_handle;
+}
+
 static void esp_mqtt5_client_delete_topic_alias(mqtt5_topic_alias_handle_t topic_alias_handle)
 {
     if (topic_alias_handle) {
-        mqtt5_topic_alias_item_t item, tmp;
-        STAILQ_FOREACH_SAFE(item, topic_alias_handle, next, tmp) {
-            STAILQ_REMOVE(topic_alias_handle, item, mqtt5_topic_alias, next);
-            free(item->topic);
-            free(item);
+        for (int i = 0; i < topic_alias_handle->count; i++) {
+            free(topic_alias_handle->alias[i].heap);
         }
         free(topic_alias_handle);
     }
@@ -336,49 +374,112 @@ static void esp_mqtt5_client_delete_topic_alias(mqtt5_topic_alias_handle_t topic
 
 static esp_err_t esp_mqtt5_client_update_topic_alias(mqtt5_topic_alias_handle_t topic_alias_handle, uint16_t topic_alias, char *topic, size_t topic_len)
 {
-    mqtt5_topic_alias_item_t item;
-    bool found = false;
-    STAILQ_FOREACH(item, topic_alias_handle, next) {
-        if (item->topic_alias == topic_alias) {
-            found = true;
-            break;
-        }
+    if (topic_alias == 0 || topic_alias > topic_alias_handle->count) {
+        return ESP_FAIL;
     }
-    if (found) {
-        if ((item->topic_len != topic_len) || strncmp(topic, item->topic, topic_len)) {
-            free(item->topic);
-            item->topic = calloc(1, topic_len);
-            ESP_MEM_CHECK(TAG, item->topic, return ESP_FAIL);
-            memcpy(item->topic, topic, topic_len);
-            item->topic_len = topic_len;
-        }
+    mqtt5_topic_alias_t *alias = &topic_alias_handle->alias[topic_alias - 1];
+    if (topic_len <= MQTT5_TOPIC_ALIAS_SLOT_SIZE) {
+        alias->topic = topic_alias_handle->arena + (topic_alias - 1) * MQTT5_TOPIC_ALIAS_SLOT_SIZE;
     } else {
-        item = calloc(1, sizeof(mqtt5_topic_alias_t));
-        ESP_MEM_CHECK(TAG, item, return ESP_FAIL);
-        item->topic_alias = topic_alias;
-        item->topic_len = topic_len;
-        item->topic = calloc(1, topic_len);
-        ESP_MEM_CHECK(TAG, item->topic, {
-            free(item);
-            return ESP_FAIL;
-        });
-        memcpy(item->topic, topic, topic_len);
-        STAILQ_INSERT_TAIL(topic_alias_handle, item, next);
+        if (topic_len > alias->heap_size) {
+            char *heap = realloc(alias->heap, topic_len);
+            ESP_MEM_CHECK(TAG, heap, return ESP_FAIL);
+            alias->heap = heap;
+            alias->heap_size = topic_len;
+        }
+        alias->topic = alias->heap;
     }
+    memcpy(alias->topic, topic, topic_len);
+    alias->topic_len = topic_len;
     return ESP_OK;
 }
 
 static char *esp_mqtt5_client_get_topic_alias(mqtt5_topic_alias_handle_t topic_alias_handle, uint16_t topic_alias, size_t *topic_length)
 {
-    mqtt5_topic_alias_item_t item;
-    STAILQ_FOREACH(item, topic_alias_handle, next) {
-        if (item->topic_alias == topic_alias) {
-            *topic_length = item->topic_len;
-            return item->topic;
-        }
+    if (topic_alias == 0 || topic_alias > topic_alias_handle->count || topic_alias_handle->alias[topic_alias - 1].topic_len == 0) {
+        *topic_length = 0;
+        return NULL;
+    }
+    *topic_length = topic_alias_handle->alias[topic_alias - 1].topic_len;
+    return topic_alias_handle->alias[topic_alias - 1].topic;
+}
+
+static void esp_mqtt5_client_delete_outbound_topic_alias(esp_mqtt5_client_handle_t client)
+{
+    mqtt5_config_storage_t *config = client->mqtt5_config;
+    for (int i = 0; i < config->outbound_topic_alias_count; i++) {
+        free(config->outbound_topic_alias[i].topic);
+    }
+    free(config->outbound_topic_alias);
+    config->outbound_topic_alias = NULL;
+    config->outbound_topic_alias_count = 0;
+    config->outbound_topic_alias_clock = 0;
+}
+
+static esp_err_t esp_mqtt5_client_reset_outbound_topic_alias(esp_mqtt5_client_handle_t client)
+{
+    mqtt5_config_storage_t *config = client->mqtt5_config;
+    esp_mqtt5_client_delete_outbound_topic_alias(client);
+    uint16_t count = MIN(config->server_resp_property_info.topic_alias_maximum, MQTT5_OUTBOUND_TOPIC_ALIAS_MAX);
+    if (!config->auto_topic_alias || count == 0) {
+        return ESP_OK;
     }
-    *topic_length = 0;
-    return NULL;
+    config->outbound_topic_alias = calloc(count, sizeof(mqtt5_outbound_topic_alias_t));
+    ESP_MEM_CHECK(TAG, config->outbound_topic_alias, return ESP_FAIL);
+    config->outbound_topic_alias_count = count;
+    return ESP_OK;
+}
+
+/*
+ * Returns the alias of the topic, assigning the least recently used alias if the topic has none
+ */
+static uint16_t esp_mqtt5_client_assign_outbound_topic_alias(esp_mqtt5_client_handle_t client, const char *topic)
+{
+    mqtt5_config_storage_t *config = client->mqtt5_config;
+    mqtt5_outbound_topic_alias_t *lru = NULL;
+    for (int i = 0; i < config->outbound_topic_alias_count; i++) {
+        mqtt5_outbound_topic_alias_t *alias = &config->outbound_topic_alias[i];
+        if (alias->topic && strcmp(alias->topic, topic) == 0) {
+            alias->last_used = ++config->outbound_topic_alias_clock;
+            return i + 1;
+        }
+        if (!lru || !alias->topic || (lru->topic && alias->last_used < lru->last_used)) {
+            lru = alias;
+        }
+    }
+    if (!lru) {
+        return 0;
+    }
+    char *copy = strdup(topic);
+    ESP_MEM_CHECK(TAG, copy, return 0);
+    free(lru->topic);
+    lru->topic = copy;
+    lru->sent = false;
+    lru->last_used = ++config->outbound_topic_alias_clock;
+    return lru - config->outbound_topic_alias + 1;
+}
+
+/*
+ * Rewrites the publish message in the output buffer in place to use a topic alias assigned by the client,
+ * if enabled. It's applied only to the message written to the connection, the outbox keeps the
+ * message with its topic, as resending it could happen on another connection.
+ */
+void esp_mqtt5_client_alias_publish(esp_mqtt5_client_handle_t client, const char *topic, const esp_mqtt5_publish_property_config_t *property)
+{
+    mqtt5_config_storage_t *config = client->mqtt5_config;
+    if (!config->outbound_topic_alias_count || !topic || (property && property->topic_alias)) {
+        return;
+    }
+    uint16_t topic_alias = esp_mqtt5_client_assign_outbound_topic_alias(client, topic);
+    if (topic_alias == 0) {
+        return;
+    }
+    mqtt5_outbound_topic_alias_t *alias = &config->outbound_topic_alias[topic_alias - 1];
+    if (mqtt5_msg_publish_set_topic_alias(&client->mqtt_state.connection, topic_alias, !alias->sent) != ESP_OK) {
+        ESP_LOGD(TAG, "Topic alias %d cannot be applied, sending the topic", topic_alias);
+        return;
+    }
+    alias->sent = true;
 }
 
 static esp_err_t esp_mqtt5_user_property_copy(mqtt5_user_property_handle_t user_property_new, const mqtt5_user_property_handle_t user_property_old)
@@ -567,8 +668,9 @@ esp_err_t esp_mqtt5_client_set_connect_property(esp_mqtt5_client_handle_t client
             client->mqtt5_config->connect_property_info.session_expiry_interval = connect_property->session_expiry_interval;
         }
         if (connect_property->maximum_packet_size) {
-            if (connect_property->maximum_packet_size > client->mqtt_state.in_buffer_length) {
-                ESP_LOGW(TAG, "Connect maximum_packet_size property is over buffer_size(%d), Please first change it", client->mqtt_state.in_buffer_length);
+            int max_packet_size = client->mqtt_state.in_buffer_length > MQTT_MAX_INCOMING_PACKET_SIZE ? client->mqtt_state.in_buffer_length : MQTT_MAX_INCOMING_PACKET_SIZE;
+            if (connect_property->maximum_packet_size > max_packet_size) {
+                ESP_LOGW(TAG, "Connect maximum_packet_size property is over buffer_size(%d) and MQTT_MAX_INCOMING_PACKET_SIZE, Please first change it", client->mqtt_state.in_buffer_length);
                 MQTT_API_UNLOCK(client);
                 return ESP_FAIL;
             } else {
@@ -582,12 +684,14 @@ esp_err_t esp_mqtt5_client_set_connect_property(esp_mqtt5_client_handle_t client
         }
         if (connect_property->topic_alias_maximum) {
             client->mqtt5_config->connect_property_info.topic_alias_maximum = connect_property->topic_alias_maximum;
-            if (!client->mqtt5_config->peer_topic_alias) {
-                client->mqtt5_config->peer_topic_alias = calloc(1, sizeof(struct mqtt5_topic_alias_list_t));
+            if (!client->mqtt5_config->peer_topic_alias || client->mqtt5_config->peer_topic_alias->count != connect_property->topic_alias_maximum) {
+                esp_mqtt5_client_delete_topic_alias(client->mqtt5_config->peer_topic_alias);
+                client->mqtt5_config->peer_topic_alias = esp_mqtt5_client_create_topic_alias(connect_property->topic_alias_maximum);
                 ESP_MEM_CHECK(TAG, client->mqtt5_config->peer_topic_alias, goto _mqtt_set_config_failed);
-                STAILQ_INIT(client->mqtt5_config->peer_topic_alias);
             }
         }
+        client->mqtt5_config->auto_topic_alias = connect_property->auto_topic_alias;
+        client->mqtt5_config->user_property_view_only = connect_property->user_property_view_only;
         if (connect_property->request_resp_info) {
             client->mqtt5_config->connect_property_info.request_resp_info = connect_property->request_resp_info;
         }
@@ -734,6 +838,50 @@ err:
     return ESP_ERR_NO_MEM;
 }
 
+bool esp_mqtt5_user_property_view_next(const esp_mqtt5_user_property_view_t *view, size_t *offset, esp_mqtt5_user_property_ref_t *item)
+{
+    if (!view || !view->properties || !offset || !item) {
+        return false;
+    }
+    return mqtt5_msg_next_user_property(view->properties, view->properties_len, offset, item);
+}
+
+esp_err_t esp_mqtt5_user_property_view_copy(const esp_mqtt5_user_property_view_t *view, mqtt5_user_property_handle_t *user_property)
+{
+    if (!view || !user_property) {
+        ESP_LOGE(TAG, "Input value is NULL");
+        return ESP_ERR_INVALID_ARG;
+    }
+    *user_property = NULL;
+    size_t offset = 0;
+    esp_mqtt5_user_property_ref_t ref;
+    while (esp_mqtt5_user_property_view_next(view, &offset, &ref)) {
+        if (!*user_property) {
+            *user_property = calloc(1, sizeof(struct mqtt5_user_property_list_t));
+            ESP_MEM_CHECK(TAG, *user_property, return ESP_ERR_NO_MEM);
+            STAILQ_INIT(*user_property);
+        }
+        mqtt5_user_property_item_t user_property_item = calloc(1, sizeof(mqtt5_user_property_t));
+        ESP_MEM_CHECK(TAG, user_property_item, goto err);
+        user_property_item->key = calloc(1, ref.key_len + 1);
+        user_property_item->value = calloc(1, ref.value_len + 1);
+        ESP_MEM_CHECK(TAG, user_property_item->key && user_property_item->value, {
+            free(user_property_item->key);
+            free(user_property_item->value);
+            free(user_property_item);
+            goto err;
+        });
+        memcpy(user_property_item->key, ref.key, ref.key_len);
+        memcpy(user_property_item->value, ref.value, ref.value_len);
+        STAILQ_INSERT_TAIL(*user_property, user_property_item, next);
+    }
+    return ESP_OK;
+err:
+    esp_mqtt5_client_delete_user_property(*user_property);
+    *user_property = NULL;
+    return ESP_ERR_NO_MEM;
+}
+
 uint8_t esp_mqtt5_client_get_user_property_count(mqtt5_user_property_handle_t user_property)
 {
     uint8_t count = 0;
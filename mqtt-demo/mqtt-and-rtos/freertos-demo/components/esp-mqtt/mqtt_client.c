@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/param.h>
 #include "esp_err.h"
 #include "esp_log.h"
 #include "esp_heap_caps.h"
@@ -8,6 +9,12 @@
 #include "mqtt_client_priv.h"
 #include "mqtt_msg.h"
 #include "mqtt_outbox.h"
+#ifdef MQTT_SUPPORTED_FEATURE_WAKEUP_EVENTFD
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "esp_vfs_eventfd.h"
+#endif
 
 _Static_assert(sizeof(uint64_t) == sizeof(outbox_tick_t), "mqtt-client tick type size different from outbox tick type");
 #ifdef ESP_EVENT_ANY_ID
@@ -29,6 +36,9 @@ ESP_EVENT_DEFINE_BASE(MQTT_EVENTS);
 #define MQTT_OVER_WS_SCHEME  "ws"
 #define MQTT_OVER_WSS_SCHEME "wss"
 
+#define MQTT_ASYNC_PUBLISH_INDEX_INITIAL_SIZE (16)
+#define MQTT_ASYNC_PUBLISH_INDEX_MAX_SIZE     (1 << 16)
+
 const static int STOPPED_BIT = (1 << 0);
 const static int RECONNECT_BIT = (1 << 1);
 const static int DISCONNECT_BIT = (1 << 2);
@@ -42,6 +52,74 @@ static char *create_string(const char *ptr, int len);
 static int mqtt_message_receive(esp_mqtt_client_handle_t client, int read_poll_timeout_ms);
 static void esp_mqtt_client_dispatch_transport_error(esp_mqtt_client_handle_t client);
 static esp_err_t send_disconnect_msg(esp_mqtt_client_handle_t client);
+static void mqtt_process_async_publishes(esp_mqtt_client_handle_t client);
+static void mqtt_drop_async_publishes(esp_mqtt_client_handle_t client);
+
+static inline bool mqtt_bulk_read_pending(esp_mqtt_client_handle_t client)
+{
+    return client->mqtt_state.bulk_read_pos < client->mqtt_state.bulk_read_len;
+}
+
+static inline void mqtt_bulk_read_reset(esp_mqtt_client_handle_t client)
+{
+    client->mqtt_state.bulk_read_pos = 0;
+    client->mqtt_state.bulk_read_len = 0;
+}
+
+/*
+ * Reads from the transport through the bulk read buffer, i.e. as much data as available is read
+ * at once and the following reads are served from the buffer. Returns less than `len` if the
+ * buffer holds less, and the same as esp_transport_read() if the transport was read.
+ */
+static int mqtt_transport_read(esp_mqtt_client_handle_t client, uint8_t *buf, int len, int timeout_ms)
+{
+    mqtt_state_t *state = &client->mqtt_state;
+    if (!mqtt_bulk_read_pending(client)) {
+        mqtt_bulk_read_reset(client);
+        // reads of the bulk size or longer (e.g. the payload of a big message) don't need the buffer
+        if (len >= state->bulk_read_size) {
+            return esp_transport_read(client->transport, (char *)buf, len, timeout_ms);
+        }
+        int read_len = esp_transport_read(client->transport, (char *)state->bulk_read_buffer, state->bulk_read_size, timeout_ms);
+        if (read_len <= 0) {
+            return read_len;
+        }
+        state->bulk_read_len = read_len;
+    }
+    int copy_len = MIN(len, state->bulk_read_len - state->bulk_read_pos);
+    memcpy(buf, state->bulk_read_buffer + state->bulk_read_pos, copy_len);
+    state->bulk_read_pos += copy_len;
+    return copy_len;
+}
+
+/*
+ * Moves the beginning of a packet exceeding the input buffer into a heap buffer of the packet size,
+ * where the rest of the packet is received. Used for all packets but PUBLISH, whose payload is split
+ * into several data events instead.
+ */
+static esp_err_t mqtt_receive_oversized(esp_mqtt_client_handle_t client, int total_len)
+{
+    if (total_len > MQTT_MAX_INCOMING_PACKET_SIZE) {
+        ESP_LOGE(TAG, "%s: message is too big (%d), exceeds MQTT_MAX_INCOMING_PACKET_SIZE", __func__, total_len);
+        return ESP_FAIL;
+    }
+    uint8_t *buffer = (uint8_t *)malloc(total_len + 1);
+    ESP_MEM_CHECK(TAG, buffer, return ESP_ERR_NO_MEM);
+    memcpy(buffer, client->mqtt_state.in_buffer, client->mqtt_state.in_buffer_read_len);
+    client->mqtt_state.in_buffer_saved = client->mqtt_state.in_buffer;
+    client->mqtt_state.in_buffer = buffer;
+    ESP_LOGD(TAG, "%s: receiving %d bytes into a temporary buffer", __func__, total_len);
+    return ESP_OK;
+}
+
+static void mqtt_release_oversized(esp_mqtt_client_handle_t client)
+{
+    if (client->mqtt_state.in_buffer_saved) {
+        free(client->mqtt_state.in_buffer);
+        client->mqtt_state.in_buffer = client->mqtt_state.in_buffer_saved;
+        client->mqtt_state.in_buffer_saved = NULL;
+    }
+}
 
 static int esp_mqtt_handle_transport_read_error(int err, esp_mqtt_client_handle_t client)
 {
@@ -398,6 +476,8 @@ esp_err_t esp_mqtt_set_config(esp_mqtt_client_handle_t client, const esp_mqtt_cl
         client->config->task_stack = MQTT_TASK_STACK;
     }
 
+    client->config->reactor = config->task.reactor;
+
     if (config->broker.address.port) {
         client->config->port = config->broker.address.port;
     }
@@ -494,6 +574,8 @@ esp_err_t esp_mqtt_set_config(esp_mqtt_client_handle_t client, const esp_mqtt_cl
     } else {
         client->config->reconnect_timeout_ms = MQTT_RECON_DEFAULT_MS;
     }
+    client->config->reconnect_max_timeout_ms = config->network.reconnect_max_timeout_ms;
+    client->config->reconnect_first_immediately = config->network.reconnect_first_immediately;
     if (config->network.transport) {
         client->config->transport = config->network.transport;
     }
@@ -583,6 +665,7 @@ esp_err_t esp_mqtt_set_config(esp_mqtt_client_handle_t client, const esp_mqtt_cl
         }
     }
     client->config->outbox_limit = config->outbox.limit;
+    client->config->outbox_overflow_policy = config->outbox.overflow_policy;
     esp_err_t config_has_conflict = esp_mqtt_check_cfg_conflict(client->config, config);
 
     MQTT_API_UNLOCK(client);
@@ -663,12 +746,12 @@ static esp_err_t process_keepalive(esp_mqtt_client_handle_t client)
     return ESP_OK;
 }
 
-static inline esp_err_t esp_mqtt_write(esp_mqtt_client_handle_t client)
+static esp_err_t esp_mqtt_write_data(esp_mqtt_client_handle_t client, const uint8_t *data, int len)
 {
-    int wlen = 0, widx = 0, len = client->mqtt_state.connection.outbound_message.length;
+    int wlen = 0, widx = 0;
     while (len > 0) {
         wlen = esp_transport_write(client->transport,
-                                   (char *)client->mqtt_state.connection.outbound_message.data + widx,
+                                   (const char *)data + widx,
                                    len,
                                    client->config->network_timeout_ms);
         if (wlen < 0) {
@@ -687,6 +770,12 @@ static inline esp_err_t esp_mqtt_write(esp_mqtt_client_handle_t client)
     return ESP_OK;
 }
 
+static inline esp_err_t esp_mqtt_write(esp_mqtt_client_handle_t client)
+{
+    return esp_mqtt_write_data(client, client->mqtt_state.connection.outbound_message.data,
+                               client->mqtt_state.connection.outbound_message.length);
+}
+
 static esp_err_t esp_mqtt_connect(esp_mqtt_client_handle_t client, int timeout_ms)
 {
     int read_len, connect_rsp_code = 0;
@@ -785,22 +874,119 @@ static esp_err_t esp_mqtt_connect(esp_mqtt_client_handle_t client, int timeout_m
     return ESP_FAIL;
 }
 
-static void esp_mqtt_abort_connection(esp_mqtt_client_handle_t client)
+/*
+ * Returns the delay before the next reconnection attempt, see reconnect_max_timeout_ms
+ * of the network configuration. The backoff is reset once the broker accepts the connection.
+ * Only a connection lost unexpectedly is reestablished immediately (reconnect_first_immediately).
+ */
+static int mqtt_next_reconnect_timeout(esp_mqtt_client_handle_t client, bool connection_lost)
+{
+    const mqtt_config_storage_t *config = client->config;
+    if (client->reconnect_attempts++ == 0 && connection_lost && config->reconnect_first_immediately) {
+        return 0;
+    }
+    if (config->reconnect_max_timeout_ms <= config->reconnect_timeout_ms) {
+        return config->reconnect_timeout_ms;
+    }
+    // decorrelated jitter, spreads the reconnections of many clients losing the same broker
+    int64_t upper = (int64_t)MAX(client->reconnect_backoff_ms, config->reconnect_timeout_ms) * 3;
+    upper = MIN(upper, config->reconnect_max_timeout_ms);
+    client->reconnect_backoff_ms = config->reconnect_timeout_ms + platform_random(upper - config->reconnect_timeout_ms + 1);
+    return client->reconnect_backoff_ms;
+}
+
+/*
+ * Closes the connection and waits for reconnection
+ * connection_lost is false if the connection was closed on purpose, by a disconnect request
+ * or to refresh it
+ */
+static void esp_mqtt_close_connection(esp_mqtt_client_handle_t client, bool connection_lost)
 {
     MQTT_API_LOCK(client);
     esp_transport_close(client->transport);
-    client->wait_timeout_ms = client->config->reconnect_timeout_ms;
+    mqtt_bulk_read_reset(client);
+    mqtt_release_oversized(client);
+    client->wait_timeout_ms = client->config->auto_reconnect ? mqtt_next_reconnect_timeout(client, connection_lost) : client->config->reconnect_timeout_ms;
     client->reconnect_tick = platform_tick_get_ms();
     client->state = MQTT_STATE_WAIT_RECONNECT;
     ESP_LOGD(TAG, "Reconnect after %d ms", client->wait_timeout_ms);
     client->event.event_id = MQTT_EVENT_DISCONNECTED;
+    client->event.reconnect_delay_ms = client->config->auto_reconnect ? client->wait_timeout_ms : -1;
     client->wait_for_ping_resp = false;
     esp_mqtt_dispatch_event_with_msgid(client);
     MQTT_API_UNLOCK(client);
 }
 
+static void esp_mqtt_abort_connection(esp_mqtt_client_handle_t client)
+{
+    esp_mqtt_close_connection(client, true);
+}
+
+#ifdef MQTT_SUPPORTED_FEATURE_WAKEUP_EVENTFD
+static int mqtt_wakeup_fd_create(void)
+{
+    esp_vfs_eventfd_config_t config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+    config.max_fds = MQTT_WAKEUP_EVENTFD_MAX_FDS;
+    esp_err_t err = esp_vfs_eventfd_register(&config);
+    // eventfd might have been registered already, by the application (with its own max_fds) or by another client
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+        ESP_LOGW(TAG, "Failed to register eventfd, the client task will poll for new work");
+        return -1;
+    }
+    int fd = eventfd(0, 0);
+    if (fd < 0) {
+        ESP_LOGW(TAG, "Failed to create eventfd, errno=%d, new work is picked up within %d ms. "
+                 "All eventfds might be in use, see CONFIG_MQTT_WAKEUP_EVENTFD_MAX_FDS", errno, MQTT_POLL_READ_TIMEOUT_MS);
+    }
+    return fd;
+}
+
+static void mqtt_wakeup_fd_signal(int fd)
+{
+    uint64_t value = 1;
+    if (write(fd, &value, sizeof(value)) < 0) {
+        ESP_LOGD(TAG, "Failed to wake up the client task, errno=%d", errno);
+    }
+}
+
+static void mqtt_wakeup_fd_clear(int fd)
+{
+    uint64_t value;
+    if (read(fd, &value, sizeof(value)) < 0) {
+        ESP_LOGD(TAG, "Failed to clear the wakeup, errno=%d", errno);
+    }
+}
+
+LIST_HEAD(esp_mqtt_reactor_client_list_t, esp_mqtt_client);
+
+struct esp_mqtt_reactor {
+    struct esp_mqtt_reactor_client_list_t clients;  // clients run by the reactor, protected by the lock
+    SemaphoreHandle_t lock;
+    EventGroupHandle_t status_bits;
+    TaskHandle_t task_handle;
+    int wakeup_fd;
+    bool run;
+};
+#endif
+
+/*
+ * Wakes up the client task waiting for incoming data, so that it processes new work right away
+ */
+static void mqtt_client_wakeup(esp_mqtt_client_handle_t client)
+{
+#ifdef MQTT_SUPPORTED_FEATURE_WAKEUP_EVENTFD
+    if (client->reactor) {
+        atomic_store(&client->reactor_pending, true);
+        mqtt_wakeup_fd_signal(client->reactor->wakeup_fd);
+    } else if (client->wakeup_fd >= 0) {
+        mqtt_wakeup_fd_signal(client->wakeup_fd);
+    }
+#endif
+}
+
 static bool create_client_data(esp_mqtt_client_handle_t client)
 {
+    client->wakeup_fd = -1;
     client->event.error_handle = calloc(1, sizeof(esp_mqtt_error_codes_t));
     ESP_MEM_CHECK(TAG, client->event.error_handle, return false)
 
@@ -813,9 +999,9 @@ static bool create_client_data(esp_mqtt_client_handle_t client)
 esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t *config)
 {
     esp_mqtt_client_handle_t client = heap_caps_calloc(1, sizeof(struct esp_mqtt_client),
-#if MQTT_EVENT_QUEUE_SIZE > 1
-                                      // if supporting multiple queued events, we keep track of them
-                                      // using atomic variable, so need to make sure it won't get allocated in PSRAM
+#if MQTT_EVENT_QUEUE_SIZE > 1 || defined(MQTT_SUPPORTED_FEATURE_WAKEUP_EVENTFD)
+                                      // if supporting multiple queued events or a reactor, we keep track of them
+                                      // using atomic variables, so need to make sure it won't get allocated in PSRAM
                                       MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
 #else
                                       MALLOC_CAP_DEFAULT);
@@ -838,14 +1024,35 @@ esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t *co
     client->mqtt_state.in_buffer = (uint8_t *)malloc(buffer_size + 1);
     ESP_MEM_CHECK(TAG, client->mqtt_state.in_buffer, goto _mqtt_init_failed);
     client->mqtt_state.in_buffer_length = buffer_size;
+    if (MQTT_BULK_READ_SIZE > 0) {
+        client->mqtt_state.bulk_read_buffer = (uint8_t *)malloc(MQTT_BULK_READ_SIZE);
+        ESP_MEM_CHECK(TAG, client->mqtt_state.bulk_read_buffer, goto _mqtt_init_failed);
+        client->mqtt_state.bulk_read_size = MQTT_BULK_READ_SIZE;
+    }
     client->outbox = outbox_init();
     ESP_MEM_CHECK(TAG, client->outbox, goto _mqtt_init_failed);
+#if MQTT_MSG_ID_INCREMENTAL
+    // continue after the messages recovered from a persistent outbox, which are resent with their ids
+    client->mqtt_state.connection.last_message_id = outbox_get_recovered_msg_id(client->outbox);
+#endif
+    client->async_publish_index = calloc(MQTT_ASYNC_PUBLISH_INDEX_INITIAL_SIZE, sizeof(esp_mqtt_async_publish_handle_t));
+    ESP_MEM_CHECK(TAG, client->async_publish_index, goto _mqtt_init_failed);
+    client->async_publish_index_size = MQTT_ASYNC_PUBLISH_INDEX_INITIAL_SIZE;
+    LIST_INIT(&client->topics);
+    client->async_publish_ring = mqtt_submit_ring_create(MQTT_ASYNC_PUBLISH_QUEUE_SIZE);
+    ESP_MEM_CHECK(TAG, client->async_publish_ring, goto _mqtt_init_failed);
     client->status_bits = xEventGroupCreate();
     ESP_MEM_CHECK(TAG, client->status_bits, goto _mqtt_init_failed);
 
     if (esp_mqtt_set_config(client, config) != ESP_OK) {
         goto _mqtt_init_failed;
     }
+#ifdef MQTT_SUPPORTED_FEATURE_WAKEUP_EVENTFD
+    // clients run by a reactor are woken up through the eventfd of the reactor
+    if (!client->config->reactor) {
+        client->wakeup_fd = mqtt_wakeup_fd_create();
+    }
+#endif
 #ifdef MQTT_SUPPORTED_FEATURE_EVENT_LOOP
     esp_event_loop_args_t no_task_loop = {
         .queue_size = MQTT_EVENT_QUEUE_SIZE,
@@ -884,13 +1091,30 @@ esp_err_t esp_mqtt_client_destroy(esp_mqtt_client_handle_t client)
     if (client->transport_list) {
         esp_transport_list_destroy(client->transport_list);
     }
+    mqtt_drop_async_publishes(client);
+    if (client->async_publish_ring) {
+        mqtt_submit_ring_destroy(client->async_publish_ring);
+    }
+    free(client->async_publish_index);
+    free(client->deleted_reports);
+    esp_mqtt_topic_handle_t topic;
+    while ((topic = LIST_FIRST(&client->topics)) != NULL) {
+        esp_mqtt_client_unregister_topic(client, topic);
+    }
     if (client->outbox) {
         outbox_destroy(client->outbox);
     }
     if (client->status_bits) {
         vEventGroupDelete(client->status_bits);
     }
+#ifdef MQTT_SUPPORTED_FEATURE_WAKEUP_EVENTFD
+    if (client->wakeup_fd >= 0) {
+        close(client->wakeup_fd);
+    }
+#endif
+    mqtt_release_oversized(client);
     free(client->mqtt_state.in_buffer);
+    free(client->mqtt_state.bulk_read_buffer);
     mqtt_msg_buffer_destroy(&client->mqtt_state.connection);
     if (client->api_lock) {
         vSemaphoreDelete(client->api_lock);
@@ -999,6 +1223,7 @@ esp_err_t esp_mqtt_dispatch_custom_event(esp_mqtt_client_handle_t client, esp_mq
         atomic_fetch_add(&client->queued_events, 1);
     }
 #endif
+    mqtt_client_wakeup(client);
     return ret;
 }
 
@@ -1008,65 +1233,50 @@ static esp_err_t esp_mqtt_dispatch_event(esp_mqtt_client_handle_t client)
     client->event.protocol_ver = client->mqtt_state.connection.information.protocol_ver;
     esp_err_t ret = ESP_FAIL;
 
+    if (client->direct_handler) {
+        client->direct_handler(&client->event, client->direct_handler_args);
+        ret = ESP_OK;
+    } else {
 #ifdef MQTT_SUPPORTED_FEATURE_EVENT_LOOP
-    esp_event_post_to(client->config->event_loop_handle, MQTT_EVENTS, client->event.event_id, &client->event, sizeof(client->event), portMAX_DELAY);
-    ret = esp_event_loop_run(client->config->event_loop_handle, 0);
+        esp_event_post_to(client->config->event_loop_handle, MQTT_EVENTS, client->event.event_id, &client->event, sizeof(client->event), portMAX_DELAY);
+        ret = esp_event_loop_run(client->config->event_loop_handle, 0);
 #else
-    return ESP_FAIL;
+        return ESP_FAIL;
 #endif
+    }
     if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5) {
 #ifdef MQTT_PROTOCOL_5
         esp_mqtt5_client_delete_user_property(client->event.property->user_property);
         client->event.property->user_property = NULL;
+        client->event.property->user_property_view.properties = NULL;
+        client->event.property->user_property_view.properties_len = 0;
 #endif
     }
     return ret;
 }
 
-static esp_err_t deliver_publish(esp_mqtt_client_handle_t client)
+static esp_err_t deliver_publish(esp_mqtt_client_handle_t client, mqtt_publish_view_t *publish)
 {
-    uint8_t *msg_buf = client->mqtt_state.in_buffer;
     size_t msg_read_len = client->mqtt_state.in_buffer_read_len;
     size_t msg_total_len = client->mqtt_state.message_length;
-    size_t msg_topic_len = msg_read_len, msg_data_len = msg_read_len;
     size_t msg_data_offset = 0;
-    char *msg_topic = NULL, *msg_data = NULL;
 
     if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5) {
 #ifdef MQTT_PROTOCOL_5
-        if (esp_mqtt5_get_publish_data(client, msg_buf, msg_read_len, &msg_topic, &msg_topic_len, &msg_data, &msg_data_len) != ESP_OK) {
+        if (esp_mqtt5_get_publish_data(client, publish) != ESP_OK) {
             ESP_LOGE(TAG, "%s: esp_mqtt5_get_publish_data() failed", __func__);
             return ESP_FAIL;
         }
 #endif
-    } else {
-        // get topic
-        msg_topic = mqtt_get_publish_topic(msg_buf, &msg_topic_len);
-        if (msg_topic == NULL) {
-            ESP_LOGE(TAG, "%s: mqtt_get_publish_topic() failed", __func__);
-            return ESP_FAIL;
-        }
-        ESP_LOGD(TAG, "%s: msg_topic_len=%"NEWLIB_NANO_COMPAT_FORMAT, __func__, NEWLIB_NANO_COMPAT_CAST(msg_topic_len));
-
-        // get payload
-        msg_data = mqtt_get_publish_data(msg_buf, &msg_data_len);
-        if (msg_data_len > 0 && msg_data == NULL) {
-            ESP_LOGE(TAG, "%s: mqtt_get_publish_data() failed", __func__);
-            return ESP_FAIL;
-        }
     }
+    char *msg_topic = publish->topic, *msg_data = publish->data;
+    size_t msg_topic_len = publish->topic_len, msg_data_len = publish->data_len;
     // post data event
-    client->event.retain = mqtt_get_retain(msg_buf);
-    if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5) {
-#ifdef MQTT_PROTOCOL_5
-        client->event.msg_id = mqtt5_get_id(msg_buf, msg_read_len);
-#endif
-    } else {
-        client->event.msg_id = mqtt_get_id(msg_buf, msg_read_len);
-    }
-    client->event.qos = mqtt_get_qos(msg_buf);
-    client->event.dup = mqtt_get_dup(msg_buf);
-    client->event.total_data_len = msg_data_len + msg_total_len - msg_read_len;
+    client->event.retain = publish->retain;
+    client->event.msg_id = publish->msg_id;
+    client->event.qos = publish->qos;
+    client->event.dup = publish->dup;
+    client->event.total_data_len = publish->total_data_len;
 post_data_event:
     ESP_LOGD(TAG, "Get data len= %"NEWLIB_NANO_COMPAT_FORMAT", topic len=%"NEWLIB_NANO_COMPAT_FORMAT", total_data: %d offset: %"NEWLIB_NANO_COMPAT_FORMAT,
              NEWLIB_NANO_COMPAT_CAST(msg_data_len), NEWLIB_NANO_COMPAT_CAST(msg_topic_len),
@@ -1086,9 +1296,9 @@ post_data_event:
         msg_topic = NULL;
         msg_topic_len = 0;
         msg_data_offset += msg_data_len;
-        int ret = esp_transport_read(client->transport, (char *)client->mqtt_state.in_buffer,
-                                     msg_total_len - msg_read_len > buf_len ? buf_len : msg_total_len - msg_read_len,
-                                     client->config->network_timeout_ms);
+        int ret = mqtt_transport_read(client, client->mqtt_state.in_buffer,
+                                      msg_total_len - msg_read_len > buf_len ? buf_len : msg_total_len - msg_read_len,
+                                      client->config->network_timeout_ms);
         if (ret <= 0) {
             return esp_mqtt_handle_transport_read_error(ret, client) == 0 ? ESP_OK : ESP_FAIL;
         }
@@ -1108,7 +1318,8 @@ static esp_err_t deliver_suback(esp_mqtt_client_handle_t client)
 
     if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5) {
 #ifdef MQTT_PROTOCOL_5
-        msg_data = mqtt5_get_suback_data(msg_buf, &msg_data_len, &client->event.property->user_property);
+        esp_mqtt5_set_user_property_view(client, NULL, 0);
+        msg_data = mqtt5_get_suback_data(msg_buf, &msg_data_len, esp_mqtt5_event_user_property(client));
 #else
         // SUBACK Using MQTT5 received but MQTT5 is disabled, This is unlikely to happen.
         return ESP_FAIL;
@@ -1155,6 +1366,144 @@ static bool remove_initiator_message(esp_mqtt_client_handle_t client, int msg_ty
     return false;
 }
 
+static void mqtt_complete_async_publish(esp_mqtt_client_handle_t client, esp_mqtt_async_publish_handle_t publish,
+                                        esp_mqtt_publish_status_t status)
+{
+    ESP_LOGD(TAG, "Asynchronous publish id=%d completed, status=%d", publish->msg_id, status);
+    if (publish->cb) {
+        publish->cb(client, publish, publish->msg_id, status, publish->user_ctx);
+    }
+    free(publish->topic);
+    free(publish);
+}
+
+static inline esp_mqtt_async_publish_handle_t *mqtt_async_publish_bucket(esp_mqtt_client_handle_t client, int msg_id)
+{
+    return &client->async_publish_index[(unsigned)msg_id & (client->async_publish_index_size - 1)];
+}
+
+static void mqtt_grow_async_publish_index(esp_mqtt_client_handle_t client)
+{
+    if (client->async_publish_count <= client->async_publish_index_size ||
+            client->async_publish_index_size >= MQTT_ASYNC_PUBLISH_INDEX_MAX_SIZE) {
+        return;
+    }
+    size_t size = client->async_publish_index_size * 2;
+    esp_mqtt_async_publish_handle_t *index = calloc(size, sizeof(esp_mqtt_async_publish_handle_t));
+    if (index == NULL) {
+        // keep the current index, only the chains get longer
+        ESP_LOGW(TAG, "Failed to grow the index of asynchronous publishes");
+        return;
+    }
+    esp_mqtt_async_publish_handle_t *old = client->async_publish_index;
+    size_t old_size = client->async_publish_index_size;
+    client->async_publish_index = index;
+    client->async_publish_index_size = size;
+    for (size_t i = 0; i < old_size; i++) {
+        esp_mqtt_async_publish_handle_t publish;
+        while ((publish = old[i]) != NULL) {
+            old[i] = publish->index_next;
+            esp_mqtt_async_publish_handle_t *slot = mqtt_async_publish_bucket(client, publish->msg_id);
+            publish->index_next = *slot;
+            *slot = publish;
+        }
+    }
+    free(old);
+}
+
+// Keeps the asynchronous publish, whose message was stored in the outbox, until it's completed by its id
+static void mqtt_add_async_publish(esp_mqtt_client_handle_t client, esp_mqtt_async_publish_handle_t publish)
+{
+    esp_mqtt_async_publish_handle_t *slot = mqtt_async_publish_bucket(client, publish->msg_id);
+    publish->index_next = *slot;
+    *slot = publish;
+    client->async_publish_count++;
+    mqtt_grow_async_publish_index(client);
+}
+
+// Completes the asynchronous publish waiting in the outbox with the given message id, if any
+static void mqtt_complete_async_publish_by_id(esp_mqtt_client_handle_t client, int msg_id, esp_mqtt_publish_status_t status)
+{
+    if (client->async_publish_count == 0) {
+        return;
+    }
+    esp_mqtt_async_publish_handle_t *slot = mqtt_async_publish_bucket(client, msg_id);
+    for (; *slot; slot = &(*slot)->index_next) {
+        esp_mqtt_async_publish_handle_t publish = *slot;
+        if (publish->msg_id == msg_id) {
+            *slot = publish->index_next;
+            client->async_publish_count--;
+            mqtt_complete_async_publish(client, publish, status);
+            return;
+        }
+    }
+}
+
+// Completes all the asynchronous publishes, both the submitted and those waiting in the outbox
+static void mqtt_drop_async_publishes(esp_mqtt_client_handle_t client)
+{
+    esp_mqtt_async_publish_handle_t publish;
+    for (size_t i = 0; i < client->async_publish_index_size && client->async_publish_count > 0; i++) {
+        while ((publish = client->async_publish_index[i]) != NULL) {
+            client->async_publish_index[i] = publish->index_next;
+            client->async_publish_count--;
+            mqtt_complete_async_publish(client, publish, MQTT_PUBLISH_STATUS_DROPPED);
+        }
+    }
+    if (client->async_publish_ring) {
+        while ((publish = mqtt_submit_ring_pop(client->async_publish_ring)) != NULL) {
+            mqtt_complete_async_publish(client, publish, MQTT_PUBLISH_STATUS_DROPPED);
+        }
+    }
+}
+
+static void mqtt_report_deleted_message(esp_mqtt_client_handle_t client, int msg_id, esp_mqtt_publish_status_t status)
+{
+    mqtt_complete_async_publish_by_id(client, msg_id, status);
+#if MQTT_REPORT_DELETED_MESSAGES
+    client->event.event_id = MQTT_EVENT_DELETED;
+    client->event.msg_id = msg_id;
+    if (esp_mqtt_dispatch_event(client) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to post event on deleting message id=%d", msg_id);
+    }
+#endif
+}
+
+/*
+ * Keeps the id of a deleted message to be reported by the client task, outside of the eviction
+ * and coalescing, which run in the context of the publishing task, and outside of a batched write
+ */
+static void mqtt_defer_deleted_report(esp_mqtt_client_handle_t client, int msg_id, esp_mqtt_publish_status_t status)
+{
+#if !MQTT_REPORT_DELETED_MESSAGES
+    if (client->async_publish_count == 0) {
+        return;
+    }
+#endif
+    if (client->deleted_report_count == client->deleted_report_size) {
+        size_t size = client->deleted_report_size ? client->deleted_report_size * 2 : 8;
+        mqtt_deleted_report_t *reports = realloc(client->deleted_reports, size * sizeof(mqtt_deleted_report_t));
+        if (reports == NULL) {
+            ESP_LOGE(TAG, "Deleted message id=%d cannot be reported", msg_id);
+            return;
+        }
+        client->deleted_reports = reports;
+        client->deleted_report_size = size;
+    }
+    client->deleted_reports[client->deleted_report_count++] = (mqtt_deleted_report_t) {
+        .msg_id = msg_id, .status = status
+    };
+    mqtt_client_wakeup(client);
+}
+
+static void mqtt_report_deferred_messages(esp_mqtt_client_handle_t client)
+{
+    for (size_t i = 0; i < client->deleted_report_count; i++) {
+        mqtt_report_deleted_message(client, client->deleted_reports[i].msg_id, client->deleted_reports[i].status);
+    }
+    client->deleted_report_count = 0;
+}
+
 static outbox_item_handle_t mqtt_enqueue(esp_mqtt_client_handle_t client, uint8_t *remaining_data, int remaining_len)
 {
     ESP_LOGD(TAG, "mqtt_enqueue id: %d, type=%d successful",
@@ -1167,8 +1516,27 @@ static outbox_item_handle_t mqtt_enqueue(esp_mqtt_client_handle_t client, uint8_
     msg.msg_qos = client->mqtt_state.pending_publish_qos;
     msg.remaining_data = remaining_data;
     msg.remaining_len = remaining_len;
+    outbox_tick_t tick = platform_tick_get_ms();
+    if (msg.msg_type == MQTT_MSG_TYPE_PUBLISH && client->mqtt_state.pending_publish_expiry_ms) {
+        msg.deadline = tick + client->mqtt_state.pending_publish_expiry_ms;
+    }
+    msg.coalesce = msg.msg_type == MQTT_MSG_TYPE_PUBLISH && client->mqtt_state.pending_publish_coalesce;
+    msg.priority = msg.msg_type == MQTT_MSG_TYPE_PUBLISH ? client->mqtt_state.pending_publish_priority : MQTT_PRIORITY_CONTROL;
+    client->mqtt_state.pending_publish_expiry_ms = 0;
+    client->mqtt_state.pending_publish_coalesce = false;
+    if (msg.coalesce) {
+        int replaced_msg_id = -1;
+        outbox_item_handle_t item = outbox_coalesce(client->outbox, &msg, tick, &replaced_msg_id);
+        if (item) {
+            // the replaced message is gone only once the new one is stored
+            if (replaced_msg_id > 0) {
+                mqtt_defer_deleted_report(client, replaced_msg_id, MQTT_PUBLISH_STATUS_DROPPED);
+            }
+            return item;
+        }
+    }
     //Copy to queue buffer
-    return outbox_enqueue(client->outbox, &msg, platform_tick_get_ms());
+    return outbox_enqueue(client->outbox, &msg, tick);
 }
 
 
@@ -1183,8 +1551,12 @@ static outbox_item_handle_t mqtt_enqueue(esp_mqtt_client_handle_t client, uint8_
 static int mqtt_message_receive(esp_mqtt_client_handle_t client, int read_poll_timeout_ms)
 {
     int read_len, total_len, fixed_header_len;
+
+    if (client->mqtt_state.in_buffer_read_len == 0) {
+        // the previous packet was processed, if it was oversized
+        mqtt_release_oversized(client);
+    }
     uint8_t *buf = client->mqtt_state.in_buffer + client->mqtt_state.in_buffer_read_len;
-    esp_transport_handle_t t = client->transport;
 
     client->mqtt_state.message_length = 0;
     if (client->mqtt_state.in_buffer_read_len == 0) {
@@ -1192,7 +1564,7 @@ static int mqtt_message_receive(esp_mqtt_client_handle_t client, int read_poll_t
          * Read first byte of the mqtt packet fixed header, it contains packet
          * type and flags.
          */
-        read_len = esp_transport_read(t, (char *)buf, 1, read_poll_timeout_ms);
+        read_len = mqtt_transport_read(client, buf, 1, read_poll_timeout_ms);
         if (read_len <= 0) {
             return esp_mqtt_handle_transport_read_error(read_len, client);
         }
@@ -1218,7 +1590,7 @@ static int mqtt_message_receive(esp_mqtt_client_handle_t client, int read_poll_t
              * maximal remaining length value = 16383 (maximal total message
              * size of 16386 bytes).
              */
-            read_len = esp_transport_read(t, (char *)buf, 1, read_poll_timeout_ms);
+            read_len = mqtt_transport_read(client, buf, 1, read_poll_timeout_ms);
             if (read_len <= 0) {
                 return esp_mqtt_handle_transport_read_error(read_len, client);
             }
@@ -1230,7 +1602,7 @@ static int mqtt_message_receive(esp_mqtt_client_handle_t client, int read_poll_t
     total_len = mqtt_get_total_length(client->mqtt_state.in_buffer, client->mqtt_state.in_buffer_read_len, &fixed_header_len);
     ESP_LOGD(TAG, "%s: total message length: %d (already read: %"NEWLIB_NANO_COMPAT_FORMAT")", __func__, total_len, NEWLIB_NANO_COMPAT_CAST(client->mqtt_state.in_buffer_read_len));
     client->mqtt_state.message_length = total_len;
-    if (client->mqtt_state.in_buffer_length < total_len) {
+    if (client->mqtt_state.in_buffer_length < total_len && !client->mqtt_state.in_buffer_saved) {
         if (mqtt_get_type(client->mqtt_state.in_buffer) == MQTT_MSG_TYPE_PUBLISH) {
             /*
              * In case larger publish messages, we only need to read full topic, data can be split to multiple data event.
@@ -1238,7 +1610,7 @@ static int mqtt_message_receive(esp_mqtt_client_handle_t client, int read_poll_t
              */
             if (client->mqtt_state.in_buffer_read_len < fixed_header_len + 2) {
                 /* read next 2 bytes - topic length to get minimum portion of publish packet */
-                read_len = esp_transport_read(t, (char *)buf, client->mqtt_state.in_buffer_read_len - fixed_header_len + 2, read_poll_timeout_ms);
+                read_len = mqtt_transport_read(client, buf, client->mqtt_state.in_buffer_read_len - fixed_header_len + 2, read_poll_timeout_ms);
                 ESP_LOGD(TAG, "%s: read_len=%d", __func__, read_len);
                 if (read_len <= 0) {
                     return esp_mqtt_handle_transport_read_error(read_len, client);
@@ -1263,13 +1635,15 @@ static int mqtt_message_receive(esp_mqtt_client_handle_t client, int read_poll_t
             }
             /* free to continue with reading */
         } else {
-            ESP_LOGE(TAG, "%s: message is too big, insufficient buffer size", __func__);
-            goto err;
+            if (mqtt_receive_oversized(client, total_len) != ESP_OK) {
+                goto err;
+            }
+            buf = client->mqtt_state.in_buffer + client->mqtt_state.in_buffer_read_len;
         }
     }
     if (client->mqtt_state.in_buffer_read_len < total_len) {
         /* read the rest of the mqtt message */
-        read_len = esp_transport_read(t, (char *)buf, total_len - client->mqtt_state.in_buffer_read_len, read_poll_timeout_ms);
+        read_len = mqtt_transport_read(client, buf, total_len - client->mqtt_state.in_buffer_read_len, read_poll_timeout_ms);
         ESP_LOGD(TAG, "%s: read_len=%d", __func__, read_len);
         if (read_len <= 0) {
             return esp_mqtt_handle_transport_read_error(read_len, client);
@@ -1289,7 +1663,7 @@ err:
     return -1;
 }
 
-static esp_err_t mqtt_process_receive(esp_mqtt_client_handle_t client)
+static esp_err_t mqtt_process_message(esp_mqtt_client_handle_t client)
 {
     uint8_t msg_type = 0, msg_qos = 0;
     uint16_t msg_id = 0;
@@ -1304,17 +1678,30 @@ static esp_err_t mqtt_process_receive(esp_mqtt_client_handle_t client)
         return ESP_OK;
     }
     int read_len = client->mqtt_state.message_length;
+    bool is_mqtt5 = client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5;
+    mqtt_publish_view_t publish;
 
     // If the message was valid, get the type, quality of service and id of the message
     msg_type = mqtt_get_type(client->mqtt_state.in_buffer);
-    msg_qos = mqtt_get_qos(client->mqtt_state.in_buffer);
-    if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5) {
+    if (msg_type == MQTT_MSG_TYPE_PUBLISH) {
+        // decoded once, for all the processing below
+        if (mqtt_msg_parse_publish(client->mqtt_state.in_buffer, client->mqtt_state.in_buffer_read_len, is_mqtt5, &publish) != ESP_OK) {
+            ESP_LOGE(TAG, "%s: mqtt_msg_parse_publish() failed", __func__);
+            return ESP_FAIL;
+        }
+        msg_qos = publish.qos;
+        msg_id = publish.msg_id;
+    } else {
+        msg_qos = mqtt_get_qos(client->mqtt_state.in_buffer);
+        if (is_mqtt5) {
 #ifdef MQTT_PROTOCOL_5
-        msg_id = mqtt5_get_id(client->mqtt_state.in_buffer, read_len);
+            msg_id = mqtt5_get_id(client->mqtt_state.in_buffer, read_len);
 #endif
-    } else {
-        msg_id = mqtt_get_id(client->mqtt_state.in_buffer, read_len);
+        } else {
+            msg_id = mqtt_get_id(client->mqtt_state.in_buffer, read_len);
+        }
     }
+    client->event.msg_id = msg_id;
 
     ESP_LOGD(TAG, "msg_type=%d, msg_id=%d", msg_type, msg_id);
 
@@ -1339,12 +1726,12 @@ static esp_err_t mqtt_process_receive(esp_mqtt_client_handle_t client)
 #endif
             ESP_LOGD(TAG, "UnSubscribe successful");
             client->event.event_id = MQTT_EVENT_UNSUBSCRIBED;
-            esp_mqtt_dispatch_event_with_msgid(client);
+            esp_mqtt_dispatch_event(client);
         }
         break;
     case MQTT_MSG_TYPE_PUBLISH:
         ESP_LOGD(TAG, "deliver_publish, message_length_read=%"NEWLIB_NANO_COMPAT_FORMAT", message_length=%"NEWLIB_NANO_COMPAT_FORMAT, NEWLIB_NANO_COMPAT_CAST(client->mqtt_state.in_buffer_read_len), NEWLIB_NANO_COMPAT_CAST(client->mqtt_state.message_length));
-        if (deliver_publish(client) != ESP_OK) {
+        if (deliver_publish(client, &publish) != ESP_OK) {
             ESP_LOGE(TAG, "Failed to deliver publish message id=%d", msg_id);
             return ESP_FAIL;
         }
@@ -1391,7 +1778,8 @@ static esp_err_t mqtt_process_receive(esp_mqtt_client_handle_t client)
             esp_mqtt5_parse_puback(client);
 #endif
             client->event.event_id = MQTT_EVENT_PUBLISHED;
-            esp_mqtt_dispatch_event_with_msgid(client);
+            esp_mqtt_dispatch_event(client);
+            mqtt_complete_async_publish_by_id(client, msg_id, MQTT_PUBLISH_STATUS_ACKNOWLEDGED);
         }
         break;
     case MQTT_MSG_TYPE_PUBREC:
@@ -1442,7 +1830,8 @@ static esp_err_t mqtt_process_receive(esp_mqtt_client_handle_t client)
             esp_mqtt5_parse_pubcomp(client);
 #endif
             client->event.event_id = MQTT_EVENT_PUBLISHED;
-            esp_mqtt_dispatch_event_with_msgid(client);
+            esp_mqtt_dispatch_event(client);
+            mqtt_complete_async_publish_by_id(client, msg_id, MQTT_PUBLISH_STATUS_ACKNOWLEDGED);
         }
         break;
     case MQTT_MSG_TYPE_PINGRESP:
@@ -1458,35 +1847,83 @@ static esp_err_t mqtt_process_receive(esp_mqtt_client_handle_t client)
     }
 
     client->mqtt_state.in_buffer_read_len = 0;
+    mqtt_release_oversized(client);
     return ESP_OK;
 }
 
-static esp_err_t mqtt_resend_queued(esp_mqtt_client_handle_t client, outbox_item_handle_t item)
+/*
+ * Receives and processes a message, followed by the messages already read in bulk, up to a batch
+ */
+static esp_err_t mqtt_process_receive(esp_mqtt_client_handle_t client)
+{
+    int batch = 0;
+    do {
+        if (mqtt_process_message(client) != ESP_OK) {
+            return ESP_FAIL;
+        }
+    } while (++batch < MQTT_RECEIVE_BATCH_SIZE && mqtt_bulk_read_pending(client));
+    return ESP_OK;
+}
+
+static void mqtt_record_outbox_wait(esp_mqtt_client_handle_t client, int priority, uint64_t wait_ms)
+{
+    int bucket = 0;
+    while (bucket < MQTT_OUTBOX_WAIT_HISTOGRAM_SIZE - 1 && wait_ms >= (10ULL << (2 * bucket))) {
+        bucket++;
+    }
+    client->outbox_wait_histogram[priority][bucket]++;
+}
+
+/*
+ * Loads the queued message to the outbound message, ready to be written.
+ * Returns ESP_ERR_TIMEOUT if the message was dropped as its deadline has passed, it's reported
+ * by the client task later, as the outbound message might be in the middle of a batch.
+ */
+static esp_err_t mqtt_prepare_queued(esp_mqtt_client_handle_t client, outbox_item_handle_t item)
 {
     // decode queued data
     client->mqtt_state.connection.outbound_message.data = outbox_item_get_data(item, &client->mqtt_state.connection.outbound_message.length, &client->mqtt_state.pending_msg_id,
             &client->mqtt_state.pending_msg_type, &client->mqtt_state.pending_publish_qos);
+    outbox_tick_t deadline = outbox_item_get_deadline(item);
+    if (deadline) {
+        outbox_tick_t now = platform_tick_get_ms();
+        if (now >= deadline) {
+            ESP_LOGD(TAG, "Dropping expired message with id=%d", client->mqtt_state.pending_msg_id);
+            int msg_id = client->mqtt_state.pending_msg_id;
+            outbox_delete_item(client->outbox, item);
+            mqtt_defer_deleted_report(client, msg_id, MQTT_PUBLISH_STATUS_EXPIRED);
+            return ESP_ERR_TIMEOUT;
+        }
+#ifdef MQTT_PROTOCOL_5
+        // let the broker know only the remaining lifetime of the message, rounded up to whole seconds
+        if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5) {
+            mqtt5_msg_set_publish_expiry(client->mqtt_state.connection.outbound_message.data,
+                                         client->mqtt_state.connection.outbound_message.length, (deadline - now + 999) / 1000);
+        }
+#endif
+    }
     // set duplicate flag for QoS-1 and QoS-2 messages
     if (client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_PUBLISH && client->mqtt_state.pending_publish_qos > 0 && (outbox_item_get_pending(item) == TRANSMITTED)) {
         mqtt_set_dup(client->mqtt_state.connection.outbound_message.data);
         ESP_LOGD(TAG, "Sending Duplicated QoS%d message with id=%d", client->mqtt_state.pending_publish_qos, client->mqtt_state.pending_msg_id);
     }
+    return ESP_OK;
+}
 
-    // try to resend the data
-    if (esp_mqtt_write(client) != ESP_OK) {
-        ESP_LOGE(TAG, "Error to resend data ");
-        esp_mqtt_abort_connection(client);
-        return ESP_FAIL;
-    }
-
+/*
+ * Updates the outbox once a queued message of the given type and QoS was written:
+ * QoS 0 publishes are deleted, others are counted as in flight.
+ */
+static void mqtt_queued_sent(esp_mqtt_client_handle_t client, outbox_item_handle_t item, int msg_type, int qos)
+{
     // check if it was QoS-0 publish message
-    if (client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_PUBLISH) {
-        if (client->mqtt_state.pending_publish_qos == 0) {
+    if (msg_type == MQTT_MSG_TYPE_PUBLISH) {
+        if (qos == 0) {
             // delete all qos0 publish messages once we process them
             if (outbox_delete_item(client->outbox, item) != ESP_OK) {
                 ESP_LOGE(TAG, "Failed to remove queued qos0 message from the outbox");
             }
-        } else if (client->mqtt_state.pending_publish_qos > 0) {
+        } else if (qos > 0) {
 #ifdef MQTT_PROTOCOL_5
             if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5) {
                 esp_mqtt5_increment_packet_counter(client);
@@ -1494,211 +1931,599 @@ static esp_err_t mqtt_resend_queued(esp_mqtt_client_handle_t client, outbox_item
 #endif
         }
     }
-    return ESP_OK;
 }
 
-static void mqtt_delete_expired_messages(esp_mqtt_client_handle_t client)
+static esp_err_t mqtt_resend_queued(esp_mqtt_client_handle_t client, outbox_item_handle_t item)
 {
-    // Delete message after OUTBOX_EXPIRED_TIMEOUT_MS milliseconds
-#if MQTT_REPORT_DELETED_MESSAGES
-    // also report the deleted items as MQTT_EVENT_DELETED events if enabled
-    int msg_id = 0;
-    while ((msg_id = outbox_delete_single_expired(client->outbox, platform_tick_get_ms(), OUTBOX_EXPIRED_TIMEOUT_MS)) > 0) {
-        client->event.event_id = MQTT_EVENT_DELETED;
-        client->event.msg_id = msg_id;
-        if (esp_mqtt_dispatch_event(client) != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to post event on deleting message id=%d", msg_id);
-        }
+    esp_err_t err = mqtt_prepare_queued(client, item);
+    if (err != ESP_OK) {
+        return err;
     }
-#else
-    outbox_delete_expired(client->outbox, platform_tick_get_ms(), OUTBOX_EXPIRED_TIMEOUT_MS);
-#endif
+    // try to resend the data
+    if (esp_mqtt_write(client) != ESP_OK) {
+        ESP_LOGE(TAG, "Error to resend data ");
+        esp_mqtt_abort_connection(client);
+        return ESP_FAIL;
+    }
+    mqtt_queued_sent(client, item, client->mqtt_state.pending_msg_type, client->mqtt_state.pending_publish_qos);
+    return ESP_OK;
 }
 
-/**
- * @brief When using multiple queued item, we'd like to reduce the poll timeout to proceed with event loop exacution
- */
-static inline int max_poll_timeout(esp_mqtt_client_handle_t client, int max_timeout)
-{
-    return
-#if MQTT_EVENT_QUEUE_SIZE > 1
-        atomic_load(&client->queued_events) > 0 ? 10 : max_timeout;
-#else
-        max_timeout;
-#endif
-}
+typedef struct {
+    outbox_item_handle_t item;
+    pending_state_t pending;    // state before the message was batched, restored if writing the batch fails
+    int msg_type;
+    int qos;
+} mqtt_batched_msg_t;
 
-static inline void run_event_loop(esp_mqtt_client_handle_t client)
+/*
+ * Writes the outbound message, holding one or more batched messages. The outbox is updated
+ * only once the write succeeds, if it fails the messages get their previous state back.
+ */
+static esp_err_t mqtt_write_batch(esp_mqtt_client_handle_t client, const mqtt_batched_msg_t *batch, int count)
 {
-#if MQTT_EVENT_QUEUE_SIZE > 1
-    if (atomic_load(&client->queued_events) > 0) {
-        atomic_fetch_sub(&client->queued_events, 1);
-#else
-    {
-#endif
-        esp_err_t ret = esp_event_loop_run(client->config->event_loop_handle, 0);
-        if (ret != ESP_OK) {
-            ESP_LOGE(TAG, "Error in running event_loop %d", ret);
+    if (esp_mqtt_write(client) != ESP_OK) {
+        ESP_LOGE(TAG, "Error to resend %d queued messages", count);
+        for (int i = 0; i < count; i++) {
+            outbox_item_set_pending(client->outbox, batch[i].item, batch[i].pending);
         }
+        esp_mqtt_abort_connection(client);
+        return ESP_FAIL;
     }
+    for (int i = 0; i < count; i++) {
+        mqtt_queued_sent(client, batch[i].item, batch[i].msg_type, batch[i].qos);
+    }
+    return ESP_OK;
 }
 
-static void esp_mqtt_task(void *pv)
+/*
+ * Sends up to MQTT_OUTBOX_DRAIN_BATCH_SIZE queued messages in the order of their priority,
+ * as long as it takes less than MQTT_OUTBOX_DRAIN_BUDGET_MS.
+ * The messages are copied one after another into the output buffer and written by a single
+ * transport write, so that a backlog isn't sent one message per iteration of the client task.
+ * Messages which don't fit into the output buffer are written separately.
+ */
+static esp_err_t mqtt_drain_queued(esp_mqtt_client_handle_t client)
 {
-    esp_mqtt_client_handle_t client = (esp_mqtt_client_handle_t) pv;
-    uint64_t last_retransmit = 0;
+    mqtt_connection_t *connection = &client->mqtt_state.connection;
+    mqtt_batched_msg_t batch[MQTT_OUTBOX_DRAIN_BATCH_SIZE];
+    int batch_count = 0;
+    size_t batch_len = 0;
+    uint64_t start = platform_tick_get_ms();
     outbox_tick_t msg_tick = 0;
-    client->run = true;
+    outbox_item_handle_t item;
 
-    client->state = MQTT_STATE_INIT;
-    xEventGroupClearBits(client->status_bits, STOPPED_BIT);
-    while (client->run) {
-        MQTT_API_LOCK(client);
-        run_event_loop(client);
-        switch (client->state) {
-        case MQTT_STATE_DISCONNECTED:
+    int sent = 0;
+    while (sent < MQTT_OUTBOX_DRAIN_BATCH_SIZE && platform_tick_get_ms() - start < MQTT_OUTBOX_DRAIN_BUDGET_MS) {
+        item = outbox_dequeue(client->outbox, QUEUED, &msg_tick);
+        if (item == NULL) {
             break;
-        case MQTT_STATE_INIT:
-            xEventGroupClearBits(client->status_bits, RECONNECT_BIT | DISCONNECT_BIT);
-            client->event.event_id = MQTT_EVENT_BEFORE_CONNECT;
-            esp_mqtt_dispatch_event_with_msgid(client);
+        }
+        int priority = outbox_item_get_priority(item);
+        if (mqtt_prepare_queued(client, item) != ESP_OK) {
+            // expired and deleted, doesn't take a place in the batch
+            continue;
+        }
+        uint8_t *data = connection->outbound_message.data;
+        size_t len = connection->outbound_message.length;
+        if (batch_len > 0 && len > connection->buffer_length - batch_len) {
+            connection->outbound_message.data = connection->buffer;
+            connection->outbound_message.length = batch_len;
+            if (mqtt_write_batch(client, batch, batch_count) != ESP_OK) {
+                return ESP_FAIL;
+            }
+            batch_len = 0;
+            batch_count = 0;
+            connection->outbound_message.data = data;
+            connection->outbound_message.length = len;
+        }
+        mqtt_batched_msg_t *msg = &batch[batch_count++];
+        msg->item = item;
+        msg->pending = outbox_item_get_pending(item);
+        msg->msg_type = client->mqtt_state.pending_msg_type;
+        msg->qos = client->mqtt_state.pending_publish_qos;
+        // not dequeued again while waiting for the batch to be written
+        outbox_item_set_pending(client->outbox, item, TRANSMITTED);
+        if (len > connection->buffer_length) {
+            // the batch is empty, as it was written above
+            if (mqtt_write_batch(client, batch, batch_count) != ESP_OK) {
+                return ESP_FAIL;
+            }
+            batch_count = 0;
+        } else {
+            memcpy(connection->buffer + batch_len, data, len);
+            batch_len += len;
+        }
+        mqtt_record_outbox_wait(client, priority, platform_tick_get_ms() - msg_tick);
+        sent++;
+    }
+    if (batch_len > 0) {
+        connection->outbound_message.data = connection->buffer;
+        connection->outbound_message.length = batch_len;
+        return mqtt_write_batch(client, batch, batch_count);
+    }
+    return ESP_OK;
+}
 
+static void mqtt_delete_expired_messages(esp_mqtt_client_handle_t client)
+{
+    // Delete message after OUTBOX_EXPIRED_TIMEOUT_MS milliseconds
+#if !MQTT_REPORT_DELETED_MESSAGES
+    if (client->async_publish_count == 0) {
+        outbox_delete_expired(client->outbox, platform_tick_get_ms(), OUTBOX_EXPIRED_TIMEOUT_MS);
+        return;
+    }
+#endif
+    // also report the deleted items as MQTT_EVENT_DELETED events if enabled, and to the asynchronous publishes
+    int msg_id = 0;
+    while ((msg_id = outbox_delete_single_expired(client->outbox, platform_tick_get_ms(), OUTBOX_EXPIRED_TIMEOUT_MS)) > 0) {
+        mqtt_report_deleted_message(client, msg_id, MQTT_PUBLISH_STATUS_EXPIRED);
+    }
+}
 
-            client->transport = client->config->transport;
-            if (!client->transport) {
+/*
+ * Drops messages according to the overflow policy until a new message of the given length
+ * fits into the outbox limit.
+ * Returns false if the message doesn't fit, i.e. it has to be rejected.
+ */
+static bool mqtt_outbox_make_room(esp_mqtt_client_handle_t client, uint64_t len)
+{
+    if (len > client->config->outbox_limit) {
+        return false;
+    }
+    while (len + outbox_get_size(client->outbox) > client->config->outbox_limit) {
+        int msg_id = outbox_evict(client->outbox, client->config->outbox_overflow_policy, OUTBOX_EXPIRED_TIMEOUT_MS);
+        if (msg_id < 0) {
+            return false;
+        }
+        client->outbox_evicted++;
+        if (msg_id > 0) {
+            mqtt_defer_deleted_report(client, msg_id, MQTT_PUBLISH_STATUS_DROPPED);
+        }
+    }
+    return true;
+}
 
-                if (esp_mqtt_client_create_transport(client) != ESP_OK) {
-                    ESP_LOGE(TAG, "Failed to create transport list");
-                    client->run = false;
-                    break;
-                }
-                //get transport by scheme
-                client->transport = esp_transport_list_get_transport(client->transport_list, client->config->scheme);
+/**
+ * @brief When using multiple queued item, we don't wait while there are events to run in the event loop
+ */
+static inline int max_poll_timeout(esp_mqtt_client_handle_t client, int max_timeout)
+{
+    return
+#if MQTT_EVENT_QUEUE_SIZE > 1
+        atomic_load(&client->queued_events) > 0 ? 0 : max_timeout;
+#else
+        max_timeout;
+#endif
+}
 
-                if (client->transport == NULL) {
-                    ESP_LOGE(TAG, "There are no transports valid, stop mqtt client, config scheme = %s", client->config->scheme);
-                    client->run = false;
-                    break;
-                }
-            }
-            //default port
-            if (client->config->port == 0) {
-                client->config->port = esp_transport_get_default_port(client->transport);
-            }
+static inline void run_event_loop(esp_mqtt_client_handle_t client)
+{
+#if MQTT_EVENT_QUEUE_SIZE > 1
+    // run all the queued events at once, instead of polling for them
+    while (atomic_load(&client->queued_events) > 0) {
+        atomic_fetch_sub(&client->queued_events, 1);
+#else
+    {
+#endif
+        esp_err_t ret = esp_event_loop_run(client->config->event_loop_handle, 0);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Error in running event_loop %d", ret);
+        }
+    }
+}
 
-#if MQTT_ENABLE_SSL
-            esp_mqtt_set_ssl_transport_properties(client->transport_list, client->config);
+/*
+ * Returns how long the client task could wait for incoming data, i.e. the time until the nearest
+ * keepalive, retransmit or connection refresh deadline, at most MQTT_POLL_READ_TIMEOUT_MS
+ */
+static int mqtt_next_deadline_timeout(esp_mqtt_client_handle_t client, uint64_t last_retransmit)
+{
+    uint64_t now = platform_tick_get_ms();
+    uint64_t deadline = now + MQTT_POLL_READ_TIMEOUT_MS;
+    if (client->mqtt_state.connection.information.keepalive > 0) {
+        const uint64_t keepalive_ms = client->mqtt_state.connection.information.keepalive * 1000;
+        uint64_t keepalive_deadline = client->keepalive_tick + (client->wait_for_ping_resp ? keepalive_ms : keepalive_ms / 2);
+        deadline = MIN(deadline, keepalive_deadline);
+    }
+    outbox_tick_t msg_tick = 0;
+    if (outbox_dequeue(client->outbox, TRANSMITTED, &msg_tick)) {
+        uint64_t retransmit_deadline = MAX(last_retransmit, (uint64_t)msg_tick) + client->config->message_retransmit_timeout;
+        deadline = MIN(deadline, retransmit_deadline);
+    }
+    if (client->config->refresh_connection_after_ms) {
+        deadline = MIN(deadline, client->refresh_connection_tick + client->config->refresh_connection_after_ms);
+    }
+    // wait at least a tick, a shorter wait returns right away and the task would spin until the deadline
+    return deadline > now + portTICK_PERIOD_MS ? deadline - now : portTICK_PERIOD_MS;
+}
+
+/*
+ * Waits for incoming data up to the timeout, or until the client task is woken up by mqtt_client_wakeup()
+ * Returns the same as esp_transport_poll_read(), i.e. negative on error, zero if there is no data to read
+ */
+static int mqtt_wait_for_data(esp_mqtt_client_handle_t client, int timeout_ms)
+{
+    // the rest of the last bulk read is left for the next batch
+    if (mqtt_bulk_read_pending(client)) {
+        return 1;
+    }
+#ifdef MQTT_SUPPORTED_FEATURE_WAKEUP_EVENTFD
+    int sock = client->wakeup_fd >= 0 && timeout_ms > 0 ? esp_transport_get_socket(client->transport) : -1;
+    if (sock >= 0) {
+        // data could be buffered in the transport (e.g. decrypted TLS records), while the socket is not readable
+        int ret = esp_transport_poll_read(client->transport, 0);
+        if (ret != 0) {
+            return ret;
+        }
+        fd_set readset, errset;
+        FD_ZERO(&readset);
+        FD_ZERO(&errset);
+        FD_SET(sock, &readset);
+        FD_SET(sock, &errset);
+        FD_SET(client->wakeup_fd, &readset);
+        struct timeval timeout = { .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000 };
+        ret = select(MAX(sock, client->wakeup_fd) + 1, &readset, NULL, &errset, &timeout);
+        if (ret < 0) {
+            return ret;
+        }
+        if (FD_ISSET(sock, &errset)) {
+            int sock_errno = 0;
+            socklen_t len = sizeof(sock_errno);
+            getsockopt(sock, SOL_SOCKET, SO_ERROR, &sock_errno, &len);
+            errno = sock_errno;
+            return -1;
+        }
+        if (FD_ISSET(client->wakeup_fd, &readset)) {
+            mqtt_wakeup_fd_clear(client->wakeup_fd);
+        }
+        return FD_ISSET(sock, &readset) ? 1 : 0;
+    }
 #endif
+    return esp_transport_poll_read(client->transport, timeout_ms);
+}
 
-            if (esp_transport_connect(client->transport,
-                                      client->config->host,
-                                      client->config->port,
-                                      client->config->network_timeout_ms) < 0) {
-                ESP_LOGE(TAG, "Error transport connect");
-                esp_mqtt_client_dispatch_transport_error(client);
-                esp_mqtt_abort_connection(client);
+typedef enum {
+    MQTT_WAIT_NONE = 0,     // the client should run again right away
+    MQTT_WAIT_DATA,         // the client waits for incoming data
+    MQTT_WAIT_RECONNECT,    // the client waits for the reconnect timeout or a reconnect request
+} mqtt_wait_t;
+
+static void mqtt_client_task_begin(esp_mqtt_client_handle_t client)
+{
+    client->last_retransmit = 0;
+    client->queued_backlog = false;
+    client->reconnect_attempts = 0;
+    client->reconnect_backoff_ms = 0;
+    client->run = true;
+
+    client->state = MQTT_STATE_INIT;
+    xEventGroupClearBits(client->status_bits, STOPPED_BIT);
+}
+
+/*
+ * Runs one step of the client state machine
+ * Returns what the client waits for, with the longest time to wait for it in timeout_ms
+ */
+static mqtt_wait_t mqtt_client_run_once(esp_mqtt_client_handle_t client, int *timeout_ms)
+{
+    mqtt_wait_t wait = MQTT_WAIT_NONE;
+    *timeout_ms = 0;
+    MQTT_API_LOCK(client);
+    run_event_loop(client);
+    mqtt_process_async_publishes(client);
+    mqtt_report_deferred_messages(client);
+    switch (client->state) {
+    case MQTT_STATE_DISCONNECTED:
+        break;
+    case MQTT_STATE_INIT:
+        xEventGroupClearBits(client->status_bits, RECONNECT_BIT | DISCONNECT_BIT);
+        client->event.event_id = MQTT_EVENT_BEFORE_CONNECT;
+        esp_mqtt_dispatch_event_with_msgid(client);
+
+
+        client->transport = client->config->transport;
+        if (!client->transport) {
+
+            if (esp_mqtt_client_create_transport(client) != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to create transport list");
+                client->run = false;
                 break;
             }
-            ESP_LOGD(TAG, "Transport connected to %s://%s:%d", client->config->scheme, client->config->host, client->config->port);
-            if (esp_mqtt_connect(client, client->config->network_timeout_ms) != ESP_OK) {
-                ESP_LOGE(TAG, "MQTT connect failed");
-                esp_mqtt_abort_connection(client);
+            //get transport by scheme
+            client->transport = esp_transport_list_get_transport(client->transport_list, client->config->scheme);
+
+            if (client->transport == NULL) {
+                ESP_LOGE(TAG, "There are no transports valid, stop mqtt client, config scheme = %s", client->config->scheme);
+                client->run = false;
                 break;
             }
-            client->event.event_id = MQTT_EVENT_CONNECTED;
-            if (client->mqtt_state.connection.information.protocol_ver != MQTT_PROTOCOL_V_5) {
-                client->event.session_present = mqtt_get_connect_session_present(client->mqtt_state.in_buffer);
-            }
-            client->state = MQTT_STATE_CONNECTED;
-            esp_mqtt_dispatch_event_with_msgid(client);
-            client->refresh_connection_tick = platform_tick_get_ms();
-            client->keepalive_tick = platform_tick_get_ms();
+        }
+        //default port
+        if (client->config->port == 0) {
+            client->config->port = esp_transport_get_default_port(client->transport);
+        }
 
+#if MQTT_ENABLE_SSL
+        esp_mqtt_set_ssl_transport_properties(client->transport_list, client->config);
+#endif
+
+        mqtt_bulk_read_reset(client);
+        if (esp_transport_connect(client->transport,
+                                  client->config->host,
+                                  client->config->port,
+                                  client->config->network_timeout_ms) < 0) {
+            ESP_LOGE(TAG, "Error transport connect");
+            esp_mqtt_client_dispatch_transport_error(client);
+            esp_mqtt_abort_connection(client);
             break;
-        case MQTT_STATE_CONNECTED:
-            // check for disconnection request
-            if (xEventGroupWaitBits(client->status_bits, DISCONNECT_BIT, true, true, 0) & DISCONNECT_BIT) {
-                send_disconnect_msg(client);    // ignore error, if clean disconnect fails, just abort the connection
-                esp_mqtt_abort_connection(client);
-                break;
-            }
-            // receive and process data
-            if (mqtt_process_receive(client) == ESP_FAIL) {
-                esp_mqtt_abort_connection(client);
-                break;
-            }
+        }
+        ESP_LOGD(TAG, "Transport connected to %s://%s:%d", client->config->scheme, client->config->host, client->config->port);
+        if (esp_mqtt_connect(client, client->config->network_timeout_ms) != ESP_OK) {
+            ESP_LOGE(TAG, "MQTT connect failed");
+            esp_mqtt_abort_connection(client);
+            break;
+        }
+        client->event.event_id = MQTT_EVENT_CONNECTED;
+        if (client->mqtt_state.connection.information.protocol_ver != MQTT_PROTOCOL_V_5) {
+            client->event.session_present = mqtt_get_connect_session_present(client->mqtt_state.in_buffer);
+        }
+        client->state = MQTT_STATE_CONNECTED;
+        client->reconnect_attempts = 0;
+        client->reconnect_backoff_ms = 0;
+        esp_mqtt_dispatch_event_with_msgid(client);
+        client->refresh_connection_tick = platform_tick_get_ms();
+        client->keepalive_tick = platform_tick_get_ms();
 
-            // delete long pending messages
-            mqtt_delete_expired_messages(client);
+        break;
+    case MQTT_STATE_CONNECTED:
+        // check for disconnection request
+        if (xEventGroupWaitBits(client->status_bits, DISCONNECT_BIT, true, true, 0) & DISCONNECT_BIT) {
+            send_disconnect_msg(client);    // ignore error, if clean disconnect fails, just abort the connection
+            esp_mqtt_close_connection(client, false);
+            break;
+        }
+        // receive and process data
+        if (mqtt_process_receive(client) == ESP_FAIL) {
+            esp_mqtt_abort_connection(client);
+            break;
+        }
 
-            // resend all non-transmitted messages first
-            outbox_item_handle_t item = outbox_dequeue(client->outbox, QUEUED, NULL);
-            if (item) {
-                if (mqtt_resend_queued(client, item) == ESP_OK) {
-                    outbox_set_pending(client->outbox, client->mqtt_state.pending_msg_id, TRANSMITTED);
-                }
-                // resend other "transmitted" messages after 1s
-            } else if (has_timed_out(last_retransmit, client->config->message_retransmit_timeout)) {
-                last_retransmit = platform_tick_get_ms();
-                item = outbox_dequeue(client->outbox, TRANSMITTED, &msg_tick);
-                if (item && (last_retransmit - msg_tick > client->config->message_retransmit_timeout))  {
-                    mqtt_resend_queued(client, item);
-                }
-            }
+        // delete long pending messages
+        mqtt_delete_expired_messages(client);
 
-            if (process_keepalive(client) != ESP_OK) {
-                break;
+        // resend all non-transmitted messages first, in batches in the order of their priority
+        outbox_item_handle_t item = outbox_dequeue(client->outbox, QUEUED, NULL);
+        client->queued_backlog = false;
+        if (item) {
+            if (mqtt_drain_queued(client) == ESP_OK) {
+                client->queued_backlog = outbox_dequeue(client->outbox, QUEUED, NULL) != NULL;
             }
-
-            if (client->config->refresh_connection_after_ms &&
-                    has_timed_out(client->refresh_connection_tick, client->config->refresh_connection_after_ms)) {
-                ESP_LOGD(TAG, "Refreshing the connection...");
-                esp_mqtt_abort_connection(client);
-                client->state = MQTT_STATE_INIT;
+            // resend other "transmitted" messages after 1s
+        } else if (has_timed_out(client->last_retransmit, client->config->message_retransmit_timeout)) {
+            client->last_retransmit = platform_tick_get_ms();
+            outbox_tick_t msg_tick = 0;
+            item = outbox_dequeue(client->outbox, TRANSMITTED, &msg_tick);
+            if (item && (client->last_retransmit - msg_tick > client->config->message_retransmit_timeout))  {
+                mqtt_resend_queued(client, item);
             }
+        }
 
+        if (process_keepalive(client) != ESP_OK) {
             break;
-        case MQTT_STATE_WAIT_RECONNECT:
+        }
 
-            if (!client->config->auto_reconnect && xEventGroupGetBits(client->status_bits)&RECONNECT_BIT) {
-                xEventGroupClearBits(client->status_bits, RECONNECT_BIT);
-                client->state = MQTT_STATE_INIT;
-                client->wait_timeout_ms = MQTT_RECON_DEFAULT_MS;
-                ESP_LOGD(TAG, "Reconnecting per user request...");
-                break;
-            } else if (client->config->auto_reconnect &&
-                       platform_tick_get_ms() - client->reconnect_tick > client->wait_timeout_ms) {
-                client->state = MQTT_STATE_INIT;
-                client->reconnect_tick = platform_tick_get_ms();
-                ESP_LOGD(TAG, "Reconnecting...");
-                break;
-            }
-            MQTT_API_UNLOCK(client);
-            xEventGroupWaitBits(client->status_bits, RECONNECT_BIT, false, true,
-                                max_poll_timeout(client, client->wait_timeout_ms / 2 / portTICK_PERIOD_MS));
-            // continue the while loop instead of break, as the mutex is unlocked
-            continue;
-        default:
-            ESP_LOGE(TAG, "MQTT client error, client is in an unrecoverable state.");
+        if (client->config->refresh_connection_after_ms &&
+                has_timed_out(client->refresh_connection_tick, client->config->refresh_connection_after_ms)) {
+            ESP_LOGD(TAG, "Refreshing the connection...");
+            esp_mqtt_close_connection(client, false);
+            client->state = MQTT_STATE_INIT;
+        }
+
+        break;
+    case MQTT_STATE_WAIT_RECONNECT:
+
+        if (!client->config->auto_reconnect && xEventGroupGetBits(client->status_bits)&RECONNECT_BIT) {
+            xEventGroupClearBits(client->status_bits, RECONNECT_BIT);
+            client->state = MQTT_STATE_INIT;
+            client->wait_timeout_ms = MQTT_RECON_DEFAULT_MS;
+            ESP_LOGD(TAG, "Reconnecting per user request...");
+            break;
+        } else if (client->config->auto_reconnect &&
+                   platform_tick_get_ms() - client->reconnect_tick >= client->wait_timeout_ms) {
+            client->state = MQTT_STATE_INIT;
+            client->reconnect_tick = platform_tick_get_ms();
+            ESP_LOGD(TAG, "Reconnecting...");
             break;
         }
-        MQTT_API_UNLOCK(client);
-        if (MQTT_STATE_CONNECTED == client->state) {
-            if (esp_transport_poll_read(client->transport, max_poll_timeout(client, MQTT_POLL_READ_TIMEOUT_MS)) < 0) {
+        wait = MQTT_WAIT_RECONNECT;
+        // at least a tick, as for the deadlines of a connected client
+        *timeout_ms = max_poll_timeout(client, MAX(client->wait_timeout_ms / 2, (int)portTICK_PERIOD_MS));
+        break;
+    default:
+        ESP_LOGE(TAG, "MQTT client error, client is in an unrecoverable state.");
+        break;
+    }
+    MQTT_API_UNLOCK(client);
+    if (MQTT_STATE_CONNECTED == client->state) {
+        // don't wait for incoming data while there are queued messages to send, just check for them,
+        // otherwise sleep until the nearest deadline, new work wakes the task up earlier
+        wait = MQTT_WAIT_DATA;
+        *timeout_ms = client->queued_backlog ? 0 : max_poll_timeout(client, mqtt_next_deadline_timeout(client, client->last_retransmit));
+    }
+    return wait;
+}
+
+static void mqtt_client_task_end(esp_mqtt_client_handle_t client)
+{
+    esp_transport_close(client->transport);
+#if !MQTT_OUTBOX_PERSISTENT
+    // the persistent outbox keeps its messages to resend them once the client is started again
+    MQTT_API_LOCK(client);
+    outbox_delete_all_items(client->outbox);
+    mqtt_drop_async_publishes(client);
+    MQTT_API_UNLOCK(client);
+#endif
+    xEventGroupSetBits(client->status_bits, STOPPED_BIT);
+    client->state = MQTT_STATE_DISCONNECTED;
+}
+
+static void esp_mqtt_task(void *pv)
+{
+    esp_mqtt_client_handle_t client = (esp_mqtt_client_handle_t) pv;
+    mqtt_client_task_begin(client);
+    while (client->run) {
+        int timeout_ms;
+        mqtt_wait_t wait = mqtt_client_run_once(client, &timeout_ms);
+        if (wait == MQTT_WAIT_DATA) {
+            if (mqtt_wait_for_data(client, timeout_ms) < 0) {
                 ESP_LOGE(TAG, "Poll read error: %d, aborting connection", errno);
                 esp_mqtt_abort_connection(client);
             }
+        } else if (wait == MQTT_WAIT_RECONNECT) {
+            xEventGroupWaitBits(client->status_bits, RECONNECT_BIT, false, true, timeout_ms / portTICK_PERIOD_MS);
         }
+    }
+    mqtt_client_task_end(client);
+    vTaskDelete(NULL);
+}
 
+#ifdef MQTT_SUPPORTED_FEATURE_WAKEUP_EVENTFD
+/*
+ * Runs the clients which have incoming data, new work or reached their deadline,
+ * and removes the stopped clients. Returns the nearest deadline of the clients.
+ *
+ * The reactor lock is released while a client runs, as the client takes its API lock, which
+ * esp_mqtt_client_start() holds while taking the reactor lock. Other tasks only insert clients
+ * at the head of the list, so the following clients stay in place meanwhile.
+ */
+static uint64_t mqtt_reactor_run_clients(esp_mqtt_reactor_handle_t reactor)
+{
+    uint64_t now = platform_tick_get_ms();
+    uint64_t deadline = now + MQTT_POLL_READ_TIMEOUT_MS;
+    xSemaphoreTakeRecursive(reactor->lock, portMAX_DELAY);
+    esp_mqtt_client_handle_t client = LIST_FIRST(&reactor->clients);
+    while (client) {
+        esp_mqtt_client_handle_t next = LIST_NEXT(client, reactor_next);
+        if (!client->run) {
+            LIST_REMOVE(client, reactor_next);
+            xSemaphoreGiveRecursive(reactor->lock);
+            mqtt_client_task_end(client);
+            xSemaphoreTakeRecursive(reactor->lock, portMAX_DELAY);
+            client = next;
+            continue;
+        }
+        xSemaphoreGiveRecursive(reactor->lock);
+        bool pending = atomic_exchange(&client->reactor_pending, false);
+        if (pending || client->reactor_ready != 0 || client->reactor_deadline <= now) {
+            if (client->reactor_ready < 0) {
+                esp_mqtt_abort_connection(client);
+            }
+            client->reactor_ready = 0;
+            int timeout_ms;
+            client->reactor_wait = mqtt_client_run_once(client, &timeout_ms);
+            // data could be buffered in the transport (e.g. decrypted TLS records), while the socket is not readable
+            if (client->reactor_wait == MQTT_WAIT_DATA && timeout_ms > 0 &&
+                    (mqtt_bulk_read_pending(client) || esp_transport_poll_read(client->transport, 0) > 0)) {
+                timeout_ms = 0;
+            }
+            client->reactor_deadline = platform_tick_get_ms() + timeout_ms;
+        }
+        deadline = MIN(deadline, client->reactor_deadline);
+        xSemaphoreTakeRecursive(reactor->lock, portMAX_DELAY);
+        client = next;
     }
-    esp_transport_close(client->transport);
-    outbox_delete_all_items(client->outbox);
-    xEventGroupSetBits(client->status_bits, STOPPED_BIT);
-    client->state = MQTT_STATE_DISCONNECTED;
+    xSemaphoreGiveRecursive(reactor->lock);
+    return deadline;
+}
+
+static void esp_mqtt_reactor_task(void *pv)
+{
+    esp_mqtt_reactor_handle_t reactor = (esp_mqtt_reactor_handle_t) pv;
+    fd_set readset, errset;
+    while (reactor->run) {
+        uint64_t deadline = mqtt_reactor_run_clients(reactor);
+        xSemaphoreTakeRecursive(reactor->lock, portMAX_DELAY);
+        FD_ZERO(&readset);
+        FD_ZERO(&errset);
+        FD_SET(reactor->wakeup_fd, &readset);
+        int max_fd = reactor->wakeup_fd;
+        esp_mqtt_client_handle_t client;
+        LIST_FOREACH(client, &reactor->clients, reactor_next) {
+            client->reactor_sock = client->reactor_wait == MQTT_WAIT_DATA ? esp_transport_get_socket(client->transport) : -1;
+            if (client->reactor_sock >= FD_SETSIZE) {
+                client->reactor_sock = -1;
+            }
+            if (client->reactor_sock >= 0) {
+                FD_SET(client->reactor_sock, &readset);
+                FD_SET(client->reactor_sock, &errset);
+                max_fd = MAX(max_fd, client->reactor_sock);
+            } else if (client->reactor_wait == MQTT_WAIT_DATA) {
+                // the socket cannot be selected, check the client for incoming data periodically
+                client->reactor_deadline = MIN(client->reactor_deadline, platform_tick_get_ms() + MQTT_REACTOR_POLL_PERIOD_MS);
+                deadline = MIN(deadline, client->reactor_deadline);
+            }
+        }
+        xSemaphoreGiveRecursive(reactor->lock);
 
+        uint64_t now = platform_tick_get_ms();
+        int timeout_ms = deadline > now ? deadline - now : 0;
+        struct timeval timeout = { .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000 };
+        int ret = select(max_fd + 1, &readset, NULL, &errset, &timeout);
+        if (ret < 0) {
+            ESP_LOGE(TAG, "Reactor select error: %d", errno);
+            // clients are checked for errors by reading from their transports
+            continue;
+        }
+        if (ret == 0) {
+            continue;
+        }
+        if (FD_ISSET(reactor->wakeup_fd, &readset)) {
+            mqtt_wakeup_fd_clear(reactor->wakeup_fd);
+        }
+        xSemaphoreTakeRecursive(reactor->lock, portMAX_DELAY);
+        LIST_FOREACH(client, &reactor->clients, reactor_next) {
+            if (client->reactor_sock < 0) {
+                continue;
+            }
+            if (FD_ISSET(client->reactor_sock, &errset)) {
+                int sock_errno = 0;
+                socklen_t len = sizeof(sock_errno);
+                getsockopt(client->reactor_sock, SOL_SOCKET, SO_ERROR, &sock_errno, &len);
+                ESP_LOGE(TAG, "Poll read error: %d, aborting connection", sock_errno);
+                client->reactor_ready = -1;
+            } else if (FD_ISSET(client->reactor_sock, &readset)) {
+                client->reactor_ready = 1;
+            }
+        }
+        xSemaphoreGiveRecursive(reactor->lock);
+    }
+    xEventGroupSetBits(reactor->status_bits, STOPPED_BIT);
     vTaskDelete(NULL);
 }
 
+static esp_err_t mqtt_reactor_add_client(esp_mqtt_reactor_handle_t reactor, esp_mqtt_client_handle_t client)
+{
+    xSemaphoreTakeRecursive(reactor->lock, portMAX_DELAY);
+    if (!reactor->run) {
+        xSemaphoreGiveRecursive(reactor->lock);
+        ESP_LOGE(TAG, "Reactor is being destroyed");
+        return ESP_FAIL;
+    }
+    mqtt_client_task_begin(client);
+    client->reactor = reactor;
+    client->task_handle = reactor->task_handle;
+    client->reactor_wait = MQTT_WAIT_NONE;
+    client->reactor_sock = -1;
+    client->reactor_ready = 0;
+    client->reactor_deadline = 0;
+    LIST_INSERT_HEAD(&reactor->clients, client, reactor_next);
+    xSemaphoreGiveRecursive(reactor->lock);
+    mqtt_client_wakeup(client);
+    return ESP_OK;
+}
+#endif
+
 esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client)
 {
     if (!client) {
@@ -1712,6 +2537,17 @@ esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client)
         return ESP_FAIL;
     }
     esp_err_t err = ESP_OK;
+    if (client->config->reactor) {
+#ifdef MQTT_SUPPORTED_FEATURE_WAKEUP_EVENTFD
+        err = mqtt_reactor_add_client(client->config->reactor, client);
+#else
+        ESP_LOGE(TAG, "Reactor is not supported");
+        err = ESP_ERR_NOT_SUPPORTED;
+#endif
+        MQTT_API_UNLOCK(client);
+        return err;
+    }
+    client->reactor = NULL;
 #if MQTT_CORE_SELECTION_ENABLED
     ESP_LOGD(TAG, "Core selection enabled on %u", MQTT_TASK_CORE);
     if (xTaskCreatePinnedToCore(esp_mqtt_task, "mqtt_task", client->config->task_stack, client, client->config->task_prio, &client->task_handle, MQTT_TASK_CORE) != pdTRUE) {
@@ -1737,6 +2573,7 @@ esp_err_t esp_mqtt_client_disconnect(esp_mqtt_client_handle_t client)
     }
     ESP_LOGI(TAG, "Client asked to disconnect");
     xEventGroupSetBits(client->status_bits, DISCONNECT_BIT);
+    mqtt_client_wakeup(client);
     return ESP_OK;
 }
 
@@ -1753,6 +2590,7 @@ esp_err_t esp_mqtt_client_reconnect(esp_mqtt_client_handle_t client)
     }
     client->wait_timeout_ms = 0;
     xEventGroupSetBits(client->status_bits, RECONNECT_BIT);
+    mqtt_client_wakeup(client);
     return ESP_OK;
 }
 
@@ -1808,6 +2646,7 @@ esp_err_t esp_mqtt_client_stop(esp_mqtt_client_handle_t client)
         client->run = false;
         client->state = MQTT_STATE_DISCONNECTED;
         MQTT_API_UNLOCK(client);
+        mqtt_client_wakeup(client);
         xEventGroupWaitBits(client->status_bits, STOPPED_BIT, false, true, portMAX_DELAY);
         return ESP_OK;
     } else {
@@ -1817,6 +2656,81 @@ esp_err_t esp_mqtt_client_stop(esp_mqtt_client_handle_t client)
     }
 }
 
+esp_mqtt_reactor_handle_t esp_mqtt_reactor_create(const esp_mqtt_reactor_config_t *config)
+{
+#ifdef MQTT_SUPPORTED_FEATURE_WAKEUP_EVENTFD
+    esp_mqtt_reactor_handle_t reactor = calloc(1, sizeof(struct esp_mqtt_reactor));
+    ESP_MEM_CHECK(TAG, reactor, return NULL);
+    LIST_INIT(&reactor->clients);
+    reactor->wakeup_fd = mqtt_wakeup_fd_create();
+    if (reactor->wakeup_fd < 0) {
+        ESP_LOGE(TAG, "Reactor needs an eventfd to wake up");
+        goto _reactor_create_failed;
+    }
+    reactor->lock = xSemaphoreCreateRecursiveMutex();
+    ESP_MEM_CHECK(TAG, reactor->lock, goto _reactor_create_failed);
+    reactor->status_bits = xEventGroupCreate();
+    ESP_MEM_CHECK(TAG, reactor->status_bits, goto _reactor_create_failed);
+    int priority = config && config->priority > 0 ? config->priority : MQTT_TASK_PRIORITY;
+    int stack_size = config && config->stack_size > 0 ? config->stack_size : MQTT_TASK_STACK;
+    reactor->run = true;
+#if MQTT_CORE_SELECTION_ENABLED
+    if (xTaskCreatePinnedToCore(esp_mqtt_reactor_task, "mqtt_reactor", stack_size, reactor, priority, &reactor->task_handle, MQTT_TASK_CORE) != pdTRUE) {
+#else
+    if (xTaskCreate(esp_mqtt_reactor_task, "mqtt_reactor", stack_size, reactor, priority, &reactor->task_handle) != pdTRUE) {
+#endif
+        ESP_LOGE(TAG, "Error create mqtt reactor task");
+        goto _reactor_create_failed;
+    }
+    return reactor;
+_reactor_create_failed:
+    if (reactor->status_bits) {
+        vEventGroupDelete(reactor->status_bits);
+    }
+    if (reactor->lock) {
+        vSemaphoreDelete(reactor->lock);
+    }
+    if (reactor->wakeup_fd >= 0) {
+        close(reactor->wakeup_fd);
+    }
+    free(reactor);
+    return NULL;
+#else
+    ESP_LOGE(TAG, "Reactor is not supported");
+    return NULL;
+#endif
+}
+
+esp_err_t esp_mqtt_reactor_destroy(esp_mqtt_reactor_handle_t reactor)
+{
+    if (reactor == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+#ifdef MQTT_SUPPORTED_FEATURE_WAKEUP_EVENTFD
+    if (xTaskGetCurrentTaskHandle() == reactor->task_handle) {
+        ESP_LOGE(TAG, "Reactor cannot be destroyed from its task");
+        return ESP_FAIL;
+    }
+    xSemaphoreTakeRecursive(reactor->lock, portMAX_DELAY);
+    if (!LIST_EMPTY(&reactor->clients)) {
+        xSemaphoreGiveRecursive(reactor->lock);
+        ESP_LOGE(TAG, "Reactor still runs some clients");
+        return ESP_FAIL;
+    }
+    reactor->run = false;
+    xSemaphoreGiveRecursive(reactor->lock);
+    mqtt_wakeup_fd_signal(reactor->wakeup_fd);
+    xEventGroupWaitBits(reactor->status_bits, STOPPED_BIT, false, true, portMAX_DELAY);
+    vEventGroupDelete(reactor->status_bits);
+    vSemaphoreDelete(reactor->lock);
+    close(reactor->wakeup_fd);
+    free(reactor);
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
 static esp_err_t esp_mqtt_client_ping(esp_mqtt_client_handle_t client)
 {
     mqtt_msg_pingreq(&client->mqtt_state.connection);
@@ -1897,6 +2811,8 @@ int esp_mqtt_client_subscribe_multiple(esp_mqtt_client_handle_t client,
 
     ESP_LOGD(TAG, "Sent subscribe, first topic=%s, id: %d", topic_list[0].filter, client->mqtt_state.pending_msg_id);
     MQTT_API_UNLOCK(client);
+    // let the client task reconsider its retransmit deadline
+    mqtt_client_wakeup(client);
     return client->mqtt_state.pending_msg_id;
 
 }
@@ -1954,21 +2870,105 @@ int esp_mqtt_client_unsubscribe(esp_mqtt_client_handle_t client, const char *top
 
     ESP_LOGD(TAG, "Sent Unsubscribe topic=%s, id: %d, successful", topic, client->mqtt_state.pending_msg_id);
     MQTT_API_UNLOCK(client);
+    mqtt_client_wakeup(client);
     return client->mqtt_state.pending_msg_id;
 }
 
-static int make_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data,
-                        int len, int qos, int retain)
+/*
+ * Creates the publish message in the output buffer, to the topic string or to the registered
+ * `handle` if set, with the given `options` of this message (NULL for the defaults).
+ * The one-time MQTT5 publish properties are applied and consumed only if `one_time_config`
+ * is set, otherwise defaults are used.
+ */
+/*
+ * Encodes the topic of a handle for the current protocol version: a QoS 0 message without payload
+ * is encoded in the output buffer, and everything after its fixed header is kept.
+ * With MQTT5, the publish properties set by esp_mqtt5_client_set_publish_property() are consumed
+ * if use_properties is set.
+ */
+static esp_err_t mqtt_encode_topic(esp_mqtt_client_handle_t client, esp_mqtt_topic_handle_t handle, bool use_properties)
+{
+    mqtt_connection_t *connection = &client->mqtt_state.connection;
+    uint16_t msg_id = 0;
+    esp_mqtt_protocol_ver_t protocol_ver = connection->information.protocol_ver;
+    if (protocol_ver == MQTT_PROTOCOL_V_5) {
+#ifdef MQTT_PROTOCOL_5
+        const esp_mqtt5_publish_property_config_t *property = use_properties ? client->mqtt5_config->publish_property_info : NULL;
+        mqtt5_msg_publish(connection, handle->topic, NULL, 0, 0, 0, &msg_id, property,
+                          client->mqtt5_config->server_resp_property_info.response_info);
+        if (connection->outbound_message.length && use_properties) {
+            client->mqtt5_config->publish_property_info = NULL;
+            if (property && property->message_expiry_interval) {
+                handle->expiry_ms = (uint64_t)property->message_expiry_interval * 1000;
+            }
+        }
+#endif
+    } else {
+        mqtt_msg_publish(connection, handle->topic, NULL, 0, 0, 0, &msg_id);
+    }
+    mqtt_message_t *message = &connection->outbound_message;
+    uint8_t *encoded = NULL;
+    int encoded_len = 0;
+    if (message->length) {
+        int fixed_header_len = 0;
+        mqtt_get_total_length(message->data, message->length, &fixed_header_len);
+        encoded_len = message->length - fixed_header_len;
+        encoded = malloc(encoded_len);
+        if (encoded) {
+            memcpy(encoded, message->data + fixed_header_len, encoded_len);
+        }
+    }
+    message->length = 0;
+    message->fragmented_msg_data_offset = 0;
+    if (encoded == NULL) {
+        return ESP_FAIL;
+    }
+    free(handle->encoded);
+    handle->encoded = encoded;
+    handle->encoded_len = encoded_len;
+    handle->protocol_ver = protocol_ver;
+    return ESP_OK;
+}
+
+static int make_publish(esp_mqtt_client_handle_t client, const char *topic, esp_mqtt_topic_handle_t handle,
+                        const char *data, int len, int qos, int retain, bool one_time_config,
+                        const esp_mqtt_publish_options_t *options)
 {
     uint16_t pending_msg_id = 0;
-    if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5) {
+    esp_mqtt_priority_t priority = options ? options->priority : MQTT_PRIORITY_DEFAULT;
+    if (priority == MQTT_PRIORITY_DEFAULT) {
+        priority = MQTT_PRIORITY_NORMAL;
+    }
+    if (priority < MQTT_PRIORITY_CONTROL || priority >= MQTT_PRIORITY_MAX) {
+        ESP_LOGE(TAG, "Invalid publish priority %d", priority);
+        return -1;
+    }
+    uint64_t expiry_ms = options ? options->expiry_ms : 0;
+    if (handle) {
+        // the protocol version might have changed since the registration, e.g. by esp_mqtt_set_config()
+        if (handle->protocol_ver != client->mqtt_state.connection.information.protocol_ver &&
+                mqtt_encode_topic(client, handle, false) != ESP_OK) {
+            ESP_LOGE(TAG, "Topic cannot be encoded for the protocol version of the client");
+            return -1;
+        }
+        mqtt_msg_publish_encoded(&client->mqtt_state.connection,
+                                 handle->encoded, handle->encoded_len, handle->topic_len,
+                                 data, len, qos, retain, &pending_msg_id);
+        if (expiry_ms == 0) {
+            expiry_ms = handle->expiry_ms;
+        }
+    } else if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5) {
 #ifdef MQTT_PROTOCOL_5
+        const esp_mqtt5_publish_property_config_t *property = one_time_config ? client->mqtt5_config->publish_property_info : NULL;
         mqtt5_msg_publish(&client->mqtt_state.connection,
                           topic, data, len,
                           qos, retain,
-                          &pending_msg_id, client->mqtt5_config->publish_property_info, client->mqtt5_config->server_resp_property_info.response_info);
-        if (client->mqtt_state.connection.outbound_message.length) {
+                          &pending_msg_id, property, client->mqtt5_config->server_resp_property_info.response_info);
+        if (client->mqtt_state.connection.outbound_message.length && one_time_config) {
             client->mqtt5_config->publish_property_info = NULL;
+            if (expiry_ms == 0 && property && property->message_expiry_interval) {
+                expiry_ms = (uint64_t)property->message_expiry_interval * 1000;
+            }
         }
 #endif
     } else {
@@ -1982,12 +2982,16 @@ static int make_publish(esp_mqtt_client_handle_t client, const char *topic, cons
         ESP_LOGE(TAG, "Publish message cannot be created");
         return -1;
     }
+    client->mqtt_state.pending_publish_expiry_ms = expiry_ms;
+    client->mqtt_state.pending_publish_coalesce = options && options->coalesce;
+    client->mqtt_state.pending_publish_priority = priority;
     return pending_msg_id;
 }
-static inline int mqtt_client_enqueue_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data,
-        int len, int qos, int retain, bool store)
+static inline int mqtt_client_enqueue_publish(esp_mqtt_client_handle_t client, const char *topic, esp_mqtt_topic_handle_t handle,
+        const char *data, int len, int qos, int retain, bool store, bool one_time_config,
+        const esp_mqtt_publish_options_t *options)
 {
-    int pending_msg_id = make_publish(client, topic, data, len, qos, retain);
+    int pending_msg_id = make_publish(client, topic, handle, data, len, qos, retain, one_time_config, options);
     if (pending_msg_id < 0) {
         return -1;
     }
@@ -2003,22 +3007,39 @@ static inline int mqtt_client_enqueue_publish(esp_mqtt_client_handle_t client, c
                 return -1;
             }
         } else {
-            int first_fragment = client->mqtt_state.connection.outbound_message.length - client->mqtt_state.connection.outbound_message.fragmented_msg_data_offset;
-            if (!mqtt_enqueue(client, ((uint8_t *)data) + first_fragment, len - first_fragment)) {
+            // the payload didn't fit the buffer, so it's copied to the outbox directly from the user data
+            if (!mqtt_enqueue(client, (uint8_t *)data, len)) {
                 return -1;
             }
-            client->mqtt_state.connection.outbound_message.fragmented_msg_total_length = 0;
         }
     }
     return pending_msg_id;
 }
 
-int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos, int retain)
+/*
+ * Writes the publish message created by make_publish(), followed by the payload
+ * if it didn't fit the output buffer
+ */
+static esp_err_t mqtt_write_publish(esp_mqtt_client_handle_t client, const char *data, int len)
+{
+    mqtt_message_t *message = &client->mqtt_state.connection.outbound_message;
+    /* Message which doesn't fit the buffer has only its header encoded there, the payload follows directly from the user data */
+    bool fragmented = message->fragmented_msg_total_length != 0;
+    if (fragmented) {
+        ESP_LOGD(TAG, "Sending fragmented message, header of %d bytes and payload of %d bytes", (int)message->length, len);
+    }
+    esp_err_t err = esp_mqtt_write(client);
+    if (err == ESP_OK && fragmented) {
+        err = esp_mqtt_write_data(client, (const uint8_t *)data, len);
+    }
+    message->fragmented_msg_data_offset = 0;
+    message->fragmented_msg_total_length = 0;
+    return err;
+}
+
+static int mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic, esp_mqtt_topic_handle_t handle,
+                               const char *data, int len, int qos, int retain, const esp_mqtt_publish_options_t *options)
 {
-    if (!client) {
-        ESP_LOGE(TAG, "Client was not initialized");
-        return -1;
-    }
     MQTT_API_LOCK(client);
 #if MQTT_SKIP_PUBLISH_IF_DISCONNECTED
     if (client->state != MQTT_STATE_CONNECTED) {
@@ -2048,13 +3069,20 @@ int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic,
     }
 
     if (client->config->outbox_limit > 0 && qos > 0) {
-        if (len + outbox_get_size(client->outbox) > client->config->outbox_limit) {
+        if (!mqtt_outbox_make_room(client, len)) {
             MQTT_API_UNLOCK(client);
             return -2;
         }
     }
 
-    int pending_msg_id = mqtt_client_enqueue_publish(client, topic, data, len, qos, retain, false);
+#ifdef MQTT_PROTOCOL_5
+    // the one-time publish properties are consumed by creating the message, keep them for the topic alias
+    const esp_mqtt5_publish_property_config_t *property = NULL;
+    if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5) {
+        property = client->mqtt5_config->publish_property_info;
+    }
+#endif
+    int pending_msg_id = mqtt_client_enqueue_publish(client, topic, handle, data, len, qos, retain, false, true, options);
     if (pending_msg_id < 0) {
         MQTT_API_UNLOCK(client);
         return -1;
@@ -2076,37 +3104,15 @@ int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic,
         goto cannot_publish;
     }
 
-    /* Provide support for sending fragmented message if it doesn't fit buffer */
-    int remaining_len = len;
-    const char *current_data = data;
-    bool sending = true;
-
-    while (sending)  {
-
-        if (esp_mqtt_write(client) != ESP_OK) {
-            esp_mqtt_abort_connection(client);
-            ret = -1;
-            goto cannot_publish;
-        }
-
-        int data_sent = client->mqtt_state.connection.outbound_message.length - client->mqtt_state.connection.outbound_message.fragmented_msg_data_offset;
-        client->mqtt_state.connection.outbound_message.fragmented_msg_data_offset = 0;
-        client->mqtt_state.connection.outbound_message.fragmented_msg_total_length = 0;
-        remaining_len -= data_sent;
-        current_data +=  data_sent;
-
-        if (remaining_len > 0) {
-            mqtt_connection_t *connection = &client->mqtt_state.connection;
-            ESP_LOGD(TAG, "Sending fragmented message, remains to send %d bytes of %d", remaining_len, len);
-            int write_len = remaining_len > connection->buffer_length ? connection->buffer_length : remaining_len;
-            memcpy(connection->buffer, current_data, write_len);
-            connection->outbound_message.data = connection->buffer;
-            connection->outbound_message.length = write_len;
-            sending = true;
-        } else {
-            // Message was sent correctly
-            sending = false;
-        }
+#ifdef MQTT_PROTOCOL_5
+    if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5) {
+        esp_mqtt5_client_alias_publish(client, topic, property);
+    }
+#endif
+    if (mqtt_write_publish(client, data, len) != ESP_OK) {
+        esp_mqtt_abort_connection(client);
+        ret = -1;
+        goto cannot_publish;
     }
 
     if (qos > 0) {
@@ -2133,7 +3139,85 @@ cannot_publish:
     return ret;
 }
 
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos, int retain)
+{
+    if (!client) {
+        ESP_LOGE(TAG, "Client was not initialized");
+        return -1;
+    }
+    return mqtt_client_publish(client, topic, NULL, data, len, qos, retain, NULL);
+}
+
+int esp_mqtt_client_publish_with_options(esp_mqtt_client_handle_t client, const char *topic,
+        const char *data, int len, int qos, int retain,
+        const esp_mqtt_publish_options_t *options)
+{
+    if (!client) {
+        ESP_LOGE(TAG, "Client was not initialized");
+        return -1;
+    }
+    return mqtt_client_publish(client, topic, NULL, data, len, qos, retain, options);
+}
+
+int esp_mqtt_client_publish_by_handle(esp_mqtt_client_handle_t client, esp_mqtt_topic_handle_t topic,
+                                      const char *data, int len, int qos, int retain)
+{
+    if (!client || !topic) {
+        ESP_LOGE(TAG, "Client or topic was not initialized");
+        return -1;
+    }
+    return mqtt_client_publish(client, NULL, topic, data, len, qos, retain, NULL);
+}
+
+esp_mqtt_topic_handle_t esp_mqtt_client_register_topic(esp_mqtt_client_handle_t client, const char *topic)
+{
+    if (!client || !topic) {
+        ESP_LOGE(TAG, "Client or topic was not initialized");
+        return NULL;
+    }
+    esp_mqtt_topic_handle_t handle = calloc(1, sizeof(struct esp_mqtt_topic));
+    ESP_MEM_CHECK(TAG, handle, return NULL);
+    handle->topic = strdup(topic);
+    ESP_MEM_CHECK(TAG, handle->topic, {
+        free(handle);
+        return NULL;
+    });
+    handle->topic_len = strlen(topic) + 2;
+    MQTT_API_LOCK(client);
+    if (mqtt_encode_topic(client, handle, true) != ESP_OK) {
+        ESP_LOGE(TAG, "Topic cannot be registered");
+        MQTT_API_UNLOCK(client);
+        free(handle->topic);
+        free(handle);
+        return NULL;
+    }
+    LIST_INSERT_HEAD(&client->topics, handle, next);
+    MQTT_API_UNLOCK(client);
+    return handle;
+}
+
+esp_err_t esp_mqtt_client_unregister_topic(esp_mqtt_client_handle_t client, esp_mqtt_topic_handle_t topic)
+{
+    if (!client || !topic) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    MQTT_API_LOCK(client);
+    LIST_REMOVE(topic, next);
+    MQTT_API_UNLOCK(client);
+    free(topic->encoded);
+    free(topic->topic);
+    free(topic);
+    return ESP_OK;
+}
+
 int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos, int retain, bool store)
+{
+    return esp_mqtt_client_enqueue_with_options(client, topic, data, len, qos, retain, store, NULL);
+}
+
+int esp_mqtt_client_enqueue_with_options(esp_mqtt_client_handle_t client, const char *topic,
+        const char *data, int len, int qos, int retain, bool store,
+        const esp_mqtt_publish_options_t *options)
 {
     if (!client) {
         ESP_LOGE(TAG, "Client was not initialized");
@@ -2149,13 +3233,6 @@ int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t client, const char *topic,
         len = strlen(data);
     }
 
-    if (client->config->outbox_limit > 0) {
-        if (len + outbox_get_size(client->outbox) > client->config->outbox_limit) {
-            return -2;
-        }
-
-    }
-
     MQTT_API_LOCK(client);
 #ifdef MQTT_PROTOCOL_5
     if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5) {
@@ -2166,8 +3243,21 @@ int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t client, const char *topic,
         }
     }
 #endif
-    int ret = mqtt_client_enqueue_publish(client, topic, data, len, qos, retain, store);
+    // make room only for messages which are going to be stored
+    if (client->config->outbox_limit > 0 && (qos > 0 || store)) {
+        if (!mqtt_outbox_make_room(client, len)) {
+            MQTT_API_UNLOCK(client);
+            return -2;
+        }
+    }
+    int ret = mqtt_client_enqueue_publish(client, topic, NULL, data, len, qos, retain, store, true, options);
+    // the message is not sent from here, clear out possible fragmented publish
+    client->mqtt_state.connection.outbound_message.fragmented_msg_total_length = 0;
     MQTT_API_UNLOCK(client);
+    if (ret > 0 || (ret == 0 && store)) {
+        // let the client task send the message right away
+        mqtt_client_wakeup(client);
+    }
     if (ret == 0 && store == false) {
         // messages with qos=0 are not enqueued if not overridden by store_in_outobx -> indicate as error
         return -1;
@@ -2175,6 +3265,124 @@ int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t client, const char *topic,
     return ret;
 }
 
+esp_mqtt_async_publish_handle_t esp_mqtt_client_publish_async(esp_mqtt_client_handle_t client, const char *topic,
+        const char *data, int len, int qos, int retain,
+        esp_mqtt_publish_cb_t cb, void *user_ctx)
+{
+    if (!client) {
+        ESP_LOGE(TAG, "Client was not initialized");
+        return NULL;
+    }
+    if (topic == NULL || topic[0] == '\0' || qos < 0 || qos > 2) {
+        ESP_LOGE(TAG, "Invalid asynchronous publish arguments");
+        return NULL;
+    }
+    if (len <= 0 && data != NULL) {
+        len = strlen(data);
+    }
+    esp_mqtt_async_publish_handle_t publish = calloc(1, sizeof(struct esp_mqtt_async_publish));
+    ESP_MEM_CHECK(TAG, publish, return NULL);
+    size_t topic_len = strlen(topic);
+    publish->topic = malloc(topic_len + 1 + len);
+    ESP_MEM_CHECK(TAG, publish->topic, {
+        free(publish);
+        return NULL;
+    });
+    memcpy(publish->topic, topic, topic_len + 1);
+    if (data) {
+        publish->data = publish->topic + topic_len + 1;
+        memcpy(publish->data, data, len);
+    }
+    publish->len = len;
+    publish->qos = qos;
+    publish->retain = retain;
+    publish->cb = cb;
+    publish->user_ctx = user_ctx;
+    // the ring is the only state shared with the client task, which might be blocked writing to the network
+    if (!mqtt_submit_ring_push(client->async_publish_ring, publish)) {
+        ESP_LOGW(TAG, "Asynchronous publish queue is full");
+        free(publish->topic);
+        free(publish);
+        return NULL;
+    }
+    mqtt_client_wakeup(client);
+    // the publish is owned by the client task from now on, it might already be completed and freed
+    return publish;
+}
+
+/*
+ * Creates the message of an asynchronous publish. Connected QoS 0 messages are written directly,
+ * other messages are stored in the outbox, to be sent by the client task and completed once acknowledged.
+ */
+static void mqtt_process_async_publish(esp_mqtt_client_handle_t client, esp_mqtt_async_publish_handle_t publish)
+{
+    bool connected = client->state == MQTT_STATE_CONNECTED;
+#if MQTT_SKIP_PUBLISH_IF_DISCONNECTED
+    if (!connected) {
+        ESP_LOGI(TAG, "Publishing skipped: client is not connected");
+        goto drop;
+    }
+#endif
+    if (publish->qos == 0 && !connected) {
+        ESP_LOGW(TAG, "Publish: Losing qos0 data when client not connected");
+        goto drop;
+    }
+#ifdef MQTT_PROTOCOL_5
+    if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5) {
+        if (esp_mqtt5_client_publish_check(client, publish->qos, publish->retain) != ESP_OK) {
+            ESP_LOGI(TAG, "MQTT5 publish check fail");
+            goto drop;
+        }
+    }
+#endif
+    if (client->config->outbox_limit > 0 && publish->qos > 0) {
+        if (!mqtt_outbox_make_room(client, publish->len)) {
+            goto drop;
+        }
+    }
+    int msg_id = mqtt_client_enqueue_publish(client, publish->topic, NULL, publish->data, publish->len,
+                 publish->qos, publish->retain, false, false, NULL);
+    if (msg_id < 0) {
+        client->mqtt_state.connection.outbound_message.fragmented_msg_total_length = 0;
+        goto drop;
+    }
+    if (publish->qos == 0) {
+#ifdef MQTT_PROTOCOL_5
+        if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5) {
+            esp_mqtt5_client_alias_publish(client, publish->topic, NULL);
+        }
+#endif
+        esp_err_t err = mqtt_write_publish(client, publish->data, publish->len);
+        if (err != ESP_OK) {
+            esp_mqtt_abort_connection(client);
+        }
+        mqtt_complete_async_publish(client, publish, err == ESP_OK ? MQTT_PUBLISH_STATUS_SENT : MQTT_PUBLISH_STATUS_DROPPED);
+        return;
+    }
+    // the message is copied to the outbox, keep only the completion
+    client->mqtt_state.connection.outbound_message.fragmented_msg_total_length = 0;
+    free(publish->topic);
+    publish->topic = NULL;
+    publish->data = NULL;
+    publish->msg_id = msg_id;
+    mqtt_add_async_publish(client, publish);
+    return;
+drop:
+    mqtt_complete_async_publish(client, publish, MQTT_PUBLISH_STATUS_DROPPED);
+}
+
+static void mqtt_process_async_publishes(esp_mqtt_client_handle_t client)
+{
+    esp_mqtt_async_publish_handle_t publish;
+    // limit the work per iteration, the producers might keep submitting
+    for (int i = 0; i < MQTT_ASYNC_PUBLISH_QUEUE_SIZE; i++) {
+        if ((publish = mqtt_submit_ring_pop(client->async_publish_ring)) == NULL) {
+            break;
+        }
+        mqtt_process_async_publish(client, publish);
+    }
+}
+
 esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client, esp_mqtt_event_id_t event, esp_event_handler_t event_handler, void *event_handler_arg)
 {
     if (client == NULL) {
@@ -2203,6 +3411,18 @@ esp_err_t esp_mqtt_client_unregister_event(esp_mqtt_client_handle_t client, esp_
 #endif
 }
 
+esp_err_t esp_mqtt_client_register_direct_handler(esp_mqtt_client_handle_t client, esp_mqtt_direct_handler_t handler, void *handler_args)
+{
+    if (client == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    MQTT_API_LOCK(client);
+    client->direct_handler = handler;
+    client->direct_handler_args = handler_args;
+    MQTT_API_UNLOCK(client);
+    return ESP_OK;
+}
+
 static void esp_mqtt_client_dispatch_transport_error(esp_mqtt_client_handle_t client)
 {
     client->event.event_id = MQTT_EVENT_ERROR;
@@ -2237,3 +3457,47 @@ int esp_mqtt_client_get_outbox_size(esp_mqtt_client_handle_t client)
 
     return outbox_size;
 }
+
+int esp_mqtt_client_get_outbox_evicted(esp_mqtt_client_handle_t client)
+{
+    if (client == NULL) {
+        return 0;
+    }
+    MQTT_API_LOCK(client);
+    int evicted = client->outbox_evicted;
+    MQTT_API_UNLOCK(client);
+    return evicted;
+}
+
+esp_err_t esp_mqtt_client_get_outbox_priority_stats(esp_mqtt_client_handle_t client, esp_mqtt_outbox_priority_stats_t *stats)
+{
+    if (client == NULL || stats == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    MQTT_API_LOCK(client);
+    for (int i = 0; i < MQTT_PRIORITY_MAX; i++) {
+        stats->queued[i] = client->outbox ? outbox_get_queued_count(client->outbox, i) : 0;
+    }
+    memcpy(stats->wait_histogram, client->outbox_wait_histogram, sizeof(stats->wait_histogram));
+    MQTT_API_UNLOCK(client);
+    return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_get_outbox_pool_stats(esp_mqtt_client_handle_t client, esp_mqtt_outbox_pool_stats_t *stats)
+{
+    if (client == NULL || stats == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+#if MQTT_OUTBOX_POOL
+    esp_err_t ret = ESP_ERR_INVALID_STATE;
+    MQTT_API_LOCK(client);
+    if (client->outbox) {
+        outbox_get_pool_stats(client->outbox, stats);
+        ret = ESP_OK;
+    }
+    MQTT_API_UNLOCK(client);
+    return ret;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
@@ -0,0 +1,452 @@
+/*
+ * This file is subject to the terms and conditions defined in
+ * file 'LICENSE', which is part of this source code package.
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "mqtt_outbox.h"
+#include "mqtt_msg.h"
+
+static uint8_t test_data[4096];
+
+static outbox_item_handle_t enqueue_coalesced(outbox_handle_t outbox, char topic, int msg_id, int len, int *replaced_msg_id)
+{
+    TEST_ASSERT_LESS_OR_EQUAL(sizeof(test_data), len);
+    TEST_ASSERT_GREATER_OR_EQUAL(8, len);
+    // QoS 1 PUBLISH to a one character topic, the payload repeats the message id
+    memset(test_data, msg_id, len);
+    int pos = 0;
+    test_data[pos++] = 0x32;
+    for (int remaining_len = len - (len > 129 ? 3 : 2); remaining_len > 0; remaining_len >>= 7) {
+        test_data[pos++] = (remaining_len & 0x7f) | (remaining_len > 0x7f ? 0x80 : 0);
+    }
+    test_data[pos++] = 0;
+    test_data[pos++] = 1;
+    test_data[pos++] = topic;
+    test_data[pos++] = msg_id >> 8;
+    test_data[pos++] = msg_id & 0xff;
+    outbox_message_t message = {
+        .data = test_data,
+        .len = len,
+        .msg_id = msg_id,
+        .msg_qos = 1,
+        .msg_type = MQTT_MSG_TYPE_PUBLISH,
+        .priority = MQTT_PRIORITY_NORMAL,
+        .coalesce = true,
+    };
+    outbox_item_handle_t item = outbox_coalesce(outbox, &message, platform_tick_get_ms(), replaced_msg_id);
+    return item ? item : outbox_enqueue(outbox, &message, platform_tick_get_ms());
+}
+
+#if MQTT_OUTBOX_RING || MQTT_OUTBOX_PERSISTENT || MQTT_OUTBOX_POOL
+static outbox_item_handle_t enqueue_publish(outbox_handle_t outbox, int msg_id, int len)
+{
+    TEST_ASSERT_LESS_OR_EQUAL(sizeof(test_data), len);
+    memset(test_data, msg_id, len);
+    outbox_message_t message = {
+        .data = test_data,
+        .len = len,
+        .msg_id = msg_id,
+        .msg_qos = 1,
+        .msg_type = MQTT_MSG_TYPE_PUBLISH,
+        .priority = MQTT_PRIORITY_NORMAL,
+    };
+    return outbox_enqueue(outbox, &message, platform_tick_get_ms());
+}
+#endif
+
+static outbox_item_handle_t enqueue_at(outbox_handle_t outbox, int msg_id, int qos, esp_mqtt_priority_t priority,
+                                       outbox_tick_t tick, outbox_tick_t deadline)
+{
+    memset(test_data, msg_id, 32);
+    outbox_message_t message = {
+        .data = test_data,
+        .len = 32,
+        .msg_id = msg_id,
+        .msg_qos = qos,
+        .msg_type = MQTT_MSG_TYPE_PUBLISH,
+        .deadline = deadline,
+        .priority = priority,
+    };
+    return outbox_enqueue(outbox, &message, tick);
+}
+
+static void check_next_queued(outbox_handle_t outbox, int expected_msg_id, size_t expected_len)
+{
+    size_t len = 0;
+    uint16_t msg_id = 0;
+    int msg_type = 0;
+    int qos = 0;
+    outbox_item_handle_t item = outbox_dequeue(outbox, QUEUED, NULL);
+    TEST_ASSERT_NOT_NULL(item);
+    uint8_t *data = outbox_item_get_data(item, &len, &msg_id, &msg_type, &qos);
+    TEST_ASSERT_EQUAL(expected_msg_id, msg_id);
+    TEST_ASSERT_EQUAL(expected_len, len);
+    TEST_ASSERT_EACH_EQUAL_UINT8((uint8_t)expected_msg_id, data, len);
+    TEST_ASSERT_EQUAL(ESP_OK, outbox_delete_item(outbox, item));
+}
+
+TEST_CASE("coalesced message replaces the queued one on the same topic", "[outbox]")
+{
+    const int len = 32;
+    int replaced_msg_id = -1;
+    outbox_handle_t outbox = outbox_init();
+    TEST_ASSERT_NOT_NULL(outbox);
+    TEST_ASSERT_NOT_NULL(enqueue_coalesced(outbox, 'a', 1, len, &replaced_msg_id));
+    TEST_ASSERT_NOT_NULL(enqueue_coalesced(outbox, 'b', 2, len, &replaced_msg_id));
+    TEST_ASSERT_EQUAL(-1, replaced_msg_id);
+    TEST_ASSERT_NOT_NULL(enqueue_coalesced(outbox, 'a', 3, len, &replaced_msg_id));
+    TEST_ASSERT_EQUAL(1, replaced_msg_id);
+    TEST_ASSERT_NULL(outbox_get(outbox, 1));
+    TEST_ASSERT_NOT_NULL(outbox_get(outbox, 2));
+    TEST_ASSERT_NOT_NULL(outbox_get(outbox, 3));
+    TEST_ASSERT_EQUAL(2 * len, outbox_get_size(outbox));
+    // a transmitted message is not replaced anymore
+    TEST_ASSERT_EQUAL(ESP_OK, outbox_set_pending(outbox, 3, TRANSMITTED));
+    replaced_msg_id = -1;
+    TEST_ASSERT_NOT_NULL(enqueue_coalesced(outbox, 'a', 4, len, &replaced_msg_id));
+    TEST_ASSERT_EQUAL(-1, replaced_msg_id);
+    TEST_ASSERT_EQUAL(3 * len, outbox_get_size(outbox));
+    // don't leave the messages to be recovered by the next test with a persistent outbox
+    outbox_delete_all_items(outbox);
+    outbox_destroy(outbox);
+}
+
+TEST_CASE("outbox finds messages by id among QoS 0 messages", "[outbox]")
+{
+    const int count = 24;
+    outbox_handle_t outbox = outbox_init();
+    TEST_ASSERT_NOT_NULL(outbox);
+    // QoS 0 messages share msg id 0, they're interleaved with the QoS 1 ones
+    for (int i = 1; i <= count; i++) {
+        TEST_ASSERT_NOT_NULL(enqueue_at(outbox, 0, 0, MQTT_PRIORITY_NORMAL, platform_tick_get_ms(), 0));
+        TEST_ASSERT_NOT_NULL(enqueue_at(outbox, i, 1, MQTT_PRIORITY_NORMAL, platform_tick_get_ms(), 0));
+    }
+    for (int i = 1; i <= count; i++) {
+        uint16_t msg_id = 0;
+        size_t len = 0;
+        int msg_type = 0;
+        int qos = -1;
+        outbox_item_handle_t item = outbox_get(outbox, i);
+        TEST_ASSERT_NOT_NULL(item);
+        outbox_item_get_data(item, &len, &msg_id, &msg_type, &qos);
+        TEST_ASSERT_EQUAL(i, msg_id);
+        TEST_ASSERT_EQUAL(1, qos);
+    }
+    // removing the QoS 0 messages keeps the others reachable
+    check_next_queued(outbox, 0, 32);
+    check_next_queued(outbox, 1, 32);
+    check_next_queued(outbox, 0, 32);
+    TEST_ASSERT_NULL(outbox_get(outbox, 1));
+    TEST_ASSERT_NOT_NULL(outbox_get(outbox, 2));
+    TEST_ASSERT_EQUAL(ESP_OK, outbox_delete(outbox, count, MQTT_MSG_TYPE_PUBLISH));
+    TEST_ASSERT_NULL(outbox_get(outbox, count));
+    TEST_ASSERT_NOT_NULL(outbox_get(outbox, count - 1));
+    TEST_ASSERT_EQUAL((2 * count - 4) * 32, outbox_get_size(outbox));
+    outbox_delete_all_items(outbox);
+    outbox_destroy(outbox);
+}
+
+TEST_CASE("outbox expires messages by their tick and their own deadline", "[outbox]")
+{
+    const outbox_tick_t timeout = 1000;
+    outbox_handle_t outbox = outbox_init();
+    TEST_ASSERT_NOT_NULL(outbox);
+    TEST_ASSERT_NOT_NULL(enqueue_at(outbox, 1, 1, MQTT_PRIORITY_NORMAL, 100, 0));
+    TEST_ASSERT_NOT_NULL(enqueue_at(outbox, 2, 1, MQTT_PRIORITY_NORMAL, 200, 150));
+    TEST_ASSERT_NOT_NULL(enqueue_at(outbox, 3, 1, MQTT_PRIORITY_NORMAL, 300, 0));
+    TEST_ASSERT_EQUAL(-1, outbox_delete_single_expired(outbox, 149, timeout));
+    TEST_ASSERT_EQUAL(2, outbox_delete_single_expired(outbox, 150, timeout));
+    TEST_ASSERT_EQUAL(-1, outbox_delete_single_expired(outbox, 100 + timeout, timeout));
+    TEST_ASSERT_EQUAL(1, outbox_delete_single_expired(outbox, 101 + timeout, timeout));
+    TEST_ASSERT_EQUAL(-1, outbox_delete_single_expired(outbox, 101 + timeout, timeout));
+    TEST_ASSERT_EQUAL(1, outbox_delete_expired(outbox, 301 + timeout, timeout));
+    TEST_ASSERT_EQUAL(0, outbox_get_size(outbox));
+    outbox_destroy(outbox);
+}
+
+TEST_CASE("outbox evicts messages by the overflow policy", "[outbox]")
+{
+    const outbox_tick_t timeout = 1000;
+    outbox_handle_t outbox = outbox_init();
+    TEST_ASSERT_NOT_NULL(outbox);
+    TEST_ASSERT_NOT_NULL(enqueue_at(outbox, 1, 1, MQTT_PRIORITY_NORMAL, 100, 0));
+    TEST_ASSERT_NOT_NULL(enqueue_at(outbox, 0, 0, MQTT_PRIORITY_NORMAL, 200, 0));
+    TEST_ASSERT_NOT_NULL(enqueue_at(outbox, 2, 2, MQTT_PRIORITY_NORMAL, 300, 350));
+    TEST_ASSERT_NOT_NULL(enqueue_at(outbox, 3, 1, MQTT_PRIORITY_NORMAL, 400, 0));
+    TEST_ASSERT_EQUAL(-1, outbox_evict(outbox, MQTT_OUTBOX_OVERFLOW_REJECT_NEW, timeout));
+    // the deadline comes before the first message expires by the timeout
+    TEST_ASSERT_EQUAL(2, outbox_evict(outbox, MQTT_OUTBOX_OVERFLOW_DROP_EXPIRING_SOONEST, timeout));
+    TEST_ASSERT_EQUAL(0, outbox_evict(outbox, MQTT_OUTBOX_OVERFLOW_DROP_LOWEST_QOS, timeout));
+    TEST_ASSERT_EQUAL(1, outbox_evict(outbox, MQTT_OUTBOX_OVERFLOW_DROP_OLDEST, timeout));
+    TEST_ASSERT_EQUAL(3, outbox_evict(outbox, MQTT_OUTBOX_OVERFLOW_DROP_EXPIRING_SOONEST, timeout));
+    TEST_ASSERT_EQUAL(-1, outbox_evict(outbox, MQTT_OUTBOX_OVERFLOW_DROP_OLDEST, timeout));
+    TEST_ASSERT_EQUAL(0, outbox_get_size(outbox));
+    outbox_destroy(outbox);
+}
+
+TEST_CASE("outbox dequeues queued messages by their priority class", "[outbox]")
+{
+    outbox_handle_t outbox = outbox_init();
+    TEST_ASSERT_NOT_NULL(outbox);
+    outbox_tick_t tick = platform_tick_get_ms();
+    TEST_ASSERT_NOT_NULL(enqueue_at(outbox, 1, 1, MQTT_PRIORITY_BULK, tick, 0));
+    TEST_ASSERT_NOT_NULL(enqueue_at(outbox, 2, 1, MQTT_PRIORITY_NORMAL, tick, 0));
+    TEST_ASSERT_NOT_NULL(enqueue_at(outbox, 3, 1, MQTT_PRIORITY_HIGH, tick, 0));
+    TEST_ASSERT_NOT_NULL(enqueue_at(outbox, 4, 1, MQTT_PRIORITY_CONTROL, tick, 0));
+    TEST_ASSERT_NOT_NULL(enqueue_at(outbox, 5, 1, MQTT_PRIORITY_DEFAULT, tick, 0));
+    // the default priority is the normal class
+    TEST_ASSERT_EQUAL(MQTT_PRIORITY_NORMAL, outbox_item_get_priority(outbox_get(outbox, 5)));
+    TEST_ASSERT_EQUAL(2, outbox_get_queued_count(outbox, MQTT_PRIORITY_NORMAL));
+    check_next_queued(outbox, 4, 32);
+    check_next_queued(outbox, 3, 32);
+    check_next_queued(outbox, 2, 32);
+    check_next_queued(outbox, 5, 32);
+    check_next_queued(outbox, 1, 32);
+    TEST_ASSERT_NULL(outbox_dequeue(outbox, QUEUED, NULL));
+    outbox_destroy(outbox);
+}
+
+#if !MQTT_OUTBOX_RING && !MQTT_OUTBOX_PERSISTENT && CONFIG_IDF_TARGET_LINUX
+static void enqueue_transmitted(outbox_handle_t outbox, int msg_id, int qos)
+{
+    outbox_message_t message = {
+        .data = test_data,
+        .len = 16,
+        .msg_id = msg_id,
+        .msg_qos = qos,
+        .msg_type = MQTT_MSG_TYPE_PUBLISH,
+        .priority = MQTT_PRIORITY_NORMAL,
+    };
+    outbox_item_handle_t item = outbox_enqueue(outbox, &message, platform_tick_get_ms());
+    TEST_ASSERT_NOT_NULL(item);
+    TEST_ASSERT_EQUAL(ESP_OK, outbox_item_set_pending(outbox, item, TRANSMITTED));
+}
+
+// Milliseconds taken by the given number of ack and resend cycles with in_flight QoS 1 messages
+static uint64_t measure_acks(int in_flight, int acks)
+{
+    outbox_handle_t outbox = outbox_init();
+    TEST_ASSERT_NOT_NULL(outbox);
+    for (int i = 1; i <= in_flight; i++) {
+        enqueue_transmitted(outbox, i, 1);
+    }
+    uint64_t start = platform_tick_get_ms();
+    for (int i = 0; i < acks; i++) {
+        int msg_id = i % in_flight + 1;
+        TEST_ASSERT_EQUAL(ESP_OK, outbox_delete(outbox, msg_id, MQTT_MSG_TYPE_PUBLISH));
+        enqueue_transmitted(outbox, msg_id, 1);
+    }
+    uint64_t elapsed = platform_tick_get_ms() - start;
+    outbox_destroy(outbox);
+    return elapsed;
+}
+
+// Milliseconds taken to enqueue and delete the given number of QoS 0 messages, which all share msg id 0
+static uint64_t measure_qos0(int count)
+{
+    outbox_handle_t outbox = outbox_init();
+    TEST_ASSERT_NOT_NULL(outbox);
+    uint64_t start = platform_tick_get_ms();
+    for (int i = 0; i < count; i++) {
+        enqueue_transmitted(outbox, 0, 0);
+    }
+    outbox_item_handle_t item;
+    while ((item = outbox_dequeue(outbox, TRANSMITTED, NULL)) != NULL) {
+        TEST_ASSERT_EQUAL(ESP_OK, outbox_delete_item(outbox, item));
+    }
+    uint64_t elapsed = platform_tick_get_ms() - start;
+    outbox_destroy(outbox);
+    return elapsed;
+}
+
+TEST_CASE("outbox ack cost doesn't grow with the number of messages in flight", "[outbox][heap][benchmark]")
+{
+    const int acks = 200000;
+    uint64_t few = measure_acks(10, acks);
+    uint64_t many = measure_acks(50000, acks);
+    printf("%d acks: %"PRIu64" ms with 10 in flight, %"PRIu64" ms with 50000 in flight\n", acks, few, many);
+    // a linear lookup would be thousands of times slower, leave room for cache misses on the bigger outbox
+    TEST_ASSERT_LESS_OR_EQUAL(8 * few + 100, many);
+}
+
+TEST_CASE("outbox enqueues QoS 0 messages in constant time", "[outbox][heap][benchmark]")
+{
+    uint64_t few = measure_qos0(10000);
+    uint64_t many = measure_qos0(50000);
+    printf("QoS 0 messages: %"PRIu64" ms for 10000, %"PRIu64" ms for 50000\n", few, many);
+    TEST_ASSERT_LESS_OR_EQUAL(8 * 5 * few + 100, many);
+}
+#endif
+
+#if MQTT_OUTBOX_POOL
+TEST_CASE("outbox pool returns empty item slabs to the heap", "[outbox][pool]")
+{
+    const int slabs = 3;
+    esp_mqtt_outbox_pool_stats_t stats;
+    outbox_handle_t outbox = outbox_init();
+    TEST_ASSERT_NOT_NULL(outbox);
+    for (int i = 1; i <= slabs * MQTT_OUTBOX_POOL_SLAB_ITEMS; i++) {
+        TEST_ASSERT_NOT_NULL(enqueue_publish(outbox, i, 32));
+    }
+    outbox_get_pool_stats(outbox, &stats);
+    TEST_ASSERT_EQUAL(slabs, stats.item_slabs);
+    TEST_ASSERT_EQUAL(slabs * MQTT_OUTBOX_POOL_SLAB_ITEMS, stats.items_in_use);
+    // a single empty slab is kept
+    outbox_delete_all_items(outbox);
+    outbox_get_pool_stats(outbox, &stats);
+    TEST_ASSERT_EQUAL(1, stats.item_slabs);
+    TEST_ASSERT_EQUAL(0, stats.items_in_use);
+    outbox_destroy(outbox);
+}
+
+TEST_CASE("outbox pool splits released data blocks for smaller messages", "[outbox][pool]")
+{
+    esp_mqtt_outbox_pool_stats_t stats;
+    outbox_handle_t outbox = outbox_init();
+    TEST_ASSERT_NOT_NULL(outbox);
+    TEST_ASSERT_NOT_NULL(enqueue_publish(outbox, 1, 32));
+    TEST_ASSERT_NOT_NULL(enqueue_publish(outbox, 2, 1024));
+    TEST_ASSERT_EQUAL(ESP_OK, outbox_delete(outbox, 2, MQTT_MSG_TYPE_PUBLISH));
+    outbox_get_pool_stats(outbox, &stats);
+    size_t arena_unused = stats.arena_unused;
+    TEST_ASSERT_EQUAL(1024, stats.free_block_bytes);
+    // the released block serves the smaller messages instead of the unused part of the arena
+    for (int i = 3; i < 3 + 1024 / 64; i++) {
+        TEST_ASSERT_NOT_NULL(enqueue_publish(outbox, i, 64));
+    }
+    outbox_get_pool_stats(outbox, &stats);
+    TEST_ASSERT_EQUAL(arena_unused, stats.arena_unused);
+    TEST_ASSERT_EQUAL(0, stats.free_block_bytes);
+    TEST_ASSERT_EQUAL(0, stats.heap_fallbacks);
+    // the arena starts over once it's empty
+    outbox_delete_all_items(outbox);
+    outbox_get_pool_stats(outbox, &stats);
+    TEST_ASSERT_EQUAL(stats.arena_size, stats.arena_unused);
+    TEST_ASSERT_EQUAL(0, stats.free_block_bytes);
+    outbox_destroy(outbox);
+}
+#endif /* MQTT_OUTBOX_POOL */
+
+#if MQTT_OUTBOX_RING
+
+TEST_CASE("ring outbox keeps the coalesced message if the new one doesn't fit", "[outbox][ring]")
+{
+    const int len = MQTT_OUTBOX_RING_SIZE / 4;
+    int replaced_msg_id = -1;
+    outbox_handle_t outbox = outbox_init();
+    TEST_ASSERT_NOT_NULL(outbox);
+    for (int i = 1; i <= 4; i++) {
+        TEST_ASSERT_NOT_NULL(enqueue_coalesced(outbox, 'a' + i, i, len, &replaced_msg_id));
+    }
+    TEST_ASSERT_NULL(enqueue_coalesced(outbox, 'a' + 1, 5, len, &replaced_msg_id));
+    TEST_ASSERT_EQUAL(-1, replaced_msg_id);
+    TEST_ASSERT_NOT_NULL(outbox_get(outbox, 1));
+    TEST_ASSERT_EQUAL(4 * len, outbox_get_size(outbox));
+    outbox_destroy(outbox);
+}
+
+TEST_CASE("ring outbox reuses index entries released by in-order acks", "[outbox][ring]")
+{
+    const int items = MQTT_OUTBOX_RING_MAX_ITEMS;
+    const int len = 16;
+    outbox_handle_t outbox = outbox_init();
+    TEST_ASSERT_NOT_NULL(outbox);
+    for (int i = 1; i <= items; i++) {
+        TEST_ASSERT_NOT_NULL(enqueue_publish(outbox, i, len));
+    }
+    TEST_ASSERT_NULL(enqueue_publish(outbox, items + 1, len));
+    // acks in the enqueue order leave no holes behind, only released leading entries
+    for (int i = 1; i <= items / 2; i++) {
+        TEST_ASSERT_EQUAL(ESP_OK, outbox_delete(outbox, i, MQTT_MSG_TYPE_PUBLISH));
+    }
+    for (int i = items + 1; i <= items + items / 2; i++) {
+        TEST_ASSERT_NOT_NULL(enqueue_publish(outbox, i, len));
+    }
+    for (int i = items / 2 + 1; i <= items + items / 2; i++) {
+        check_next_queued(outbox, i, len);
+    }
+    TEST_ASSERT_EQUAL(0, outbox_get_size(outbox));
+    outbox_destroy(outbox);
+}
+
+TEST_CASE("ring outbox joins free space split by in-order acks", "[outbox][ring]")
+{
+    const int len = MQTT_OUTBOX_RING_SIZE / 8;
+    outbox_handle_t outbox = outbox_init();
+    TEST_ASSERT_NOT_NULL(outbox);
+    for (int i = 1; i <= 7; i++) {
+        TEST_ASSERT_NOT_NULL(enqueue_publish(outbox, i, len));
+    }
+    TEST_ASSERT_EQUAL(ESP_OK, outbox_delete(outbox, 1, MQTT_MSG_TYPE_PUBLISH));
+    // neither the space in front of the first message nor the one at the end fits it alone
+    TEST_ASSERT_NOT_NULL(enqueue_publish(outbox, 8, 2 * len));
+    for (int i = 2; i <= 7; i++) {
+        check_next_queued(outbox, i, len);
+    }
+    check_next_queued(outbox, 8, 2 * len);
+    TEST_ASSERT_EQUAL(0, outbox_get_size(outbox));
+    outbox_destroy(outbox);
+}
+#endif /* MQTT_OUTBOX_RING */
+
+#if MQTT_OUTBOX_PERSISTENT
+static outbox_handle_t outbox_init_empty(void)
+{
+    outbox_handle_t outbox = outbox_init();
+    TEST_ASSERT_NOT_NULL(outbox);
+    // acknowledge whatever was left in the log by a previous run
+    outbox_delete_all_items(outbox);
+    return outbox;
+}
+
+TEST_CASE("persistent outbox recovers unacknowledged messages in order", "[outbox][persistent]")
+{
+    const int len = 64;
+    outbox_handle_t outbox = outbox_init_empty();
+    TEST_ASSERT_EQUAL(0, outbox_get_recovered_msg_id(outbox));
+    for (int i = 1; i <= 6; i++) {
+        TEST_ASSERT_NOT_NULL(enqueue_publish(outbox, i, len));
+    }
+    TEST_ASSERT_EQUAL(ESP_OK, outbox_delete(outbox, 2, MQTT_MSG_TYPE_PUBLISH));
+    TEST_ASSERT_EQUAL(ESP_OK, outbox_delete(outbox, 5, MQTT_MSG_TYPE_PUBLISH));
+    TEST_ASSERT_EQUAL(ESP_OK, outbox_set_pending(outbox, 3, TRANSMITTED));
+    // restart, the transmitted message is recovered as transmitted, to be resent as a duplicate
+    outbox_destroy(outbox);
+    outbox = outbox_init();
+    TEST_ASSERT_NOT_NULL(outbox);
+    TEST_ASSERT_EQUAL(6, outbox_get_recovered_msg_id(outbox));
+    TEST_ASSERT_EQUAL(4 * len, outbox_get_size(outbox));
+    TEST_ASSERT_NULL(outbox_get(outbox, 2));
+    TEST_ASSERT_NULL(outbox_get(outbox, 5));
+    TEST_ASSERT_EQUAL(TRANSMITTED, outbox_item_get_pending(outbox_get(outbox, 3)));
+    TEST_ASSERT_EQUAL_PTR(outbox_get(outbox, 3), outbox_dequeue(outbox, TRANSMITTED, NULL));
+    // messages enqueued after the recovery follow the recovered ones, also after another restart
+    TEST_ASSERT_NOT_NULL(enqueue_publish(outbox, 7, len));
+    TEST_ASSERT_EQUAL(ESP_OK, outbox_delete(outbox, 4, MQTT_MSG_TYPE_PUBLISH));
+    outbox_destroy(outbox);
+    outbox = outbox_init();
+    TEST_ASSERT_NOT_NULL(outbox);
+    TEST_ASSERT_EQUAL(7, outbox_get_recovered_msg_id(outbox));
+    check_next_queued(outbox, 1, len);
+    check_next_queued(outbox, 6, len);
+    check_next_queued(outbox, 7, len);
+    TEST_ASSERT_NULL(outbox_dequeue(outbox, QUEUED, NULL));
+    TEST_ASSERT_EQUAL(ESP_OK, outbox_delete_item(outbox, outbox_dequeue(outbox, TRANSMITTED, NULL)));
+    TEST_ASSERT_EQUAL(0, outbox_get_size(outbox));
+    // all messages were acknowledged, nothing is left to recover
+    outbox_destroy(outbox);
+    outbox = outbox_init();
+    TEST_ASSERT_NOT_NULL(outbox);
+    TEST_ASSERT_EQUAL(0, outbox_get_size(outbox));
+    TEST_ASSERT_EQUAL(0, outbox_get_recovered_msg_id(outbox));
+    outbox_destroy(outbox);
+}
+#endif /* MQTT_OUTBOX_PERSISTENT */
+
+void app_main(void)
+{
+    unity_run_menu();
+}